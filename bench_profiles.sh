@@ -0,0 +1,13 @@
+
+# Builds each benchmark app under every build profile and runs it in qemu, output on the serial port.
+# Usage: ./bench_profiles.sh [seconds per run]
+for app in tests/bench_context_switch.c tests/bench_spawn.c tests/bench_stdout.c
+do
+    for profile in debug release profile
+    do
+        make -s -C kernel_ken/src clean
+        make -s -C kernel_ken/src PROFILE=$profile APP=$app || exit 1
+        echo "=== $app ($profile) ==="
+        timeout ${1:-30} qemu-system-i386 -m 16M -smp 4 -kernel kernel_ken/src/kernel -display none -serial stdio
+    done
+done
@@ -0,0 +1,18 @@
+#!/bin/bash
+# Builds the microbenchmark suite ("make bench"), boots it headless in qemu and keeps the JSON lines it prints on the
+# serial port. The suite switches qemu off itself through isa-debug-exit when it's done, which qemu reports as
+# status 1; anything else means it crashed or hung.
+# Usage: ./bench_qemu.sh [output file, default bench.jsonl] [seconds before giving up, default 300]
+out=${1:-bench.jsonl}
+
+make -s -C kernel_ken/src bench || exit 1
+
+timeout ${2:-300} qemu-system-i386 -m 16M -smp 4 -kernel kernel_ken/src/kernel -display none -serial stdio \
+    -device isa-debug-exit,iobase=0xf4,iosize=0x04 | tr -d '\r' | grep '^{"bench"' > $out
+status=${PIPESTATUS[0]}
+
+cat $out
+if [ $status -ne 1 ]; then
+    echo "qemu exited with status $status instead of through isa-debug-exit" >&2
+    exit 1
+fi
@@ -40,13 +40,26 @@ char *utoa(uint32_t value, char *result, int base);
 /// \param [in] dest the location to start writing
 /// \param [in] val the value to write to each byte
 /// \param [in] len how many bytes to write
-void memset(void *dest, uint8_t val, uint32_t len);
+/// \returns dest, like C's memset()
+void *memset(void *dest, uint8_t val, uint32_t len);
 
 /// Copy len bytes from src to dest
 /// \param [in] dest the location to write to
 /// \param [in] src the location to read from
 /// \param [in] len the number of bytes to write
-void memcpy(void *dest, const void *src, uint32_t len);
+/// \returns dest, like C's. Optimised builds call memcpy() for big struct copies, and may use it.
+void *memcpy(void *dest, const void *src, uint32_t len);
+
+/// Lets memset() clear big, dword aligned blocks with non-temporal stores (SSE2's movnti), which bypass the cache.
+/// Only enable it if CPUID says the CPU has SSE2. Off until then.
+void memory_use_nontemporal(int enable);
+
+/// Copy len bytes from src to dest, which may overlap
+/// \param [in] dest the location to write to
+/// \param [in] src the location to read from
+/// \param [in] len the number of bytes to write
+/// \returns dest
+void *memmove(void *dest, const void *src, uint32_t len);
 
 /// Compare two strings based on a lexicographic comparison.
 /// \param [in] s1 first string to compare
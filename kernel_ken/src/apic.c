@@ -0,0 +1,174 @@
+// apic.c -- Local APIC and IO APIC access.
+
+#include "apic.h"
+#include "paging.h"
+#include "isr.h"
+#include "smp.h"
+
+uint32_t lapic_base = 0;
+uint32_t ioapic_base = 0;
+int ioapic_enabled = FALSE;
+int imcr_present = FALSE;
+
+// Set from the MP tables by ioapic_set_isa_route().
+static uint8_t isa_irq_routed[ISA_IRQS];
+static uint8_t isa_irq_pin[ISA_IRQS];
+static uint32_t isa_irq_flags[ISA_IRQS];
+
+extern page_directory_t *kernel_directory;
+
+void apic_map_registers()
+{
+    if(lapic_base){
+        map_mmio(lapic_base, kernel_directory);
+    }
+    if(ioapic_base){
+        map_mmio(ioapic_base, kernel_directory);
+    }
+}
+
+uint32_t lapic_read(uint32_t reg)
+{
+    return *(volatile uint32_t *)(lapic_base + reg);
+}
+
+void lapic_write(uint32_t reg, uint32_t value)
+{
+    *(volatile uint32_t *)(lapic_base + reg) = value;
+}
+
+void lapic_enable()
+{
+    // Bit 8 of the spurious interrupt vector register is the software enable bit.
+    lapic_write(LAPIC_SVR, 0x100 | APIC_SPURIOUS);
+    lapic_write(LAPIC_TPR, 0);
+}
+
+uint8_t lapic_id()
+{
+    return (uint8_t)(lapic_read(LAPIC_ID) >> 24);
+}
+
+void lapic_eoi()
+{
+    lapic_write(LAPIC_EOI, 0);
+}
+
+void lapic_send_ipi(uint8_t apic_id, uint32_t flags)
+{
+    lapic_write(LAPIC_ICR_HIGH, (uint32_t)apic_id << 24);
+    // Writing the low word is what actually sends the IPI.
+    lapic_write(LAPIC_ICR_LOW, flags);
+    while(lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING);
+}
+
+void lapic_timer_start(uint32_t mode, uint32_t count)
+{
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, APIC_TIMER | mode);
+    // Writing the initial count is what starts it counting down.
+    lapic_write(LAPIC_TIMER_INITIAL, count);
+}
+
+void lapic_timer_set_tsc_deadline(uint64_t deadline)
+{
+    lapic_write(LAPIC_LVT_TIMER, APIC_TIMER | LAPIC_TIMER_TSC_DEADLINE);
+    write_msr(MSR_TSC_DEADLINE, deadline);
+}
+
+void lapic_timer_stop()
+{
+    lapic_write(LAPIC_LVT_TIMER, APIC_TIMER | LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+}
+
+int lapic_tsc_deadline_supported()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return (ecx & (1 << 24)) != 0;
+}
+
+static uint32_t ioapic_read(uint32_t reg)
+{
+    *(volatile uint32_t *)(ioapic_base + IOAPIC_REGSEL) = reg;
+    return *(volatile uint32_t *)(ioapic_base + IOAPIC_WIN);
+}
+
+static void ioapic_write(uint32_t reg, uint32_t value)
+{
+    *(volatile uint32_t *)(ioapic_base + IOAPIC_REGSEL) = reg;
+    *(volatile uint32_t *)(ioapic_base + IOAPIC_WIN) = value;
+}
+
+void ioapic_set_isa_route(uint8_t irq, uint8_t pin, uint32_t flags)
+{
+    if(irq >= ISA_IRQS){
+        return;
+    }
+    isa_irq_routed[irq] = TRUE;
+    isa_irq_pin[irq] = pin;
+    isa_irq_flags[irq] = flags;
+}
+
+/// \returns the IO APIC pin ISA IRQ irq is wired to
+static uint8_t isa_pin(uint8_t irq)
+{
+    if(isa_irq_routed[irq]){
+        return isa_irq_pin[irq];
+    }
+    return irq == 0 ? 2 : irq;
+}
+
+void apic_init()
+{
+    if(!lapic_base){
+        return;
+    }
+    lapic_enable();
+
+    if(!ioapic_base){
+        return;
+    }
+
+    asm volatile("cli" : : : "memory");
+
+    if(imcr_present){
+        // Connect the interrupt lines to the APICs instead of straight to the BSP.
+        outb(0x22, 0x70);
+        outb(0x23, 0x01);
+    }
+
+    uint32_t destination = (uint32_t)cpus[0].apic_id << 24;
+    for(uint8_t irq = 0; irq < ISA_IRQS; irq++){
+        // IRQ2 is only the cascade from the slave PIC.
+        if(irq == 2){
+            continue;
+        }
+        uint32_t reg = IOAPIC_REDTBL + 2 * isa_pin(irq);
+        ioapic_write(reg + 1, destination);
+        ioapic_write(reg, (IRQ0 + irq) | isa_irq_flags[irq]);
+    }
+
+    // Mask everything at the PICs, so they can't send anything that would need an EOI there.
+    outb(0x21, 0xFF);
+    outb(0xA1, 0xFF);
+    ioapic_enabled = TRUE;
+
+    asm volatile("sti" : : : "memory");
+}
+
+void irq_set_masked(uint8_t irq, int masked)
+{
+    if(ioapic_enabled){
+        uint32_t reg = IOAPIC_REDTBL + 2 * isa_pin(irq);
+        uint32_t entry = ioapic_read(reg);
+        ioapic_write(reg, masked ? (entry | IOAPIC_MASKED) : (entry & ~IOAPIC_MASKED));
+        return;
+    }
+
+    uint16_t port = irq < 8 ? 0x21 : 0xA1;
+    uint8_t bit = 1 << (irq % 8);
+    uint8_t mask = inb(port);
+    outb(port, masked ? (mask | bit) : (mask & ~bit));
+}
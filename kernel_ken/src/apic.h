@@ -0,0 +1,109 @@
+// apic.h -- Local APIC and IO APIC access: IPIs, the local APIC timer, and routing the ISA IRQs through the
+//           IO APIC instead of the 8259 PICs.
+
+#ifndef APIC_H
+#define APIC_H
+
+#include "common.h"
+
+#define LAPIC_DEFAULT_BASE      0xFEE00000
+
+// Local APIC register offsets
+#define LAPIC_ID                0x020
+#define LAPIC_TPR               0x080
+#define LAPIC_EOI               0x0B0
+#define LAPIC_SVR               0x0F0
+#define LAPIC_ICR_LOW           0x300
+#define LAPIC_ICR_HIGH          0x310
+#define LAPIC_LVT_TIMER         0x320
+#define LAPIC_TIMER_INITIAL     0x380
+#define LAPIC_TIMER_CURRENT     0x390
+#define LAPIC_TIMER_DIVIDE      0x3E0
+
+// Interrupt command register bits
+#define LAPIC_ICR_INIT          0x00000500
+#define LAPIC_ICR_STARTUP       0x00000600
+#define LAPIC_ICR_PENDING       0x00001000
+#define LAPIC_ICR_ASSERT        0x00004000
+#define LAPIC_ICR_ALL_BUT_SELF  0x000C0000
+
+// Local vector table bits (for LAPIC_LVT_TIMER)
+#define LAPIC_LVT_MASKED        0x00010000
+#define LAPIC_TIMER_ONE_SHOT    0x00000000
+#define LAPIC_TIMER_PERIODIC    0x00020000
+#define LAPIC_TIMER_TSC_DEADLINE 0x00040000
+#define LAPIC_TIMER_DIVIDE_16   0x3
+
+// Writing a TSC value here arms the local APIC timer in TSC-deadline mode.
+#define MSR_TSC_DEADLINE        0x6E0
+
+// IO APIC registers, accessed indirectly through IOREGSEL/IOWIN
+#define IOAPIC_REGSEL           0x00
+#define IOAPIC_WIN              0x10
+#define IOAPIC_REDTBL           0x10
+
+// Redirection table entry bits
+#define IOAPIC_ACTIVE_LOW       0x00002000
+#define IOAPIC_LEVEL_TRIGGERED  0x00008000
+#define IOAPIC_MASKED           0x00010000
+
+#define ISA_IRQS                16
+
+/// Physical (and identity mapped) address of the local APIC registers. 0 if there isn't one.
+extern uint32_t lapic_base;
+/// Physical (and identity mapped) address of the first IO APIC. 0 if there isn't one.
+extern uint32_t ioapic_base;
+/// TRUE once apic_init() has moved the ISA IRQs from the PICs to the IO APIC.
+extern int ioapic_enabled;
+/// TRUE if the IMCR has to be switched over before the IO APIC sees any interrupts (MP spec PIC mode).
+extern int imcr_present;
+
+/// Records which IO APIC pin an ISA IRQ is wired to, from the MP tables. IRQs that are never mentioned are
+/// assumed to be identity mapped, except for the PIT (IRQ0), which is normally on pin 2.
+/// \param [in] flags IOAPIC_ACTIVE_LOW and/or IOAPIC_LEVEL_TRIGGERED
+void ioapic_set_isa_route(uint8_t irq, uint8_t pin, uint32_t flags);
+
+/// Enables this CPU's local APIC and, if there's an IO APIC, routes every ISA IRQ through it to the bootstrap
+/// processor with the same vectors as the PICs used, then masks the PICs. Without an IO APIC the PICs carry on as
+/// they are. Call after initialise_paging().
+void apic_init();
+
+/// Masks or unmasks an ISA IRQ, at the IO APIC or the PICs, whichever is delivering it.
+void irq_set_masked(uint8_t irq, int masked);
+
+/// Maps the APIC registers found by smp_detect(). Called by initialise_paging() so the mappings end up in
+/// the kernel's page tables, which every process shares.
+void apic_map_registers();
+
+uint32_t lapic_read(uint32_t reg);
+void lapic_write(uint32_t reg, uint32_t value);
+
+/// Software enables this CPU's local APIC and accepts interrupts of every priority.
+void lapic_enable();
+
+/// \returns the local APIC id of the CPU executing this
+uint8_t lapic_id();
+
+/// Signals the end of an interrupt that was delivered by the local APIC (eg. an IPI).
+void lapic_eoi();
+
+/// Sends an inter-processor interrupt and waits until the local APIC has accepted it for delivery.
+/// \param [in] apic_id the destination CPU, ignored if flags contains a destination shorthand
+/// \param [in] flags the low word of the interrupt command register: vector, delivery mode, shorthand...
+void lapic_send_ipi(uint8_t apic_id, uint32_t flags);
+
+/// Starts this CPU's local APIC timer on vector APIC_TIMER.
+/// \param [in] mode LAPIC_TIMER_PERIODIC or LAPIC_TIMER_ONE_SHOT
+/// \param [in] count timer counts (at a 16th of the bus clock) until the interrupt
+void lapic_timer_start(uint32_t mode, uint32_t count);
+
+/// Arms this CPU's local APIC timer to interrupt once the TSC reaches deadline. Only if CPUID says it's supported.
+void lapic_timer_set_tsc_deadline(uint64_t deadline);
+
+/// Stops this CPU's local APIC timer.
+void lapic_timer_stop();
+
+/// \returns TRUE if the local APIC timer supports TSC-deadline mode
+int lapic_tsc_deadline_supported();
+
+#endif
@@ -500,6 +500,56 @@ void test_sem_close1()
 
 }
 
+static void test_threads_worker(void *arg)
+{
+    int *slot = arg;
+    *slot = getpid();
+}
+
+/// Threads write to a block on the heap of the process that made them. If they didn't share its address space,
+/// the writes would never be seen by the parent (like they wouldn't after a fork).
+void test_threads1()
+{
+    const int n = 8;
+    int tids[n];
+    int *slots = alloc(sizeof(int) * n, FALSE);
+
+    for(int i = 0; i < n; i++){
+        slots[i] = 0;
+        tids[i] = thread_create(test_threads_worker, &slots[i], 0);
+        assert(tids[i] > 0);
+    }
+    for(int i = 0; i < n; i++){
+        assert(thread_join(tids[i]) == 0);
+        assert(slots[i] == tids[i]);
+    }
+
+    // Can't join yourself, or something that isn't a thread of this process.
+    assert(thread_join(getpid()) == -1);
+    assert(thread_join(1) == -1);
+
+    free(slots);
+}
+
+/// msleep() has to sleep for at least as long as it was asked to, and a periodic loop using sleep_until()
+/// shouldn't drift, however late each wakeup is.
+void test_sleep1()
+{
+    uint32_t start = monotonic_ms();
+    msleep(120);
+    assert(monotonic_ms() - start >= 120);
+
+    const uint32_t period = 30;
+    uint32_t first = monotonic_ms();
+    uint32_t deadline = first;
+    for(int i = 0; i < 10; i++){
+        deadline += period;
+        sleep_until(deadline);
+        assert((int32_t)(monotonic_ms() - deadline) >= 0);
+    }
+    assert(monotonic_ms() - first < 10 * period + TIME_QUANTUM);
+}
+
 void run_tests()
 {
 
@@ -514,6 +564,8 @@ void run_tests()
     RUNTEST(test_pc1, "Producer-Consumer #1");
     RUNTEST(test_sem1, "Sem Test #1");
     RUNTEST(test_sem_close1, "Sem Close #1");
+    RUNTEST(test_threads1, "Threads #1");
+    RUNTEST(test_sleep1, "Sleep #1");
 #ifdef STRESS_TEST
     RUNTEST(test_merging, "Merge Sort #1");
 #endif
@@ -522,5 +574,9 @@ void run_tests()
 
     printf("All tests done!\n");
 
+    // Where the tests spent their time in the kernel. The producer-consumer tests make a lot of write() calls to a
+    // full pipe, which show up as write_impl's zeros.
+    syscall_report(0, 10);
+
 }
 
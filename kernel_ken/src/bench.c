@@ -0,0 +1,47 @@
+// bench.c -- Kernel side of the microbenchmark suite.
+
+#include "bench.h"
+#include "algorithm.h"
+#include "kheap.h"
+#include "serial.h"
+
+#define KMALLOC_SLOTS 64
+
+int bench_kmalloc_impl(uint32_t ops, uint32_t max_size, uint64_t *cycles)
+{
+    if(!cycles || max_size == 0 || max_size > BENCH_KMALLOC_MAX_SIZE || ops > BENCH_KMALLOC_MAX_OPS){
+        return -1;
+    }
+
+    void *slots[KMALLOC_SLOTS];
+    memset(slots, 0, sizeof(slots));
+
+    // Same generator as rand_internal_old() in autotest.c, so every run asks for the same sizes in the same order.
+    uint32_t seed = 1;
+    uint64_t start = read_tsc();
+    for(uint32_t i = 0; i < ops; i++){
+        seed = seed * 214013 + 2531011;
+        uint32_t slot = (seed >> 16) % KMALLOC_SLOTS;
+        if(slots[slot]){
+            kfree(slots[slot]);
+            slots[slot] = NULL;
+        } else {
+            slots[slot] = kmalloc(1 + (seed >> 8) % max_size);
+        }
+    }
+    *cycles = read_tsc() - start;
+
+    for(uint32_t i = 0; i < KMALLOC_SLOTS; i++){
+        if(slots[i]){
+            kfree(slots[i]);
+        }
+    }
+    return 0;
+}
+
+int qemu_exit_impl(uint32_t code)
+{
+    serial_drain();
+    outb(QEMU_DEBUG_EXIT_PORT, (uint8_t)code);
+    return -1;
+}
@@ -0,0 +1,28 @@
+// bench.h -- Kernel side of the microbenchmark suite (tests/bench_suite.c): the benchmarks that have to run in the
+//            kernel, and a way to switch QEMU off once the results have been printed.
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "common.h"
+
+// Where bench_qemu.sh puts QEMU's isa-debug-exit device.
+#define QEMU_DEBUG_EXIT_PORT 0xF4
+
+// The most bench_kmalloc_impl() will do, which is what the suite asks for. The whole run holds the kernel lock, and
+// 64 blocks of the largest size have to fit on the kernel heap.
+#define BENCH_KMALLOC_MAX_OPS   20000
+#define BENCH_KMALLOC_MAX_SIZE  4096
+
+/// Allocates and frees blocks of between 1 and max_size bytes on the kernel heap, ops times in all, keeping up to
+/// 64 of them alive at once so that the heap has holes to search and merge.
+/// \param [out] cycles TSC cycles the ops took
+/// \returns 0 on success, -1 if an argument is invalid or above BENCH_KMALLOC_MAX_OPS/BENCH_KMALLOC_MAX_SIZE
+int bench_kmalloc_impl(uint32_t ops, uint32_t max_size, uint64_t *cycles);
+
+/// Waits for the serial port to send everything it has queued, then exits QEMU through its isa-debug-exit device.
+/// QEMU's exit status is (code << 1) | 1.
+/// \returns -1 if there's no isa-debug-exit device, in which case nothing happens
+int qemu_exit_impl(uint32_t code);
+
+#endif
@@ -0,0 +1,148 @@
+// clock.c -- Picks and calibrates the clocksource behind clock_monotonic_ns().
+
+#include "clock.h"
+#include "timer.h"
+
+// About 10ms of PIT input clock cycles, which is how long TSC calibration takes.
+#define CALIBRATE_COUNT 11932
+// Gives up on the PIT if it hasn't finished counting after this many polls.
+#define CALIBRATE_MAX_POLLS 10000000
+
+typedef struct
+{
+    const char *name;
+    uint64_t (*read_ns)();
+} clocksource_t;
+
+// ns = tsc_base_ns + (tsc - tsc_base) * tsc_mult, with tsc_mult in 32.32 fixed point.
+static uint64_t tsc_base = 0;
+static uint64_t tsc_base_ns = 0;
+static uint64_t tsc_mult = 0;
+// The other way around: TSC cycles per ns, also 32.32 fixed point.
+static uint64_t tsc_per_ns = 0;
+
+static uint64_t last_ns = 0;
+
+/// \returns a * b >> 32, for b a 32.32 fixed point number, without losing the top of the 96 bit product
+static uint64_t mul_fp32(uint64_t a, uint64_t b)
+{
+    uint32_t a_hi = (uint32_t)(a >> 32), a_lo = (uint32_t)a;
+    uint32_t b_hi = (uint32_t)(b >> 32), b_lo = (uint32_t)b;
+    return a * b_hi + (uint64_t)a_hi * b_lo + (((uint64_t)a_lo * b_lo) >> 32);
+}
+
+static uint64_t tsc_read_ns()
+{
+    return tsc_base_ns + mul_fp32(read_tsc() - tsc_base, tsc_mult);
+}
+
+static clocksource_t pit_clocksource = {"pit", timer_monotonic_ns};
+static clocksource_t tsc_clocksource = {"tsc", tsc_read_ns};
+static clocksource_t *clocksource = &pit_clocksource;
+
+/// \returns TRUE if CPUID says there's a TSC
+static int tsc_present()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return (edx & (1 << 4)) != 0;
+}
+
+/// Counts how many TSC cycles go by while PIT channel 2 counts down from CALIBRATE_COUNT. Channel 2 doesn't
+/// interrupt anything (it's meant for the speaker), so this works however channel 0 is set up.
+/// \returns the number of cycles, or 0 if the PIT never finished
+static uint64_t tsc_calibrate()
+{
+    // Gate channel 2 on, but keep its output away from the speaker.
+    uint8_t port61 = inb(0x61);
+    outb(0x61, (port61 & ~0x02) | 0x01);
+
+    // Channel 2, lobyte/hibyte, mode 0 (output goes high on terminal count).
+    outb(0x43, 0xB0);
+    outb(0x42, CALIBRATE_COUNT & 0xFF);
+    outb(0x42, (CALIBRATE_COUNT >> 8) & 0xFF);
+
+    uint64_t start = read_tsc();
+    uint32_t polls = 0;
+    while(!(inb(0x61) & 0x20)){
+        if(++polls == CALIBRATE_MAX_POLLS){
+            outb(0x61, port61);
+            return 0;
+        }
+    }
+    uint64_t end = read_tsc();
+
+    outb(0x61, port61);
+    return end - start;
+}
+
+void clock_init()
+{
+    if(!tsc_present()){
+        return;
+    }
+
+    uint64_t cycles = tsc_calibrate();
+    if(cycles == 0 || cycles >> 32){
+        return;
+    }
+
+    // tsc_mult = window_ns / cycles, done as two 32 bit long division steps so it doesn't need libgcc.
+    uint32_t window_ns = (uint32_t)(((uint64_t)CALIBRATE_COUNT * PIT_NS_PER_COUNT_FP) >> 32);
+    uint32_t whole = window_ns / (uint32_t)cycles;
+    uint32_t remainder = window_ns % (uint32_t)cycles;
+    tsc_mult = ((uint64_t)whole << 32) | udiv64((uint64_t)remainder << 32, (uint32_t)cycles);
+    whole = (uint32_t)cycles / window_ns;
+    remainder = (uint32_t)cycles % window_ns;
+    tsc_per_ns = ((uint64_t)whole << 32) | udiv64((uint64_t)remainder << 32, window_ns);
+
+    // Carry on from wherever the PIT clock has got to, so the switch doesn't make time jump.
+    tsc_base_ns = clock_monotonic_ns();
+    tsc_base = read_tsc();
+    clocksource = &tsc_clocksource;
+}
+
+uint64_t clock_monotonic_ns()
+{
+    uint64_t now = clocksource->read_ns();
+    // The TSCs of different CPUs could be slightly out of step. Never let the clock go backwards because of it.
+    if(now < last_ns){
+        return last_ns;
+    }
+    last_ns = now;
+    return now;
+}
+
+int clock_uses_tsc()
+{
+    return clocksource == &tsc_clocksource;
+}
+
+uint64_t clock_ns_to_tsc(uint64_t ns)
+{
+    if(ns < tsc_base_ns){
+        return tsc_base;
+    }
+    return tsc_base + mul_fp32(ns - tsc_base_ns, tsc_per_ns);
+}
+
+uint64_t clock_tsc_to_ns(uint64_t cycles)
+{
+    return mul_fp32(cycles, tsc_mult);
+}
+
+const char *clock_source_name()
+{
+    return clocksource->name;
+}
+
+int clock_gettime_impl(int clock_id, timespec_t *ts)
+{
+    if(clock_id != CLOCK_MONOTONIC || !ts){
+        return -1;
+    }
+    uint64_t now = clock_monotonic_ns();
+    ts->tv_sec = udiv64(now, NS_PER_SECOND);
+    ts->tv_nsec = (uint32_t)(now - (uint64_t)ts->tv_sec * NS_PER_SECOND);
+    return 0;
+}
@@ -0,0 +1,40 @@
+// clock.h -- The kernel's time base. Everything that measures time (sleeps, time slices, idle residency,
+//            benchmarks) reads clock_monotonic_ns(), so all of it agrees.
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include "common.h"
+
+#define CLOCK_MONOTONIC 1
+
+typedef struct
+{
+    uint32_t tv_sec;
+    uint32_t tv_nsec;
+} timespec_t;
+
+/// Calibrates the TSC against PIT channel 2 and, if that works, makes it the clocksource. Otherwise the clock keeps
+/// counting PIT cycles (timer_monotonic_ns()), which only moves forward on timer interrupts. Call after init_timer().
+void clock_init();
+
+/// \returns nanoseconds since init_timer(). This never goes backwards.
+uint64_t clock_monotonic_ns();
+
+/// \returns TRUE if clock_monotonic_ns() is read from the TSC
+int clock_uses_tsc();
+
+/// \returns the TSC value at which clock_monotonic_ns() will read ns. Only meaningful if clock_uses_tsc().
+uint64_t clock_ns_to_tsc(uint64_t ns);
+
+/// \returns how long cycles TSC cycles take in nanoseconds. Only meaningful if clock_uses_tsc().
+uint64_t clock_tsc_to_ns(uint64_t cycles);
+
+/// \returns "tsc" or "pit", depending on what clock_monotonic_ns() is read from
+const char *clock_source_name();
+
+/// Fills in *ts with the time on a clock. Only CLOCK_MONOTONIC is supported.
+/// \returns 0 on success, -1 if clock_id or ts is invalid
+int clock_gettime_impl(int clock_id, timespec_t *ts);
+
+#endif
@@ -1,13 +1,13 @@
 #include "common.h"
 #include "monitor.h"
+#include "serial.h"
 #include "ulib.h"
 #include "klib.h"
 #include "syscall.h"
+#include "kernel_ken.h"
 
 
 
-extern uint32_t read_eip();
-
 // Write a byte out to the specified port.
 void outb(uint16_t port, uint8_t value)
 {
@@ -28,11 +28,56 @@ uint16_t inw(uint16_t port)
     return ret;
 }
 
+uint64_t read_tsc()
+{
+    uint32_t low, high;
+    asm volatile("rdtsc" : "=a" (low), "=d" (high));
+    return ((uint64_t)high << 32) | low;
+}
+
+void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+{
+    asm volatile("cpuid" : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx) : "a" (leaf), "c" (0));
+}
+
+void write_msr(uint32_t msr, uint64_t value)
+{
+    asm volatile("wrmsr" : : "c" (msr), "a" ((uint32_t)value), "d" ((uint32_t)(value >> 32)));
+}
+
+uint32_t udiv64(uint64_t n, uint32_t d)
+{
+    uint32_t high = (uint32_t)(n >> 32);
+    uint32_t low = (uint32_t)n;
+    // divl faults if the quotient doesn't fit in eax.
+    ASSERT(high < d);
+
+    uint32_t quotient, remainder;
+    asm("divl %4" : "=a" (quotient), "=d" (remainder) : "a" (low), "d" (high), "rm" (d));
+    return quotient;
+}
+
+uint32_t irq_save()
+{
+    uint32_t flags;
+    asm volatile("pushf; pop %0; cli" : "=r" (flags) : : "memory");
+    return flags;
+}
+
+void irq_restore(uint32_t flags)
+{
+    if(flags & EFLAGS_IF){
+        asm volatile("sti" : : : "memory");
+    }
+}
+
 extern void panic(const char *message, const char *file, uint32_t line)
 {
     // We encountered a massive problem and have to stop.
-    asm volatile("cli"); // Disable interrupts.
+    asm volatile("cli" : : : "memory"); // Disable interrupts.
 
+    // Take the screen back from any process that has it.
+    monitor_resume();
     monitor_write("PANIC(");
     monitor_write(message);
     monitor_write(") at ");
@@ -40,6 +85,9 @@ extern void panic(const char *message, const char *file, uint32_t line)
     monitor_write(":");
     monitor_write_dec(line);
     monitor_write("\n");
+    // There won't be another tick to show it, or interrupts to send it.
+    monitor_flush();
+    serial_drain();
     // Halt by going into an infinite loop.
     for(;;);
 }
@@ -47,8 +95,10 @@ extern void panic(const char *message, const char *file, uint32_t line)
 extern void panic_assert(const char *file, uint32_t line, const char *desc)
 {
     // An assertion failed, and we have to panic.
-    asm volatile("cli"); // Disable interrupts.
+    asm volatile("cli" : : : "memory"); // Disable interrupts.
 
+    // Take the screen back from any process that has it.
+    monitor_resume();
     monitor_write("ASSERTION-FAILED(");
     monitor_write(desc);
     monitor_write(") at ");
@@ -56,6 +106,9 @@ extern void panic_assert(const char *file, uint32_t line, const char *desc)
     monitor_write(":");
     monitor_write_dec(line);
     monitor_write("\n");
+    // There won't be another tick to show it, or interrupts to send it.
+    monitor_flush();
+    serial_drain();
     // Halt by going into an infinite loop.
     for(;;);
 }
@@ -65,5 +118,5 @@ extern void user_assert(const char *file, uint32_t line, const char *desc)
     // An assertion failed, kill the user process, I suppose.
     printf("USER ASSERTION FAILED (%s) at %s: %u \n", desc, file, line);
 
-    syscall_exit_impl();
+    exit();
 }
@@ -28,6 +28,8 @@
 #define UHEAP_START             0x30000000
 #define UHEAP_INITIAL_SIZE      0xA000
 #define UHEAP_MAX               0x9FFFFFFC
+// One page, mapped in every process for its buffered stdout (see print.h).
+#define USTDOUT_START           0xA0400000
 
 #define KHEAP_START             0xC0000000
 #define KHEAP_INITIAL_SIZE      0xA000
@@ -37,14 +39,23 @@
 #define HEAP_MAGIC              0x123890AB
 #define HEAP_MIN_SIZE           0xA000
 #define KERNEL_STACK_SIZE       0x10000
+#define THREAD_STACK_SIZE       0x4000
+#define THREAD_STACK_MAX        0x100000
 
 #define TIME_SLICE_PER_AGE      40
 #define TIME_QUANTUM            50
-#define TICKS_PER_SECOND        (1000 / TIME_QUANTUM)
+#define TICKS_PER_SECOND        1000
+#define NS_PER_MS               1000000
+#define NS_PER_SECOND           1000000000
 #define PRIORITY_MIN            10
 #define PRIORITY_NORMAL         5
 #define PRIORITY_MAX            1
 
+#define EFLAGS_IF               0x200
+
+#define MAX_CPUS                8
+#define AP_TRAMPOLINE_ADDR      0x8000
+
 #define COLOUR_BLACK 0
 #define COLOUR_BLUE 1
 #define COLOUR_GREEN 2
@@ -67,6 +78,19 @@
 void outb(uint16_t port, uint8_t value);
 uint8_t inb(uint16_t port);
 uint16_t inw(uint16_t port);
+/// Reads the CPU's time stamp counter. This works from user mode too.
+uint64_t read_tsc();
+/// Runs CPUID for the given leaf.
+void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx);
+/// Writes a model specific register.
+void write_msr(uint32_t msr, uint64_t value);
+/// Divides a 64 bit number by a 32 bit one, without needing libgcc. The quotient has to fit in 32 bits.
+uint32_t udiv64(uint64_t n, uint32_t d);
+/// Disables interrupts.
+/// \returns the previous EFLAGS, to hand to irq_restore()
+uint32_t irq_save();
+/// Enables interrupts again if they were enabled before the matching irq_save().
+void irq_restore(uint32_t flags);
 
 #define PANIC(msg) panic(msg, __FILE__, __LINE__);
 /// Use this macro in kernel mode!
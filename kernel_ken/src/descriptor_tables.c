@@ -21,11 +21,11 @@ static void gdt_set_gate(int32_t,uint32_t,uint32_t,uint8_t,uint8_t);
 static void idt_set_gate(uint8_t,uint32_t,uint16_t,uint8_t);
 static void write_tss(int32_t,uint16_t,uint32_t);
 
-gdt_entry_t gdt_entries[6];
+gdt_entry_t gdt_entries[GDT_TSS_BASE + MAX_CPUS];
 gdt_ptr_t   gdt_ptr;
 idt_entry_t idt_entries[256];
 idt_ptr_t   idt_ptr;
-tss_entry_t tss_entry;
+tss_entry_t tss_entries[MAX_CPUS];
 
 // Extern the ISR handler array so we can nullify them on startup.
 extern isr_t interrupt_handlers[];
@@ -45,7 +45,7 @@ void init_descriptor_tables()
 
 static void init_gdt()
 {
-    gdt_ptr.limit = (sizeof(gdt_entry_t) * 6) - 1;
+    gdt_ptr.limit = (sizeof(gdt_entry_t) * (GDT_TSS_BASE + MAX_CPUS)) - 1;
     gdt_ptr.base  = (uint32_t)&gdt_entries;
 
     gdt_set_gate(0, 0, 0, 0, 0);                // Null segment
@@ -53,12 +53,30 @@ static void init_gdt()
     gdt_set_gate(2, 0, 0xFFFFFFFF, 0x92, 0xCF); // Data segment
     gdt_set_gate(3, 0, 0xFFFFFFFF, 0xFA, 0xCF); // User mode code segment
     gdt_set_gate(4, 0, 0xFFFFFFFF, 0xF2, 0xCF); // User mode data segment
-    write_tss(5, 0x10, 0x0);
+    for(int i = 0; i < MAX_CPUS; i++){
+        write_tss(i, 0x10, 0x0);
+    }
 
     gdt_flush((uint32_t)&gdt_ptr);
     tss_flush();
 }
 
+void init_ap_descriptor_tables(uint32_t cpu)
+{
+    gdt_flush((uint32_t)&gdt_ptr);
+    idt_flush((uint32_t)&idt_ptr);
+    // Same as tss_flush(), but with this CPU's TSS descriptor (RPL 3, like the BSP's).
+    uint16_t selector = (uint16_t)(((GDT_TSS_BASE + cpu) * sizeof(gdt_entry_t)) | 0x3);
+    asm volatile("ltr %0" : : "r" (selector));
+}
+
+uint32_t get_cpu_index()
+{
+    uint16_t selector;
+    asm volatile("str %0" : "=r" (selector));
+    return (selector / sizeof(gdt_entry_t)) - GDT_TSS_BASE;
+}
+
 // Set the value of one GDT entry.
 static void gdt_set_gate(int32_t num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran)
 {
@@ -141,6 +159,9 @@ static void init_idt()
     idt_set_gate(46, (uint32_t)irq14, 0x08, 0x8E);
     idt_set_gate(47, (uint32_t)irq15, 0x08, 0x8E);
     idt_set_gate(128, (uint32_t)isr128, 0x08, 0x8E);
+    idt_set_gate(APIC_TIMER, (uint32_t)irq_apic_timer, 0x08, 0x8E);
+    idt_set_gate(IPI_RESCHEDULE, (uint32_t)irq_ipi_reschedule, 0x08, 0x8E);
+    idt_set_gate(APIC_SPURIOUS, (uint32_t)irq_apic_spurious, 0x08, 0x8E);
 
     idt_flush((uint32_t)&idt_ptr);
 }
@@ -156,21 +177,23 @@ static void idt_set_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags
 }
 
 
-// Initialise our task state segment structure.
-static void write_tss(int32_t num, uint16_t ss0, uint32_t esp0)
+// Initialise the task state segment structure of one CPU.
+static void write_tss(int32_t cpu, uint16_t ss0, uint32_t esp0)
 {
+    tss_entry_t *tss = &tss_entries[cpu];
+
     // Firstly, let's compute the base and limit of our entry into the GDT.
-    uint32_t base = (uint32_t) &tss_entry;
-    uint32_t limit = base + sizeof(tss_entry);
+    uint32_t base = (uint32_t) tss;
+    uint32_t limit = base + sizeof(*tss);
 
     // Now, add our TSS descriptor's address to the GDT.
-    gdt_set_gate(num, base, limit, 0xE9, 0x00);
+    gdt_set_gate(GDT_TSS_BASE + cpu, base, limit, 0xE9, 0x00);
 
     // Ensure the descriptor is initially zero.
-    memset(&tss_entry, 0, sizeof(tss_entry));
+    memset(tss, 0, sizeof(*tss));
 
-    tss_entry.ss0  = ss0;  // Set the kernel stack segment.
-    tss_entry.esp0 = esp0; // Set the kernel stack pointer.
+    tss->ss0  = ss0;  // Set the kernel stack segment.
+    tss->esp0 = esp0; // Set the kernel stack pointer.
 
     // Here we set the cs, ss, ds, es, fs and gs entries in the TSS. These specify what
     // segments should be loaded when the processor switches to kernel mode. Therefore
@@ -178,13 +201,13 @@ static void write_tss(int32_t num, uint16_t ss0, uint32_t esp0)
     // but with the last two bits set, making 0x0b and 0x13. The setting of these bits
     // sets the RPL (requested privilege level) to 3, meaning that this TSS can be used
     // to switch to kernel mode from ring 3.
-    tss_entry.cs   = 0x0b;
-    tss_entry.ss = tss_entry.ds = tss_entry.es = tss_entry.fs = tss_entry.gs = 0x13;
+    tss->cs   = 0x0b;
+    tss->ss = tss->ds = tss->es = tss->fs = tss->gs = 0x13;
 }
 
 void set_kernel_stack(uint32_t stack)
 {
-    tss_entry.esp0 = stack;
+    tss_entries[get_cpu_index()].esp0 = stack;
 }
 
 
@@ -10,9 +10,19 @@
 
 #include "common.h"
 
+// Each CPU has its own TSS, so the GDT has one TSS descriptor per CPU starting at this index.
+#define GDT_TSS_BASE 5
+
 // Initialisation function is publicly accessible.
 void init_descriptor_tables();
 
+/// Loads the (already initialised) GDT and IDT on an application processor, along with that CPU's TSS.
+/// \param [in] cpu the index of the CPU executing this
+void init_ap_descriptor_tables(uint32_t cpu);
+
+/// \returns the index of the CPU executing this, based on which TSS it has loaded
+uint32_t get_cpu_index();
+
 // This structure contains the value of one GDT entry.
 // We use the attribute 'packed' to tell GCC not to change
 // any of the alignment in the structure.
@@ -111,6 +121,9 @@ extern void irq13();
 extern void irq14();
 extern void irq15();
 extern void isr128();
+extern void irq_apic_timer();
+extern void irq_ipi_reschedule();
+extern void irq_apic_spurious();
 
 // A struct describing a Task State Segment.
 struct tss_entry_struct
@@ -146,7 +159,7 @@ struct tss_entry_struct
 
 typedef struct tss_entry_struct tss_entry_t;
 
-/// Uses the provided memory address as the kernel's stack, for the purposes of executing things like system calls.
+/// Uses the provided memory address as the current CPU's kernel stack, for the purposes of executing things like system calls.
 /// \param stack -- address to use for the stack. (Make sure the page below this is able to be overwritten
 /// because the stack grows downwards)
 void set_kernel_stack(uint32_t stack);
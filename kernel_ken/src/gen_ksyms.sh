@@ -0,0 +1,50 @@
+#!/bin/sh
+# gen_ksyms.sh -- Turns "nm -n kernel" on stdin into ksyms_table.c, the table ksyms.h describes. Only functions (nm
+# types t and T) go in it. With nothing on stdin, the table is empty, which is what the kernel is first linked with.
+#
+# Everything in the table is writable data rather than const or string literals, so that it goes in .data. That's
+# laid out after all of the code, so linking the table in doesn't move any function.
+awk '
+{ address[n] = $1; type[n] = $2; name[n] = $3; n++ }
+END {
+    print "// Generated by gen_ksyms.sh from the linked kernel. Don'"'"'t edit, and don'"'"'t commit."
+    print "#include \"ksyms.h\""
+    print ""
+
+    count = 0
+    for(i = 0; i < n; i++){
+        if(type[i] == "t" || type[i] == "T"){
+            text[count++] = i
+        }
+    }
+    # The last function ends wherever the next symbol is.
+    end = "0"
+    if(count > 0){
+        last = text[count - 1]
+        end = address[last]
+        for(i = last + 1; i < n; i++){
+            if(address[i] != address[last]){
+                end = address[i]
+                break
+            }
+        }
+    }
+
+    print "ksym_t ksyms[] ="
+    print "{"
+    offset = 0
+    for(i = 0; i < count; i++){
+        printf "    {0x%s, %d},\n", address[text[i]], offset
+        offset += length(name[text[i]]) + 1
+    }
+    printf "    {0x%s, 0}\n", end
+    print "};"
+    print ""
+    printf "uint32_t ksyms_count = %d;\n", count
+    print ""
+    print "char ksym_names[] ="
+    for(i = 0; i < count; i++){
+        printf "    \"%s\" \"\\0\"\n", name[text[i]]
+    }
+    print "    \"\";"
+}'
@@ -2,6 +2,8 @@
 #include "monitor.h"
 #include "kheap.h"
 #include "klib.h"
+#include "smp.h"
+#include "trace.h"
 
 
 /// Expands the heap by the specified number of bytes
@@ -14,7 +16,7 @@ void heap_expand(heap_t *heap, uint32_t increase)
     // This probably shouldn't cause kernel panic, but I'm not going to fix it unless it becomes a real issue
 
     if(heap->end_address + increase > heap->max_address) {
-        kprintf("Your process is trying to allocate too much memory. \n");
+        klog(KLOG_WARN, "Your process is trying to allocate too much memory. \n");
         PANIC("User Process allocated too much memory");
     }
 
@@ -32,6 +34,7 @@ void heap_expand(heap_t *heap, uint32_t increase)
         alloc_frame(get_page(i, TRUE, heap->directory), heap->supervisor, !heap->readonly);
     }
 
+    TRACE(TRACE_HEAP_EXPAND, heap->start_address, heap->end_address, new_max);
     heap->end_address = new_max;
     assert(heap->end_address % PAGE_SIZE == 0);
 
@@ -46,6 +49,13 @@ void heap_contract(heap_t *heap, uint32_t decrease)
     // Here be a check for numerical underflow
     ASSERT(decrease <= (heap->end_address - heap->start_address));
 
+    // Sibling threads running in user mode on other CPUs can keep these pages in their TLBs, and nothing makes them
+    // flush before the frames are handed out to another process. So a shared user heap stays the size it is until
+    // it's down to one thread.
+    if(heap != kernel_heap && heap->directory->refcount > 1){
+        return;
+    }
+
     // Page align if needed.
     uint32_t new_size = (heap->end_address - heap->start_address) - decrease;
     if(new_size < HEAP_MIN_SIZE) {
@@ -63,7 +73,28 @@ void heap_contract(heap_t *heap, uint32_t decrease)
     for(i = new_max; i <= heap->end_address; i += PAGE_SIZE) {
         free_frame(get_page(i, FALSE, heap->directory));
     }
+    TRACE(TRACE_HEAP_CONTRACT, heap->start_address, heap->end_address, new_max);
     heap->end_address = new_max;
+
+    // Every CPU shares the kernel heap's page tables, and any of them could still have these pages cached.
+    if(heap == kernel_heap){
+        tlb_shootdown();
+    }
+}
+
+/// Works out how far into a hole a page aligned block has to start, so that the memory after its header is page
+/// aligned. The space skipped becomes a hole of its own, so it's either 0 or big enough for a header and a footer.
+static uint32_t heap_align_padding(header_t *hole)
+{
+    uint32_t misalignment = ((uint32_t)hole + sizeof(header_t)) % PAGE_SIZE;
+    if(misalignment == 0){
+        return 0;
+    }
+    uint32_t padding = PAGE_SIZE - misalignment;
+    if(padding <= sizeof(header_t) + sizeof(footer_t)){
+        padding += PAGE_SIZE;
+    }
+    return padding;
 }
 
 /// Finds the smallest memory hole that can fit [size] bytes.
@@ -77,16 +108,11 @@ int32_t heap_best_fit(heap_t *heap, uint32_t size, uint8_t page_aligned)
     for(uint32_t i = 0; i < heap->index->size; i++){
         header_t *header = hindex_at(heap->index, i);
 
-        if(page_aligned && header->size >= size) {
+        if(page_aligned) {
             // Things get weird because the header has to come before the page alignment in this setup.
-            uint32_t space_remaining = 0;
-            // ... so it becomes necessary to include header_t size in the check for page alignment
-            if(((uint32_t)header + sizeof(header_t)) % PAGE_SIZE != 0){
-                space_remaining = PAGE_SIZE - (((uint32_t)header + sizeof(header_t)) % PAGE_SIZE);
-            }
+            uint32_t padding = heap_align_padding(header);
             // Check if the size (after aligning the memory block) is still enough
-            uint32_t remaining_size = header->size - space_remaining;
-            if(remaining_size >= size){
+            if(header->size >= padding && header->size - padding >= size){
                 // If so: we're done.
                 return i;
             }
@@ -98,6 +124,20 @@ int32_t heap_best_fit(heap_t *heap, uint32_t size, uint8_t page_aligned)
     return -1;
 }
 
+/// Removes a hole from the index, wherever its size has put it.
+static void heap_index_remove(heap_t *heap, header_t *hole)
+{
+    uint32_t i;
+    for(i = 0; i < heap->index->size; i++){
+        if(hindex_at(heap->index, i) == (void*)hole){
+            break;
+        }
+    }
+    // If this fails, it indicates an error in the algorithm (missed a footer/header).
+    ASSERT(i != heap->index->size);
+    hindex_erase(heap->index, i);
+}
+
 int8_t header_comparator(const void *a, const void *b)
 {
     const header_t *h_a = a;
@@ -193,10 +233,11 @@ void *heap_alloc(heap_t *heap, uint32_t size, uint8_t page_aligned)
 
             ASSERT(final_footer->magic == HEAP_MAGIC);
             ASSERT(final_header->magic == HEAP_MAGIC);
-            ASSERT(final_header->is_hole);
-
             if(final_header->is_hole){
+                // The index is sorted by size, so the hole has to be taken out while it grows.
+                heap_index_remove(heap, final_header);
                 final_header->size += (new_size - old_size);
+                hindex_insert(heap->index, final_header);
 
                 footer_t *added_footer = (footer_t *)(heap->end_address - sizeof(footer_t));
                 added_footer->header = final_header;
@@ -232,13 +273,8 @@ void *heap_alloc(heap_t *heap, uint32_t size, uint8_t page_aligned)
     header_t *hole = (header_t*) hindex_at(heap->index, block_index);
     uint32_t hf_size = sizeof(footer_t) + sizeof(header_t);
 
-    ASSERT(hole->size >= full_size);
-    // Check if there's enough room to split the block
-    if(hole->size - full_size <= hf_size){
-        // Not enough. Just add the <= 20 bytes to the back of whatever the user requested.
-        full_size = hole->size;
-        size = full_size - hf_size;
-    }
+    uint32_t padding = page_aligned ? heap_align_padding(hole) : 0;
+    ASSERT(hole->size >= padding + full_size);
     hindex_erase(heap->index, block_index);
 
     uint32_t block_start = (uint32_t)hole;
@@ -246,29 +282,25 @@ void *heap_alloc(heap_t *heap, uint32_t size, uint8_t page_aligned)
 
     // If page_aligned is TRUE, we might've fragmented the block into 3 pieces.
     // Thus, we have to check for that.
-    if(page_aligned && ((uint32_t)hole + sizeof(header_t)) % PAGE_SIZE != 0) {
-        uint32_t space_left = PAGE_SIZE - (((uint32_t)hole + sizeof(header_t)) % PAGE_SIZE);
-
-        if(space_left > hf_size){
-            // Write a hole before the block, in this particular case
-            // (we may have to triple split the block depending on what's at the end).
-
-            block_start = (uint32_t)hole + space_left;
-            // Simple: just rewrite the header/footer.
-            header_t *hole_before_header = hole;
-            hole_before_header->size = space_left;
-            hole_before_header->magic = HEAP_MAGIC;
-            hole_before_header->is_hole = TRUE;
-            footer_t *hole_before_footer = (footer_t*)((uint32_t)hole + space_left - sizeof(footer_t));
-            hole_before_footer->magic = HEAP_MAGIC;
-            hole_before_footer->header = hole_before_header;
-            // and of course, put it in the index.
-            ASSERT(hole_before_header->size > 20);
-            ASSERT(hole_before_header->size <= 1000000000);
-
-            hindex_insert(heap->index, hole_before_header);
-            remaining_size -= hole_before_header->size;
-        }
+    if(padding != 0) {
+        // Write a hole before the block, in this particular case
+        // (we may have to triple split the block depending on what's at the end).
+
+        block_start = (uint32_t)hole + padding;
+        // Simple: just rewrite the header/footer.
+        header_t *hole_before_header = hole;
+        hole_before_header->size = padding;
+        hole_before_header->magic = HEAP_MAGIC;
+        hole_before_header->is_hole = TRUE;
+        footer_t *hole_before_footer = (footer_t*)((uint32_t)hole + padding - sizeof(footer_t));
+        hole_before_footer->magic = HEAP_MAGIC;
+        hole_before_footer->header = hole_before_header;
+        // and of course, put it in the index.
+        ASSERT(hole_before_header->size > 20);
+        ASSERT(hole_before_header->size <= 1000000000);
+
+        hindex_insert(heap->index, hole_before_header);
+        remaining_size -= hole_before_header->size;
     }
 
     // If there's a trivial amount of space left over, just make the block given to the user a tiny bit bigger
@@ -342,15 +374,7 @@ void heap_free(heap_t *heap, void *p)
             header = footer->header;
 
             // It is necessary to remove this from the index, and maybe replace it later, because its size changed
-            uint32_t i;
-            for(i = 0; i < heap->index->size; i++){
-                if(hindex_at(heap->index, i) == (void*)header){
-                    break;
-                }
-            }
-            // If this fails, it indicates an error in the algorithm (missed a footer/header).
-            ASSERT(i != heap->index->size);
-            hindex_erase(heap->index, i);
+            heap_index_remove(heap, header);
         }
     }
 
@@ -364,15 +388,7 @@ void heap_free(heap_t *heap, void *p)
             footer->header = header;
 
             // It is necessary to remove this from the index, and maybe replace it later, because its size changed
-            uint32_t i;
-            for(i = 0; i < heap->index->size; i++){
-                if(hindex_at(heap->index, i) == (void*)right_header){
-                    break;
-                }
-            }
-            // If this fails, it indicates an error in the algorithm (missed a footer/header).
-            ASSERT(i != heap->index->size);
-            hindex_erase(heap->index, i);
+            heap_index_remove(heap, right_header);
         }
     }
 
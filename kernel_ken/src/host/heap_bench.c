@@ -0,0 +1,198 @@
+// heap_bench.c -- Measures heap_alloc()/heap_free() throughput on the development machine, for a few size
+//                 distributions and numbers of live blocks.
+//
+// Build and run it from kernel_ken/src with "make heap_bench && ./heap_bench [--json]". It's linked against the real
+// heap.c and heapindex.c, with host/kernel_shim.c standing in for paging, so an allocator change can be measured in
+// seconds instead of a QEMU boot. Like Google Benchmark, each benchmark runs for more and more iterations until it
+// takes at least MIN_TIME_NS, and reports the time per operation (an alloc or a free), both wall clock and CPU.
+// --json prints one line per benchmark instead, in the same form as the kernel's own suite (tests/bench_suite.c).
+
+#include "kernel_shim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define MIN_TIME_NS 500000000ull
+#define MAX_ITERATIONS (1u << 26)
+// Sizes and slots are drawn from tables this big, so that the random number generator isn't what's being timed.
+#define TABLE_SIZE 4096
+#define MAX_LIVE 1024
+
+typedef struct
+{
+    const char *name;
+    /// Draws one allocation size
+    uint32_t (*size)();
+    /// 1 in this many allocations are page aligned, or 0 for none
+    uint32_t aligned_one_in;
+} distribution_t;
+
+static uint32_t seed = 1;
+
+/// xorshift32
+static uint32_t next_random()
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static uint32_t size_small()
+{
+    return 8 + next_random() % 57;
+}
+
+/// Mostly list nodes and small structures, some buffers of a few hundred bytes, and the odd one of several pages.
+static uint32_t size_kernel()
+{
+    uint32_t r = next_random() % 100;
+    if(r < 70){
+        return 1 + next_random() % 64;
+    } else if(r < 95){
+        return 65 + next_random() % 1024;
+    }
+    return 1089 + next_random() % (8 * PAGE_SIZE);
+}
+
+static uint32_t size_large()
+{
+    return PAGE_SIZE / 4 + next_random() % (4 * PAGE_SIZE);
+}
+
+static const distribution_t distributions[] =
+{
+    {"small", size_small, 0},
+    {"kernel", size_kernel, 0},
+    {"large", size_large, 0},
+    {"kernel_aligned", size_kernel, 8},
+};
+
+static uint32_t sizes[TABLE_SIZE];
+static uint8_t aligned[TABLE_SIZE];
+static uint32_t slots[TABLE_SIZE];
+
+static void fill_tables(const distribution_t *distribution, uint32_t live)
+{
+    seed = 1;
+    for(int i = 0; i < TABLE_SIZE; i++){
+        sizes[i] = distribution->size();
+        aligned[i] = distribution->aligned_one_in && next_random() % distribution->aligned_one_in == 0;
+        slots[i] = next_random() % live;
+    }
+}
+
+static uint64_t now_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/// Allocates a block and frees it straight away, iterations times. The heap only ever has one block in it, so this
+/// is the best case: the first hole in the index always fits.
+static uint32_t run_pairs(heap_t *heap, uint32_t live, uint32_t iterations)
+{
+    (void)live;
+    for(uint32_t i = 0; i < iterations; i++){
+        uint32_t t = i % TABLE_SIZE;
+        heap_free(heap, heap_alloc(heap, sizes[t], aligned[t]));
+    }
+    return 2 * iterations;
+}
+
+/// Picks a random one of live slots each iteration, and frees its block if it has one or allocates one if it
+/// doesn't. About half the slots are full at any time, so the index holds a realistic number of holes.
+static uint32_t run_churn(heap_t *heap, uint32_t live, uint32_t iterations)
+{
+    static void *blocks[MAX_LIVE];
+    for(uint32_t i = 0; i < live; i++){
+        blocks[i] = NULL;
+    }
+    for(uint32_t i = 0; i < iterations; i++){
+        uint32_t t = i % TABLE_SIZE;
+        void **block = &blocks[slots[t]];
+        if(*block){
+            heap_free(heap, *block);
+            *block = NULL;
+        } else {
+            *block = heap_alloc(heap, sizes[t], aligned[t]);
+        }
+    }
+    for(uint32_t i = 0; i < live; i++){
+        heap_free(heap, blocks[i]);
+    }
+    return iterations;
+}
+
+typedef struct
+{
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+    uint32_t ops;
+    uint32_t iterations;
+} result_t;
+
+static result_t run_one(uint32_t (*run)(heap_t *, uint32_t, uint32_t), uint32_t live, uint32_t iterations)
+{
+    heap_t *heap = host_heap_create(HEAP_MIN_SIZE);
+    result_t result;
+    uint64_t wall = now_ns(CLOCK_MONOTONIC);
+    uint64_t cpu = now_ns(CLOCK_PROCESS_CPUTIME_ID);
+    result.ops = run(heap, live, iterations);
+    result.cpu_ns = now_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+    result.wall_ns = now_ns(CLOCK_MONOTONIC) - wall;
+    result.iterations = iterations;
+    host_heap_destroy(heap);
+    return result;
+}
+
+static void benchmark(const char *name, uint32_t (*run)(heap_t *, uint32_t, uint32_t), const distribution_t *distribution,
+                      uint32_t live, int json)
+{
+    char full_name[64];
+    snprintf(full_name, sizeof(full_name), "%s/%s/%u", name, distribution->name, live);
+    fill_tables(distribution, live);
+
+    result_t result;
+    uint32_t iterations = 1000;
+    for(;;){
+        result = run_one(run, live, iterations);
+        if(result.wall_ns >= MIN_TIME_NS || iterations >= MAX_ITERATIONS){
+            break;
+        }
+        // Aim a bit past the minimum, like Google Benchmark does, rather than doubling blindly.
+        uint64_t next = result.wall_ns ? (uint64_t)iterations * MIN_TIME_NS * 14 / 10 / result.wall_ns : iterations * 10ull;
+        iterations = next > MAX_ITERATIONS ? MAX_ITERATIONS : next < iterations * 2ull ? iterations * 2 : (uint32_t)next;
+    }
+
+    double wall_per_op = (double)result.wall_ns / result.ops;
+    double cpu_per_op = (double)result.cpu_ns / result.ops;
+    if(json){
+        printf("{\"bench\":\"%s\",\"ops\":%u,\"ns\":%llu,\"ns_per_op\":%.1f,\"cpu_ns_per_op\":%.1f}\n", full_name,
+               result.ops, (unsigned long long)result.wall_ns, wall_per_op, cpu_per_op);
+    } else {
+        printf("%-32s %10.1f ns %10.1f ns %12u %10.2fM/s\n", full_name, wall_per_op, cpu_per_op, result.iterations,
+               1000.0 / cpu_per_op);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int json = argc > 1 && argv[1][0] == '-' && argv[1][1] == '-' && argv[1][2] == 'j';
+    if(!json){
+        printf("%-32s %13s %13s %12s %11s\n", "Benchmark", "Time", "CPU", "Iterations", "ops/s");
+        printf("----------------------------------------------------------------------------------------\n");
+    }
+
+    int count = sizeof(distributions) / sizeof(distributions[0]);
+    for(int i = 0; i < count; i++){
+        benchmark("heap_pairs", run_pairs, &distributions[i], 1, json);
+    }
+    for(int i = 0; i < count; i++){
+        benchmark("heap_churn", run_churn, &distributions[i], 64, json);
+        benchmark("heap_churn", run_churn, &distributions[i], 1024, json);
+    }
+    return 0;
+}
@@ -0,0 +1,375 @@
+// heap_test.c -- Runs the kernel's heap, heap index, linked list, queue and printf code on the development machine.
+//
+// Build and run it from kernel_ken/src with "make heap_test && ./heap_test [seed]", or "make heap_test_asan" for a
+// build with AddressSanitizer and UndefinedBehaviorSanitizer. It's linked against the real heap.c, heapindex.c,
+// linked_list.c, queue.c, print.c and algorithm.c, with host/kernel_shim.c standing in for paging and panic().
+//
+// The stress test makes random allocations and frees, fills every block with a pattern and checks it's intact when
+// the block is freed, and walks the whole heap every so often to check that:
+// -- every header and footer has its magic number, and every footer points back at its header
+// -- the blocks and holes cover the heap exactly
+// -- no two holes are next to each other (heap_free() merges them)
+// -- the index holds exactly the holes, smallest first
+// The seed is printed first, so a failing run can be repeated.
+
+#include "kernel_shim.h"
+#include "linked_list.h"
+#include "queue.h"
+#include "print.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/// Runs a test, like RUNTEST in autotest.c. Anything that fails aborts the whole program.
+#define RUNTEST(fn, name) \
+    printf("Starting test: %s \n", name); \
+    fn(); \
+    printf("Success: %s \n", name);
+
+#define CHECK(b) ((b) ? (void)0 : user_assert(__FILE__, __LINE__, #b))
+
+#define STRESS_OPS 200000
+#define STRESS_SLOTS 512
+#define CHECK_EVERY 997
+
+static uint32_t seed;
+
+/// xorshift32. Never returns 0 as long as seed isn't 0.
+static uint32_t next_random()
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+/// Sizes like the kernel asks for: mostly list nodes and small structures, some buffers of a few hundred bytes, and
+/// the odd one of several pages (pipes, stacks).
+static uint32_t random_size()
+{
+    uint32_t r = next_random() % 100;
+    if(r < 70){
+        return 1 + next_random() % 64;
+    } else if(r < 95){
+        return 65 + next_random() % 1024;
+    }
+    return 1089 + next_random() % (8 * PAGE_SIZE);
+}
+
+/// Walks every block and hole from start_address to end_address and checks the invariants listed at the top.
+/// \returns the number of free bytes
+static uint32_t heap_check(heap_t *heap)
+{
+    uint32_t address = heap->start_address;
+    uint32_t holes = 0;
+    uint32_t free_bytes = 0;
+    int previous_was_hole = FALSE;
+
+    while(address < heap->end_address){
+        header_t *header = (header_t *)(uintptr_t)address;
+        CHECK(header->magic == HEAP_MAGIC);
+        CHECK(header->size >= sizeof(header_t) + sizeof(footer_t));
+        CHECK(address + header->size <= heap->end_address);
+        footer_t *footer = (footer_t *)(uintptr_t)(address + header->size - sizeof(footer_t));
+        CHECK(footer->magic == HEAP_MAGIC);
+        CHECK(footer->header == header);
+
+        if(header->is_hole){
+            CHECK(!previous_was_hole);
+            holes++;
+            free_bytes += header->size;
+
+            uint32_t i = 0;
+            while(i < heap->index->size && hindex_at(heap->index, i) != header){
+                i++;
+            }
+            CHECK(i < heap->index->size);
+        }
+        previous_was_hole = header->is_hole;
+        address += header->size;
+    }
+    CHECK(address == heap->end_address);
+    CHECK(holes == heap->index->size);
+
+    for(uint32_t i = 1; i < heap->index->size; i++){
+        header_t *smaller = hindex_at(heap->index, i - 1);
+        header_t *larger = hindex_at(heap->index, i);
+        CHECK(smaller->size <= larger->size);
+    }
+    return free_bytes;
+}
+
+/// \returns the size of the largest hole, which is the largest allocation that fits without expanding the heap
+static uint32_t largest_hole(heap_t *heap)
+{
+    if(heap->index->size == 0){
+        return 0;
+    }
+    header_t *largest = hindex_at(heap->index, heap->index->size - 1);
+    return largest->size;
+}
+
+static void test_alloc_free()
+{
+    heap_t *heap = host_heap_create(HEAP_MIN_SIZE);
+    uint32_t mapped = host_pages_mapped();
+
+    uint8_t *a = heap_alloc(heap, 10, FALSE);
+    uint8_t *b = heap_alloc(heap, 100, FALSE);
+    uint8_t *c = heap_alloc(heap, 1000, FALSE);
+    CHECK((uintptr_t)a % WORD_SIZE == 0 && (uintptr_t)b % WORD_SIZE == 0 && (uintptr_t)c % WORD_SIZE == 0);
+    CHECK(a < b && b < c);
+    memset(a, 0xAA, 10);
+    memset(b, 0xBB, 100);
+    memset(c, 0xCC, 1000);
+    heap_check(heap);
+
+    // Free the middle one first so that both merges get used.
+    heap_free(heap, b);
+    heap_check(heap);
+    heap_free(heap, a);
+    heap_check(heap);
+    heap_free(heap, c);
+    heap_free(heap, NULL);
+
+    CHECK(heap_check(heap) == heap->end_address - heap->start_address);
+    CHECK(heap->index->size == 1);
+    CHECK(host_pages_mapped() == mapped);
+    host_heap_destroy(heap);
+}
+
+/// A heap shared by threads (refcount above 1) must never give pages back, since other CPUs could still have them in
+/// their TLBs. Once it's down to one thread, freeing contracts it again.
+static void test_shared_no_contract()
+{
+    heap_t *heap = host_heap_create(HEAP_MIN_SIZE);
+    uint32_t mapped = host_pages_mapped();
+
+    uint8_t *big = heap_alloc(heap, 16 * PAGE_SIZE, FALSE);
+    uint32_t grown = host_pages_mapped();
+    CHECK(grown > mapped);
+
+    heap->directory->refcount = 2;
+    heap_free(heap, big);
+    heap_check(heap);
+    CHECK(host_pages_mapped() == grown);
+
+    heap->directory->refcount = 1;
+    big = heap_alloc(heap, 16 * PAGE_SIZE, FALSE);
+    heap_free(heap, big);
+    heap_check(heap);
+    CHECK(host_pages_mapped() == mapped);
+    host_heap_destroy(heap);
+}
+
+static void test_page_aligned()
+{
+    heap_t *heap = host_heap_create(HEAP_MIN_SIZE);
+    void *blocks[64];
+    for(int i = 0; i < 64; i++){
+        blocks[i] = heap_alloc(heap, random_size(), i % 3 == 0);
+        if(i % 3 == 0){
+            CHECK((uintptr_t)blocks[i] % PAGE_SIZE == 0);
+        }
+    }
+    heap_check(heap);
+    for(int i = 0; i < 64; i += 2){
+        heap_free(heap, blocks[i]);
+    }
+    heap_check(heap);
+    for(int i = 1; i < 64; i += 2){
+        heap_free(heap, blocks[i]);
+    }
+    CHECK(heap_check(heap) == heap->end_address - heap->start_address);
+    host_heap_destroy(heap);
+}
+
+typedef struct
+{
+    uint8_t *p;
+    uint32_t size;
+    uint8_t fill;
+} block_t;
+
+static void block_verify(const block_t *block)
+{
+    for(uint32_t i = 0; i < block->size; i++){
+        CHECK(block->p[i] == block->fill);
+    }
+}
+
+static void test_stress()
+{
+    heap_t *heap = host_heap_create(HEAP_MIN_SIZE);
+    uint32_t mapped = host_pages_mapped();
+    block_t blocks[STRESS_SLOTS] = {{0}};
+    uint32_t peak_end = heap->end_address;
+
+    for(uint32_t op = 0; op < STRESS_OPS; op++){
+        block_t *block = &blocks[next_random() % STRESS_SLOTS];
+        if(block->p){
+            block_verify(block);
+            heap_free(heap, block->p);
+            block->p = NULL;
+        } else {
+            block->size = random_size();
+            block->fill = (uint8_t)next_random();
+            block->p = heap_alloc(heap, block->size, next_random() % 50 == 0);
+            CHECK((uint32_t)(uintptr_t)block->p >= heap->start_address);
+            CHECK((uint32_t)(uintptr_t)block->p + block->size <= heap->end_address);
+            memset(block->p, block->fill, block->size);
+        }
+        if(heap->end_address > peak_end){
+            peak_end = heap->end_address;
+        }
+        if(op % CHECK_EVERY == 0){
+            heap_check(heap);
+        }
+    }
+
+    for(int i = 0; i < STRESS_SLOTS; i++){
+        if(blocks[i].p){
+            block_verify(&blocks[i]);
+            heap_free(heap, blocks[i].p);
+        }
+    }
+    CHECK(heap_check(heap) == heap->end_address - heap->start_address);
+    CHECK(host_pages_mapped() == mapped);
+    printf("  the heap grew to %u KB and shrank back to %u KB \n", (peak_end - heap->start_address) / 1024,
+           (heap->end_address - heap->start_address) / 1024);
+    host_heap_destroy(heap);
+}
+
+/// Frees every other small block, then checks that the holes left behind are all separate (so a bigger allocation
+/// can't use them), and that freeing the rest merges everything back into one hole.
+static void test_fragmentation()
+{
+    heap_t *heap = host_heap_create(HEAP_MIN_SIZE);
+    enum { COUNT = 2000, SIZE = 48 };
+    void **blocks = malloc(COUNT * sizeof(void *));
+    for(int i = 0; i < COUNT; i++){
+        blocks[i] = heap_alloc(heap, SIZE, FALSE);
+    }
+    for(int i = 0; i < COUNT; i += 2){
+        heap_free(heap, blocks[i]);
+    }
+
+    uint32_t free_bytes = heap_check(heap);
+    uint32_t largest = largest_hole(heap);
+    printf("  %u bytes free in %u holes, largest %u bytes (%u%% fragmented) \n", free_bytes, heap->index->size,
+           largest, 100 - (uint32_t)((uint64_t)largest * 100 / free_bytes));
+    CHECK(heap->index->size >= COUNT / 2);
+
+    // Nothing that's been freed is big enough, so this has to come from the end of the heap.
+    uint8_t *big = heap_alloc(heap, 4 * SIZE, FALSE);
+    CHECK(big > (uint8_t *)blocks[COUNT - 1]);
+    heap_free(heap, big);
+
+    for(int i = 1; i < COUNT; i += 2){
+        heap_free(heap, blocks[i]);
+    }
+    CHECK(heap_check(heap) == heap->end_address - heap->start_address);
+    CHECK(heap->index->size == 1);
+    free(blocks);
+    host_heap_destroy(heap);
+}
+
+/// Like the comparators the kernel hands to the list functions: 0 means equal.
+static int int_cmp(void *a, void *b)
+{
+    return a != b;
+}
+
+static void test_list_queue()
+{
+    list_t *list = list_init();
+    CHECK(list_is_empty(list));
+    for(uintptr_t i = 1; i <= 100; i++){
+        list_add_back(list, (void *)i);
+    }
+    list_add_front(list, (void *)1000);
+    CHECK(list_size(list) == 101);
+    CHECK(list_contains(list, (void *)50, int_cmp));
+    CHECK(list_remove(list, (void *)50, int_cmp) == 0);
+    CHECK(!list_contains(list, (void *)50, int_cmp));
+    CHECK(list_remove_front(list) == (void *)1000);
+    CHECK(list_remove_back(list) == (void *)100);
+
+    uintptr_t expected = 1;
+    list_enumerator_t iter = list_get_enumerator(list);
+    while(list_has_next(&iter)){
+        if(expected == 50){
+            expected++;
+        }
+        CHECK(list_next_value(&iter) == (void *)expected);
+        expected++;
+    }
+    CHECK(expected == 100);
+    list_clear(list);
+    CHECK(list_is_empty(list));
+    list_destroy(list);
+
+    queue_t *queue = queue_init();
+    for(uintptr_t i = 1; i <= 1000; i++){
+        queue_enqueue(queue, (void *)i);
+    }
+    for(uintptr_t i = 1; i <= 1000; i++){
+        CHECK(queue_dequeue(queue) == (void *)i);
+    }
+    CHECK(queue_is_empty(queue));
+    CHECK(queue_dequeue(queue) == NULL);
+    queue_destroy(queue);
+}
+
+static int format(char *buffer, uint32_t size, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int length = __vsnprintf__internal(buffer, size, fmt, args);
+    va_end(args);
+    return length;
+}
+
+static void check_format(const char *expected, const char *actual)
+{
+    if(strcmp((char *)expected, (char *)actual) != 0){
+        fprintf(stderr, "expected \"%s\", got \"%s\"\n", expected, actual);
+        abort();
+    }
+}
+
+static void test_print()
+{
+    char buffer[128];
+    format(buffer, sizeof(buffer), "%d %u %5d|%-5d|%05d", -42, 42u, 7, 7, -7);
+    check_format("-42 42     7|7    |-0007", buffer);
+    format(buffer, sizeof(buffer), "%x %X %s %c %%", 0xbeefu, 0xBEEFu, "str", 'c');
+    check_format("0xbeef 0XBEEF str c %", buffer);
+    format(buffer, sizeof(buffer), "%llu %lld %.3s", 12345678901234ull, -12345678901234ll, "truncated");
+    check_format("12345678901234 -12345678901234 tru", buffer);
+    format(buffer, sizeof(buffer), "%hhd %hhu %hd %hx|%.0x|%.0d|", 300, 300, 70000, 0x12345, 0, 0);
+    check_format("44 44 4464 0x2345|||", buffer);
+
+    // It must always null terminate, and return the length it would have written.
+    CHECK(format(buffer, 4, "%d", 123456) == 6);
+    check_format("123", buffer);
+}
+
+int main(int argc, char **argv)
+{
+    seed = argc > 1 ? (uint32_t)strtoul(argv[1], NULL, 0) : (uint32_t)time(NULL);
+    if(seed == 0){
+        seed = 1;
+    }
+    printf("Seed: %u \n", seed);
+
+    RUNTEST(test_alloc_free, "Alloc and Free");
+    RUNTEST(test_shared_no_contract, "Shared Heap Doesn't Contract");
+    RUNTEST(test_page_aligned, "Page Aligned Allocations");
+    RUNTEST(test_stress, "Random Alloc/Free Stress");
+    RUNTEST(test_fragmentation, "Fragmentation and Merging");
+    RUNTEST(test_list_queue, "Linked List and Queue");
+    RUNTEST(test_print, "printf Formatter");
+    return 0;
+}
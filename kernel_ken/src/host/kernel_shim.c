@@ -0,0 +1,179 @@
+// kernel_shim.c -- Stand-ins for the kernel functions the host builds of the data structure code call.
+
+#include "kernel_shim.h"
+#include "kheap.h"
+#include "monitor.h"
+#include "paging.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#define PAGE_PRESENT 1
+
+heap_t *kernel_heap = NULL;
+
+// One entry per page of the region. Only the present bit is used.
+static page_t pages[HOST_HEAP_SIZE / PAGE_SIZE];
+static uint32_t pages_mapped = 0;
+static page_directory_t directory;
+
+void *kmalloc(uint32_t sz)
+{
+    void *p = calloc(1, sz);
+    if(!p){
+        PANIC("OUT OF MEMORY");
+    }
+    return p;
+}
+
+void kfree(void *p)
+{
+    free(p);
+}
+
+page_t *get_page(uint32_t address, int make, page_directory_t *dir)
+{
+    (void)make;
+    (void)dir;
+    if(address < HOST_HEAP_START || address - HOST_HEAP_START >= HOST_HEAP_SIZE){
+        PANIC("get_page() outside of the host heap");
+    }
+    return &pages[(address - HOST_HEAP_START) / PAGE_SIZE];
+}
+
+static void *page_address(page_t *page)
+{
+    return (void *)(uintptr_t)(HOST_HEAP_START + (uint32_t)(page - pages) * PAGE_SIZE);
+}
+
+void alloc_frame(page_t *page, int is_kernel, int is_writeable)
+{
+    (void)is_kernel;
+    (void)is_writeable;
+    if(page->contents & PAGE_PRESENT){
+        return;
+    }
+    if(mprotect(page_address(page), PAGE_SIZE, PROT_READ | PROT_WRITE) != 0){
+        PANIC("mprotect() failed");
+    }
+    page->contents |= PAGE_PRESENT;
+    pages_mapped++;
+}
+
+void free_frame(page_t *page)
+{
+    if(!page || !(page->contents & PAGE_PRESENT)){
+        return;
+    }
+    // Throw the contents away as well, so that anything still relying on them shows up.
+    madvise(page_address(page), PAGE_SIZE, MADV_DONTNEED);
+    mprotect(page_address(page), PAGE_SIZE, PROT_NONE);
+    page->contents &= ~PAGE_PRESENT;
+    pages_mapped--;
+}
+
+heap_t *host_heap_create(uint32_t initial_size)
+{
+    void *start = (void *)(uintptr_t)HOST_HEAP_START;
+    void *region = mmap(start, HOST_HEAP_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE,
+                        -1, 0);
+    if(region != start){
+        PANIC("Couldn't reserve the host heap's region");
+    }
+
+    for(uint32_t i = HOST_HEAP_START; i < HOST_HEAP_START + initial_size; i += PAGE_SIZE){
+        alloc_frame(get_page(i, TRUE, &directory), FALSE, TRUE);
+    }
+    alloc_frame(get_page(HOST_HEAP_MAX, TRUE, &directory), FALSE, TRUE);
+
+    heap_t *heap = heap_init(HOST_HEAP_START, HOST_HEAP_START + initial_size, HOST_HEAP_MAX, FALSE, FALSE);
+    directory.refcount = 1;
+    heap->directory = &directory;
+    return heap;
+}
+
+void host_heap_destroy(heap_t *heap)
+{
+    munmap((void *)(uintptr_t)HOST_HEAP_START, HOST_HEAP_SIZE);
+    for(uint32_t i = 0; i < HOST_HEAP_SIZE / PAGE_SIZE; i++){
+        pages[i].contents = 0;
+    }
+    pages_mapped = 0;
+    kfree(heap->index);
+    kfree(heap);
+}
+
+uint32_t host_pages_mapped()
+{
+    return pages_mapped;
+}
+
+void tlb_shootdown()
+{
+}
+
+void panic(const char *message, const char *file, uint32_t line)
+{
+    fprintf(stderr, "PANIC(%s) at %s:%u\n", message, file, line);
+    abort();
+}
+
+void panic_assert(const char *file, uint32_t line, const char *desc)
+{
+    fprintf(stderr, "ASSERTION-FAILED(%s) at %s:%u\n", desc, file, line);
+    abort();
+}
+
+void user_assert(const char *file, uint32_t line, const char *desc)
+{
+    panic_assert(file, line, desc);
+}
+
+void monitor_write(const char *c)
+{
+    fputs(c, stdout);
+}
+
+void klog_write(uint32_t level, const char *text)
+{
+    (void)level;
+    fputs(text, stderr);
+}
+
+// print.c's system call wrappers and stdout lock. Nothing here prints through them.
+int syscall_monitor_write(const char *s)
+{
+    fputs(s, stdout);
+    return 0;
+}
+
+int syscall_yield_impl()
+{
+    return 0;
+}
+
+int spin_trylock(spinlock_t *lock)
+{
+    (void)lock;
+    return 1;
+}
+
+void spin_unlock(spinlock_t *lock)
+{
+    (void)lock;
+}
+
+// heap.c's tracepoints. Tracing is never switched on here.
+volatile uint32_t trace_mask = 0;
+
+void trace_record(uint32_t event, uint32_t a0, uint32_t a1, uint32_t a2)
+{
+    (void)event;
+    (void)a0;
+    (void)a1;
+    (void)a2;
+}
@@ -0,0 +1,36 @@
+// kernel_shim.h -- Stand-ins for the parts of the kernel that heap.c, heapindex.c, linked_list.c, queue.c and print.c
+//                  call into, so that they can be built and run as an ordinary Linux program (see heap_test.c and
+//                  heap_bench.c).
+//
+// The heap code keeps addresses in uint32_t, so a host heap has to live below 4 GB. It's put at the same addresses as
+// a process's heap, in a region that's reserved with no access at all. alloc_frame() makes a page readable and
+// writable, and free_frame() takes it away again, so touching a page the heap hasn't expanded onto (or has contracted
+// off) faults just like it would in the kernel. The binaries are linked with -no-pie for the same reason: string
+// literals get passed around as uint32_t too.
+//
+// The shim's panic(), panic_assert() and user_assert() print the message and abort().
+
+#ifndef KERNEL_SHIM_H
+#define KERNEL_SHIM_H
+
+#include "heap.h"
+
+// Where the host heap goes. The heap can grow from HOST_HEAP_START up to HOST_HEAP_MAX, and its index grows down
+// from HOST_HEAP_MAX, just like a process heap between UHEAP_START and UHEAP_MAX. HOST_HEAP_MAX is 8 byte aligned
+// since the index holds host pointers.
+#define HOST_HEAP_START         UHEAP_START
+#define HOST_HEAP_SIZE          0x4000000
+#define HOST_HEAP_MAX           (HOST_HEAP_START + HOST_HEAP_SIZE - 8)
+
+/// Reserves the region and sets a heap up in it the way task_create_heap() does: initial_size bytes of it mapped,
+/// plus the page the index starts in. Only one host heap can exist at a time.
+/// \param [in] initial_size multiple of PAGE_SIZE, at least HEAP_MIN_SIZE
+heap_t *host_heap_create(uint32_t initial_size);
+
+/// Unmaps the region and frees the heap_t. Every pointer into the heap becomes invalid.
+void host_heap_destroy(heap_t *heap);
+
+/// \returns how many pages of the region alloc_frame() has mapped
+uint32_t host_pages_mapped();
+
+#endif
@@ -0,0 +1,170 @@
+// mem_bench.c -- Times the kernel's memcpy() and memset() on the development machine, against the byte loops they
+// replaced, for sizes from 8 bytes to 64 KB.
+//
+// Build and run it from kernel_ken/src with "make mem_bench && ./mem_bench". It's linked against the real
+// algorithm.c. The first table reuses one buffer, so it stays in the cache. The second walks through far more memory
+// than the cache holds, which is where memset()'s streaming stores (only turned on when the CPU has SSE2) pay off.
+// Before timing anything it checks every routine against the byte loops at a spread of sizes and alignments.
+//
+// Kernel headers aren't included here, because they'd clash with the C library's, so the few kernel functions used
+// are declared by hand.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+void *memcpy(void *dest, const void *src, uint32_t len);
+void *memset(void *dest, uint8_t val, uint32_t len);
+int strlen(const char *s);
+void memory_use_nontemporal(int enable);
+
+#define MAX_SIZE (64 * 1024)
+// How many bytes each size copies in total, so that every size takes about as long.
+#define BYTES_PER_SIZE (64 * 1024 * 1024)
+// Big enough that nothing written in the second table is still cached when it's written again.
+#define COLD_REGION (128 * 1024 * 1024)
+
+// The old byte loops, built without optimisation like the kernel built them.
+__attribute__((optimize("O0"))) static void *byte_memcpy(void *dest, const void *src, uint32_t len)
+{
+    const uint8_t *sp = (const uint8_t*)src;
+    uint8_t *dp = (uint8_t *)dest;
+    for(; len != 0; len--) *dp++ = *sp++;
+    return dest;
+}
+
+__attribute__((optimize("O0"))) static void *byte_memset(void *dest, uint8_t val, uint32_t len)
+{
+    uint8_t *temp = (uint8_t*)dest;
+    for ( ; len != 0; len--) *temp++ = val;
+    return dest;
+}
+
+static uint8_t *source;
+static uint8_t *dest;
+static uint8_t *expected;
+
+static int failures = 0;
+
+static void fail(const char *what, uint32_t size, uint32_t offset)
+{
+    printf("%s: wrong result for %u bytes at offset %u\n", what, size, offset);
+    failures++;
+}
+
+static int differs(uint32_t length)
+{
+    for(uint32_t i = 0; i < length; i++){
+        if(dest[i] != expected[i]){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void check_routines()
+{
+    static const uint32_t sizes[] = {0, 1, 3, 4, 7, 15, 16, 17, 63, 4095, 4096, 4097, 4111, 8192 + 5, MAX_SIZE - 8};
+    for(uint32_t i = 0; i < MAX_SIZE + 16; i++){
+        source[i] = (uint8_t)(i * 7 + 3);
+    }
+
+    for(uint32_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++){
+        for(uint32_t offset = 0; offset < 8; offset++){
+            uint32_t size = sizes[s];
+
+            byte_memset(dest, 0xAA, MAX_SIZE + 16);
+            byte_memset(expected, 0xAA, MAX_SIZE + 16);
+            byte_memcpy(expected + offset, source + (offset & 3), size);
+            memcpy(dest + offset, source + (offset & 3), size);
+            if(differs(MAX_SIZE + 16)){
+                fail("memcpy", size, offset);
+            }
+
+            byte_memset(expected + offset, 0x5C, size);
+            memset(dest + offset, 0x5C, size);
+            if(differs(MAX_SIZE + 16)){
+                fail("memset", size, offset);
+            }
+
+            byte_memset(dest, 'x', MAX_SIZE + 16);
+            dest[offset + size] = '\0';
+            if((uint32_t)strlen((const char*)dest + offset) != size){
+                fail("strlen", size, offset);
+            }
+        }
+    }
+}
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/// \returns throughput in MB/s of copying (or, without copy, filling) size bytes over and over. Each round starts
+/// stride bytes further on, wrapping at the end of region.
+static double bench(void *(*copy)(void*, const void*, uint32_t), void *(*fill)(void*, uint8_t, uint32_t),
+                    uint32_t size, uint8_t *to, const uint8_t *from, uint32_t region, uint32_t stride)
+{
+    uint32_t rounds = BYTES_PER_SIZE / size;
+    uint32_t offset = 0;
+    double start = now_seconds();
+    for(uint32_t i = 0; i < rounds; i++){
+        if(copy){
+            copy(to + offset, from + offset, size);
+        }
+        else {
+            fill(to + offset, (uint8_t)i, size);
+        }
+        offset = offset + stride + size <= region ? offset + stride : 0;
+    }
+    return (double)rounds * size / (now_seconds() - start) / 1e6;
+}
+
+int main()
+{
+    source = malloc(MAX_SIZE + 16);
+    dest = malloc(MAX_SIZE + 16);
+    expected = malloc(MAX_SIZE + 16);
+
+    for(int streaming = 0; streaming < 2; streaming++){
+        memory_use_nontemporal(streaming);
+        check_routines();
+    }
+    if(failures){
+        printf("%d checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+
+    printf("In the cache, MB/s\n");
+    printf("    size   memcpy: bytes    rep   memset: bytes    rep  movnti\n");
+    for(uint32_t size = 8; size <= MAX_SIZE; size *= 2){
+        double copy_bytes = bench(byte_memcpy, NULL, size, dest, source, MAX_SIZE, 0);
+        double set_bytes = bench(NULL, byte_memset, size, dest, NULL, MAX_SIZE, 0);
+        memory_use_nontemporal(0);
+        double copy_rep = bench(memcpy, NULL, size, dest, source, MAX_SIZE, 0);
+        double set_rep = bench(NULL, memset, size, dest, NULL, MAX_SIZE, 0);
+        memory_use_nontemporal(1);
+        double set_nt = bench(NULL, memset, size, dest, NULL, MAX_SIZE, 0);
+        printf("%8u  %13.0f %6.0f  %13.0f %6.0f %7.0f\n", size, copy_bytes, copy_rep, set_bytes, set_rep, set_nt);
+    }
+
+    uint8_t *cold_source = malloc(COLD_REGION);
+    uint8_t *cold_dest = malloc(COLD_REGION);
+    byte_memset(cold_source, 1, COLD_REGION);
+    byte_memset(cold_dest, 1, COLD_REGION);
+    printf("\nOut of the cache, MB/s\n");
+    printf("    size   memcpy:  rep   memset:  rep  movnti\n");
+    for(uint32_t size = 4096; size <= MAX_SIZE; size *= 4){
+        memory_use_nontemporal(0);
+        double copy_rep = bench(memcpy, NULL, size, cold_dest, cold_source, COLD_REGION, size);
+        double set_rep = bench(NULL, memset, size, cold_dest, NULL, COLD_REGION, size);
+        memory_use_nontemporal(1);
+        double set_nt = bench(NULL, memset, size, cold_dest, NULL, COLD_REGION, size);
+        printf("%8u  %12.0f  %12.0f %7.0f\n", size, copy_rep, set_rep, set_nt);
+    }
+    return EXIT_SUCCESS;
+}
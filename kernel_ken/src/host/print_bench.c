@@ -0,0 +1,210 @@
+// print_bench.c -- Times the kernel's printf formatter on the development machine, against the one it replaced.
+//
+// Build and run it from kernel_ken/src with "make print_bench && ./print_bench". It's linked against the real print.c
+// and algorithm.c, so it measures exactly what the kernel runs. Before timing anything it checks the new formatter
+// against the host's snprintf() on conversions where the two are meant to agree.
+//
+// Kernel headers aren't included here, because they'd clash with the C library's, so the few kernel functions used
+// are declared by hand.
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+int __vsnprintf__internal(char *buffer, uint32_t size, const char *fmt, va_list args);
+int strlen(const char *s);
+char *itoa(int32_t value, char *result, int base);
+char *utoa(uint32_t value, char *result, int base);
+
+// print.c's system call wrappers are never called here, but they have to link.
+int syscall_monitor_write(const char *s) { (void)s; return 0; }
+int syscall_yield_impl() { return 0; }
+void klog_write(uint32_t level, const char *text) { (void)level; (void)text; }
+int spin_trylock(volatile uint32_t *lock) { (void)lock; return 1; }
+void spin_unlock(volatile uint32_t *lock) { (void)lock; }
+
+#define ITERATIONS 200000
+
+/// The formatter print.c used before, with its argument reading switched to <stdarg.h> so that it runs on a 64 bit
+/// host. The strlen() in every loop condition and the itoa() into a 512 byte buffer are what's being compared.
+static int old_vfprintf(char *output, int size, const char *fmt, va_list args)
+{
+    if(size == 0)
+        return 0;
+    size--;
+
+    int output_index = 0;
+    int int_temp;
+    char *string_temp;
+    char ch;
+    int length = 0;
+    char buffer[512];
+
+    while(output_index < size && (ch = *fmt++)){
+        if('%' == ch){
+            switch(ch = *fmt++){
+                case '%':
+                    output[output_index++] = '%';
+                    length++;
+                    break;
+                case 'c':
+                    output[output_index++] = (char)va_arg(args, int);
+                    length++;
+                    break;
+                case 's':
+                    string_temp = va_arg(args, char *);
+                    for(int i = 0; i < strlen(string_temp) && output_index < size; i++){
+                        output[output_index++] = string_temp[i];
+                    }
+                    length += strlen(string_temp);
+                    break;
+                case 'u':
+                    int_temp = va_arg(args, int);
+                    utoa(int_temp, buffer, 10);
+                    for(int i = 0; i < strlen(buffer) && output_index < size; i++){
+                        output[output_index++] = buffer[i];
+                    }
+                    length += strlen(buffer);
+                    break;
+                case 'd':
+                    int_temp = va_arg(args, int);
+                    itoa(int_temp, buffer, 10);
+                    for(int i = 0; i < strlen(buffer) && output_index < size; i++){
+                        output[output_index++] = buffer[i];
+                    }
+                    length += strlen(buffer);
+                    break;
+                case 'x':
+                    output[output_index++] = '0';
+                    output[output_index++] = 'x';
+                    int_temp = va_arg(args, int);
+                    utoa(int_temp, buffer, 16);
+                    for(int i = 0; i < strlen(buffer) && output_index < size; i++){
+                        output[output_index++] = buffer[i];
+                    }
+                    length += strlen(buffer);
+                    break;
+            }
+        }
+        else {
+            output[output_index++] = ch;
+            length++;
+        }
+    }
+    output[output_index] = '\0';
+    return length;
+}
+
+static int old_snprintf(char *buffer, int size, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int length = old_vfprintf(buffer, size, fmt, args);
+    va_end(args);
+    return length;
+}
+
+static int new_snprintf(char *buffer, uint32_t size, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int length = __vsnprintf__internal(buffer, size, fmt, args);
+    va_end(args);
+    return length;
+}
+
+static int failures = 0;
+
+/// Formats the same thing with the kernel's formatter and the host's, and complains if they differ.
+#define CHECK(fmt, ...) check(__LINE__, fmt, new_snprintf(kernel, sizeof(kernel), fmt, ##__VA_ARGS__), \
+                              snprintf(host, sizeof(host), fmt, ##__VA_ARGS__))
+
+static char kernel[256];
+static char host[256];
+
+static void check(int line, const char *fmt, int kernel_length, int host_length)
+{
+    int same = kernel_length == host_length;
+    for(int i = 0; same && kernel[i]; i++){
+        same = kernel[i] == host[i];
+    }
+    if(!same){
+        printf("line %d: \"%s\" gave \"%s\" (%d), expected \"%s\" (%d)\n", line, fmt, kernel, kernel_length, host,
+               host_length);
+        failures++;
+    }
+}
+
+static void check_formatting()
+{
+    CHECK("plain text");
+    CHECK("%d %i %u", -42, 17, 4000000000u);
+    CHECK("[%5d] [%-5d] [%05d] [%+d] [% d]", 42, 42, -42, 42, 42);
+    CHECK("[%.3d] [%8.3d] [%.0d]", 7, -7, 0);
+    CHECK("%lld %llu", (long long)-9000000000LL, 18446744073709551615ULL);
+    CHECK("%zu %ld %lu", (size_t)123456, -100000L, 100000UL);
+    CHECK("[%s] [%10s] [%-10s] [%.3s] [%*s]", "abc", "abc", "abc", "abcdef", 6, "ab");
+    CHECK("[%c] [%3c] [%-3c]", 'x', 'y', 'z');
+    CHECK("100%%");
+    CHECK("%hd %hhu", 5, 7);
+
+    // %x always has a 0x in front in the kernel.
+    new_snprintf(kernel, sizeof(kernel), "%x %08X %llx", 0xbeefu, 0xABCu, 0x123456789abcULL);
+    snprintf(host, sizeof(host), "%#x %#08X %#llx", 0xbeefu, 0xABCu, 0x123456789abcULL);
+    check(__LINE__, "%x %08X %llx", strlen(kernel), strlen(host));
+
+    // Truncated output still reports its full length, and is still terminated.
+    CHECK("%s", "longer than the buffer");
+    int length = new_snprintf(kernel, 8, "%s", "longer than the buffer");
+    if(length != 22 || strlen(kernel) != 7){
+        printf("truncation: got \"%s\" (%d)\n", kernel, length);
+        failures++;
+    }
+}
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static volatile int sink;
+
+#define BENCH(name, fmt, ...) do { \
+        char buffer[512]; \
+        double start = now_seconds(); \
+        for(int i = 0; i < ITERATIONS; i++){ \
+            sink += old_snprintf(buffer, sizeof(buffer), fmt, ##__VA_ARGS__); \
+        } \
+        double old_ns = (now_seconds() - start) * 1e9 / ITERATIONS; \
+        start = now_seconds(); \
+        for(int i = 0; i < ITERATIONS; i++){ \
+            sink += new_snprintf(buffer, sizeof(buffer), fmt, ##__VA_ARGS__); \
+        } \
+        double new_ns = (now_seconds() - start) * 1e9 / ITERATIONS; \
+        printf("%-16s old %8.1f ns  new %8.1f ns  %5.1fx\n", name, old_ns, new_ns, old_ns / new_ns); \
+    } while(0)
+
+int main()
+{
+    check_formatting();
+    if(failures){
+        printf("%d formatting checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+
+    static char long_string[401];
+    for(int i = 0; i < 400; i++){
+        long_string[i] = 'a' + i % 26;
+    }
+
+    BENCH("log line", "fork:  %u workers took %u us (%u us per worker) \n", 100, 123456, 1234);
+    BENCH("integers", "%d %d %d %d %u %u %x %x", -1, 22, -333, 4444, 55555u, 666666u, 0xdeadu, 0xbeefu);
+    BENCH("short string", "[%s] %s", "pid", "exited");
+    BENCH("long string", "%s", long_string);
+    BENCH("plain text", "Philosopher is thinking about forks and eating with them \n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,206 @@
+// profile_report.c -- Turns the "PROFILE <stack> <count>" lines that profile_dump() prints into a flat profile, or
+//                     into folded stacks for flamegraph.pl.
+//
+// Build it from kernel_ken/src with "make profile_report", and feed it a serial log on stdin or as a file:
+//
+//     ./profile_report serial.log              flat profile, the functions with the most samples of their own first
+//     ./profile_report --folded serial.log     one "stack count" line per stack, for flamegraph.pl
+//
+// Anything in the log that isn't a PROFILE line is skipped, and so is the same stack showing up twice (the folded
+// output adds them together). In the flat profile, self is how many samples were taken in the function itself and
+// total is how many had it anywhere on the stack, counting a recursive function once per sample.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LINE_SIZE       4096
+#define PREFIX          "PROFILE "
+
+typedef struct
+{
+    char *stack;
+    unsigned long count;
+} folded_t;
+
+typedef struct
+{
+    char *name;
+    unsigned long self;
+    unsigned long total;
+    // The last sample (stack index) total was counted for, so that recursion doesn't count twice.
+    size_t last_stack;
+} function_t;
+
+static folded_t *stacks = NULL;
+static size_t stack_count = 0;
+static size_t stack_capacity = 0;
+
+static function_t *functions = NULL;
+static size_t function_count = 0;
+static size_t function_capacity = 0;
+
+static void *grow(void *array, size_t *capacity, size_t element_size)
+{
+    *capacity = *capacity ? *capacity * 2 : 256;
+    array = realloc(array, *capacity * element_size);
+    if(!array){
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return array;
+}
+
+static void add_stack(const char *stack, unsigned long count)
+{
+    for(size_t i = 0; i < stack_count; i++){
+        if(strcmp(stacks[i].stack, stack) == 0){
+            stacks[i].count += count;
+            return;
+        }
+    }
+    if(stack_count == stack_capacity){
+        stacks = grow(stacks, &stack_capacity, sizeof(folded_t));
+    }
+    stacks[stack_count].stack = strdup(stack);
+    stacks[stack_count].count = count;
+    stack_count++;
+}
+
+static function_t *find_function(const char *name)
+{
+    for(size_t i = 0; i < function_count; i++){
+        if(strcmp(functions[i].name, name) == 0){
+            return &functions[i];
+        }
+    }
+    if(function_count == function_capacity){
+        functions = grow(functions, &function_capacity, sizeof(function_t));
+    }
+    function_t *function = &functions[function_count++];
+    function->name = strdup(name);
+    function->self = 0;
+    function->total = 0;
+    function->last_stack = (size_t)-1;
+    return function;
+}
+
+/// Parses one line of the log, if it's a PROFILE line: the stack runs up to the last space, and the count follows it.
+static void read_line(char *line)
+{
+    char *start = strstr(line, PREFIX);
+    if(!start){
+        return;
+    }
+    start += strlen(PREFIX);
+    line[strcspn(line, "\r\n")] = '\0';
+
+    char *space = strrchr(start, ' ');
+    if(!space || space == start){
+        return;
+    }
+    char *end;
+    unsigned long count = strtoul(space + 1, &end, 10);
+    if(*end != '\0' || count == 0){
+        return;
+    }
+    *space = '\0';
+    add_stack(start, count);
+}
+
+static int by_self(const void *a, const void *b)
+{
+    const function_t *fa = a;
+    const function_t *fb = b;
+    if(fa->self != fb->self){
+        return fa->self < fb->self ? 1 : -1;
+    }
+    if(fa->total != fb->total){
+        return fa->total < fb->total ? 1 : -1;
+    }
+    return strcmp(fa->name, fb->name);
+}
+
+static void print_flat()
+{
+    unsigned long samples = 0;
+    for(size_t i = 0; i < stack_count; i++){
+        samples += stacks[i].count;
+        // The first two frames are the pid and the mode, which aren't functions.
+        char *frames = strdup(stacks[i].stack);
+        char *saveptr;
+        char *frame = strtok_r(frames, ";", &saveptr);
+        char *leaf = NULL;
+        for(int depth = 0; frame; depth++, frame = strtok_r(NULL, ";", &saveptr)){
+            if((depth == 0 && strncmp(frame, "pid", 3) == 0) ||
+               (depth < 2 && (strcmp(frame, "[user]") == 0 || strcmp(frame, "[kernel]") == 0))){
+                continue;
+            }
+            function_t *function = find_function(frame);
+            if(function->last_stack != i){
+                function->total += stacks[i].count;
+                function->last_stack = i;
+            }
+            leaf = frame;
+        }
+        if(leaf){
+            find_function(leaf)->self += stacks[i].count;
+        }
+        free(frames);
+    }
+
+    qsort(functions, function_count, sizeof(function_t), by_self);
+    printf("%lu samples\n\n", samples);
+    printf("%10s %7s %10s %7s  %s\n", "self", "self%", "total", "total%", "function");
+    for(size_t i = 0; i < function_count; i++){
+        printf("%10lu %6.2f%% %10lu %6.2f%%  %s\n", functions[i].self, 100.0 * functions[i].self / samples,
+               functions[i].total, 100.0 * functions[i].total / samples, functions[i].name);
+    }
+}
+
+static void print_folded()
+{
+    for(size_t i = 0; i < stack_count; i++){
+        printf("%s %lu\n", stacks[i].stack, stacks[i].count);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int folded = 0;
+    const char *path = NULL;
+    for(int i = 1; i < argc; i++){
+        if(strcmp(argv[i], "--folded") == 0){
+            folded = 1;
+        } else if(!path && argv[i][0] != '-'){
+            path = argv[i];
+        } else {
+            fprintf(stderr, "usage: %s [--folded] [log]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    FILE *in = path ? fopen(path, "r") : stdin;
+    if(!in){
+        perror(path);
+        return 1;
+    }
+    char line[LINE_SIZE];
+    while(fgets(line, sizeof(line), in)){
+        read_line(line);
+    }
+    if(in != stdin){
+        fclose(in);
+    }
+
+    if(stack_count == 0){
+        fprintf(stderr, "no PROFILE lines found\n");
+        return 1;
+    }
+    if(folded){
+        print_folded();
+    } else {
+        print_flat();
+    }
+    return 0;
+}
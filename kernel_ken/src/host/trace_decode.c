@@ -0,0 +1,320 @@
+// trace_decode.c -- Turns the "TRACE <hex>" lines that trace_dump() prints into Chrome trace_event JSON, which
+//                   chrome://tracing and ui.perfetto.dev both open.
+//
+// Build it from kernel_ken/src with "make trace_decode", and feed it a serial log on stdin or as a file:
+//
+//     ./trace_decode serial.log > trace.json
+//
+// What comes out:
+//   - a "CPUs" process with one row per CPU, showing which task it was running (from the context switches)
+//   - one process per task, with its system calls as slices ("syscall 7" is entry 7 of the table in syscall.c) and
+//     instant events for semaphore blocks and wakeups and pipe reads and writes
+//   - counters for frames allocated since tracing started, each heap's size and how full each pipe is
+//
+// Times come from the TSC, scaled by the TRACE_CLOCK records the kernel writes when tracing starts and stops.
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LINE_SIZE       256
+#define PREFIX          "TRACE "
+// sizeof(trace_record_t) in the kernel. The host lays the struct out differently (it aligns the uint64_t to 8 bytes),
+// so records are decoded field by field from the kernel's offsets instead.
+#define RECORD_BYTES    28
+#define MAX_CPUS_SEEN   256
+// Chrome pid for the CPU rows, out of the way of any task id.
+#define CPUS_PID        1000000
+
+// enum trace_event from trace.h, which can't be included here: it pulls in the kernel's own string functions.
+enum trace_event
+{
+    TRACE_CLOCK = 0,
+    TRACE_SWITCH,
+    TRACE_SYSCALL_ENTER,
+    TRACE_SYSCALL_EXIT,
+    TRACE_FRAME_ALLOC,
+    TRACE_FRAME_FREE,
+    TRACE_HEAP_EXPAND,
+    TRACE_HEAP_CONTRACT,
+    TRACE_SEM_BLOCK,
+    TRACE_SEM_WAKE,
+    TRACE_PIPE_WRITE,
+    TRACE_PIPE_READ
+};
+
+typedef struct
+{
+    uint64_t tsc;
+    uint32_t pid;
+    uint32_t event;
+    uint32_t cpu;
+    uint32_t args[3];
+    uint32_t sequence;      // Order in the log, so that sorting keeps records with the same TSC in order
+} decoded_t;
+
+static decoded_t *records = NULL;
+static uint32_t record_count = 0;
+static uint32_t record_capacity = 0;
+
+static uint64_t tsc_start = 0;
+static double ns_per_tsc = 1.0;
+static int first_event = 1;
+
+static int hex_value(char c)
+{
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/// Little endian, like the kernel wrote it.
+static uint64_t field(const uint8_t *bytes, int offset, int size)
+{
+    uint64_t value = 0;
+    for(int i = size - 1; i >= 0; i--){
+        value = (value << 8) | bytes[offset + i];
+    }
+    return value;
+}
+
+static void read_line(const char *line)
+{
+    const char *hex = strstr(line, PREFIX);
+    if(!hex){
+        return;
+    }
+    hex += strlen(PREFIX);
+
+    uint8_t bytes[RECORD_BYTES];
+    for(int i = 0; i < RECORD_BYTES; i++){
+        int high = hex_value(hex[2 * i]);
+        int low = high < 0 ? -1 : hex_value(hex[2 * i + 1]);
+        if(low < 0){
+            fprintf(stderr, "skipping a garbled record: %s", line);
+            return;
+        }
+        bytes[i] = (uint8_t)(high << 4 | low);
+    }
+
+    if(record_count == record_capacity){
+        record_capacity = record_capacity ? record_capacity * 2 : 4096;
+        records = realloc(records, record_capacity * sizeof(decoded_t));
+        if(!records){
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    decoded_t *record = &records[record_count];
+    record->tsc = field(bytes, 0, 8);
+    record->pid = (uint32_t)field(bytes, 8, 4);
+    record->event = (uint32_t)field(bytes, 12, 2);
+    record->cpu = (uint32_t)field(bytes, 14, 1);
+    for(int i = 0; i < 3; i++){
+        record->args[i] = (uint32_t)field(bytes, 16 + 4 * i, 4);
+    }
+    record->sequence = record_count;
+    record_count++;
+}
+
+static int by_tsc(const void *a, const void *b)
+{
+    const decoded_t *ra = a;
+    const decoded_t *rb = b;
+    if(ra->tsc != rb->tsc){
+        return ra->tsc < rb->tsc ? -1 : 1;
+    }
+    return ra->sequence < rb->sequence ? -1 : 1;
+}
+
+/// Works out ns_per_tsc from the first and last TRACE_CLOCK records.
+static void calibrate()
+{
+    decoded_t *first = NULL;
+    decoded_t *last = NULL;
+    for(uint32_t i = 0; i < record_count; i++){
+        if(records[i].event == TRACE_CLOCK){
+            if(!first){
+                first = &records[i];
+            }
+            last = &records[i];
+        }
+    }
+
+    tsc_start = first ? first->tsc : records[0].tsc;
+    if(first && last->tsc > first->tsc){
+        uint64_t first_ns = (uint64_t)first->args[1] << 32 | first->args[0];
+        uint64_t last_ns = (uint64_t)last->args[1] << 32 | last->args[0];
+        ns_per_tsc = (double)(last_ns - first_ns) / (double)(last->tsc - first->tsc);
+    } else {
+        fprintf(stderr, "no start and stop TRACE_CLOCK records, so timestamps are in TSC cycles\n");
+    }
+}
+
+/// Microseconds since tracing started, which is what Chrome's ts and dur are in.
+static double micros(uint64_t tsc)
+{
+    return (double)(int64_t)(tsc - tsc_start) * ns_per_tsc / 1000.0;
+}
+
+/// Starts the next event in the array. format is the rest of the event's fields, after its name and phase.
+static void event(const char *name, const char *phase, uint32_t pid, uint32_t tid, uint64_t tsc, const char *format, ...)
+{
+    printf("%s\n{\"name\":\"%s\",\"ph\":\"%s\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f", first_event ? "" : ",", name, phase,
+           pid, tid, micros(tsc));
+    first_event = 0;
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf("}");
+}
+
+/// Idle tasks don't get a pid, so they're all task 0.
+static void task_name(char *buf, size_t size, uint32_t pid)
+{
+    if(pid == 0){
+        snprintf(buf, size, "idle");
+    } else {
+        snprintf(buf, size, "task %u", pid);
+    }
+}
+
+static void name_track(const char *kind, uint32_t pid, uint32_t tid, const char *name)
+{
+    printf("%s\n{\"name\":\"%s\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", first_event ? "" : ",",
+           kind, pid, tid, name);
+    first_event = 0;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc > 2 || (argc == 2 && argv[1][0] == '-')){
+        fprintf(stderr, "usage: %s [log] > trace.json\n", argv[0]);
+        return 2;
+    }
+    FILE *in = argc == 2 ? fopen(argv[1], "r") : stdin;
+    if(!in){
+        perror(argv[1]);
+        return 1;
+    }
+    char line[LINE_SIZE];
+    while(fgets(line, sizeof(line), in)){
+        read_line(line);
+    }
+    if(in != stdin){
+        fclose(in);
+    }
+    if(record_count == 0){
+        fprintf(stderr, "no TRACE lines found\n");
+        return 1;
+    }
+
+    qsort(records, record_count, sizeof(decoded_t), by_tsc);
+    calibrate();
+
+    // Which task each CPU is running, and since when, once there's been a switch on it.
+    uint32_t running[MAX_CPUS_SEEN];
+    uint64_t running_since[MAX_CPUS_SEEN];
+    int running_known[MAX_CPUS_SEEN] = {0};
+    int cpu_seen[MAX_CPUS_SEEN] = {0};
+    int64_t frames = 0;
+    char name[64];
+    char label[64];
+
+    printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    name_track("process_name", CPUS_PID, 0, "CPUs");
+
+    for(uint32_t i = 0; i < record_count; i++){
+        decoded_t *r = &records[i];
+        uint32_t cpu = r->cpu % MAX_CPUS_SEEN;
+        if(!cpu_seen[cpu]){
+            cpu_seen[cpu] = 1;
+            snprintf(label, sizeof(label), "CPU %u", r->cpu);
+            name_track("thread_name", CPUS_PID, r->cpu, label);
+        }
+
+        switch(r->event){
+            case TRACE_SWITCH: {
+                // The task switched away from ran since the last switch on this CPU, or since the start. One that
+                // exited can't be named by the kernel any more, but the last switch here says which it was.
+                int alive = r->args[2];
+                if(alive || running_known[cpu]){
+                    uint32_t prev = alive ? r->args[0] : running[cpu];
+                    uint64_t since = running_known[cpu] ? running_since[cpu] : tsc_start;
+                    task_name(name, sizeof(name), prev);
+                    event(name, "X", CPUS_PID, r->cpu, since, ",\"dur\":%.3f", micros(r->tsc) - micros(since));
+                }
+                running[cpu] = r->args[1];
+                running_since[cpu] = r->tsc;
+                running_known[cpu] = 1;
+                break;
+            }
+            case TRACE_SYSCALL_ENTER:
+                snprintf(name, sizeof(name), "syscall %u", r->args[0]);
+                event(name, "B", r->pid, r->pid, r->tsc, ",\"args\":{\"arg\":%u}", r->args[1]);
+                break;
+            case TRACE_SYSCALL_EXIT:
+                snprintf(name, sizeof(name), "syscall %u", r->args[0]);
+                event(name, "E", r->pid, r->pid, r->tsc, ",\"args\":{\"ret\":%d}", (int)r->args[1]);
+                break;
+            case TRACE_FRAME_ALLOC:
+            case TRACE_FRAME_FREE:
+                frames += r->event == TRACE_FRAME_ALLOC ? 1 : -1;
+                event("frames", "C", CPUS_PID, 0, r->tsc, ",\"args\":{\"allocated since start\":%lld}",
+                      (long long)frames);
+                break;
+            case TRACE_HEAP_EXPAND:
+            case TRACE_HEAP_CONTRACT:
+                snprintf(name, sizeof(name), "heap %#x", r->args[0]);
+                event(name, "C", CPUS_PID, 0, r->tsc, ",\"args\":{\"bytes\":%u}", r->args[2] - r->args[0]);
+                break;
+            case TRACE_SEM_BLOCK:
+                snprintf(name, sizeof(name), "sem %u block", r->args[0]);
+                event(name, "i", r->pid, r->pid, r->tsc, ",\"s\":\"t\",\"args\":{\"counter\":%d}", (int)r->args[1]);
+                break;
+            case TRACE_SEM_WAKE:
+                snprintf(name, sizeof(name), "sem %u wake", r->args[0]);
+                event(name, "i", r->pid, r->pid, r->tsc, ",\"s\":\"t\",\"args\":{\"woken\":%u}", r->args[1]);
+                break;
+            case TRACE_PIPE_WRITE:
+            case TRACE_PIPE_READ:
+                snprintf(name, sizeof(name), "pipe %u %s", r->args[0], r->event == TRACE_PIPE_WRITE ? "write" : "read");
+                event(name, "i", r->pid, r->pid, r->tsc, ",\"s\":\"t\",\"args\":{\"bytes\":%u,\"stored\":%u}", r->args[1],
+                      r->args[2]);
+                snprintf(name, sizeof(name), "pipe %u", r->args[0]);
+                event(name, "C", CPUS_PID, 0, r->tsc, ",\"args\":{\"stored\":%u}", r->args[2]);
+                break;
+            default:
+                break;
+        }
+    }
+
+    // Whatever each CPU was running when tracing stopped ran until the last record.
+    uint64_t end = records[record_count - 1].tsc;
+    for(uint32_t cpu = 0; cpu < MAX_CPUS_SEEN; cpu++){
+        if(running_known[cpu]){
+            task_name(name, sizeof(name), running[cpu]);
+            event(name, "X", CPUS_PID, cpu, running_since[cpu], ",\"dur\":%.3f",
+                  micros(end) - micros(running_since[cpu]));
+        }
+    }
+
+    // Name every task's process after its pid.
+    for(uint32_t i = 0; i < record_count; i++){
+        uint32_t pid = records[i].pid;
+        int named = 0;
+        for(uint32_t j = 0; j < i && !named; j++){
+            named = records[j].pid == pid;
+        }
+        if(!named){
+            task_name(label, sizeof(label), pid);
+            name_track("process_name", pid, pid, label);
+        }
+    }
+    printf("\n]}\n");
+    return 0;
+}
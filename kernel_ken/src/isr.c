@@ -8,28 +8,194 @@
 #include "isr.h"
 #include "monitor.h"
 #include "task.h"
+#include "smp.h"
+#include "apic.h"
+#include "clock.h"
+#include "klib.h"
+#include "profile.h"
 
 isr_t interrupt_handlers[256];
+static void tasklet_softirq();
+static softirq_t softirq_handlers[NUM_SOFTIRQS] = {[SOFTIRQ_TASKLET] = &tasklet_softirq};
+
+// How many times softirq_run() goes back for softirqs raised while it was running, before it leaves them for
+// the next interrupt. This keeps a flood of interrupts from starving the task that was interrupted.
+#define SOFTIRQ_MAX_ROUNDS 10
+
+// The longest times seen since boot in TSC cycles, for irq_report_impl().
+static uint64_t max_hard_cycles = 0;
+static uint64_t max_deferred_cycles = 0;
+static uint64_t max_softirq_cycles = 0;
+static uint32_t deferred_count = 0;
+
+/// \returns the TSC, or 0 if it isn't the clocksource (in which case it may not exist). This is read before the
+/// kernel lock is taken, so it can't go through clock_monotonic_ns().
+static uint64_t irq_timestamp()
+{
+    return clock_uses_tsc() ? read_tsc() : 0;
+}
 
 void register_interrupt_handler(uint8_t n, isr_t handler)
 {
     interrupt_handlers[n] = handler;
 }
 
+void register_softirq(uint8_t n, softirq_t handler)
+{
+    softirq_handlers[n] = handler;
+}
+
+void softirq_raise(uint8_t n)
+{
+    uint32_t flags = irq_save();
+    this_cpu()->softirq_pending |= 1 << n;
+    irq_restore(flags);
+}
+
+void tasklet_schedule(tasklet_t *tasklet)
+{
+    uint32_t flags = irq_save();
+    if(!tasklet->scheduled){
+        cpu_t *cpu = this_cpu();
+        tasklet->scheduled = TRUE;
+        tasklet->next = cpu->tasklets;
+        cpu->tasklets = tasklet;
+        cpu->softirq_pending |= 1 << SOFTIRQ_TASKLET;
+    }
+    irq_restore(flags);
+}
+
+static void tasklet_softirq()
+{
+    cpu_t *cpu = this_cpu();
+    uint32_t flags = irq_save();
+    tasklet_t *list = cpu->tasklets;
+    cpu->tasklets = NULL;
+    irq_restore(flags);
+
+    // The list is most recent first, so turn it around to run them in the order they were scheduled.
+    tasklet_t *ordered = NULL;
+    while(list){
+        tasklet_t *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+
+    while(ordered){
+        tasklet_t *tasklet = ordered;
+        ordered = ordered->next;
+        tasklet->scheduled = FALSE;
+        tasklet->func(tasklet->data);
+    }
+}
+
+/// Runs the handlers of interrupts that arrived while this CPU was running softirqs. Called with interrupts off.
+/// \param [in] regs the registers of the interrupt the softirqs are running for. Deferred handlers see these.
+static void irq_replay_deferred(cpu_t *cpu, registers_t *regs)
+{
+    if(!cpu->irqs_deferred){
+        return;
+    }
+    max_deferred_cycles = MAX(max_deferred_cycles, irq_timestamp() - cpu->deferred_since);
+    cpu->irqs_deferred = FALSE;
+
+    for(uint32_t i = 0; i < 8; i++){
+        while(cpu->deferred_irqs[i]){
+            uint32_t bit = __builtin_ctz(cpu->deferred_irqs[i]);
+            cpu->deferred_irqs[i] &= ~(1 << bit);
+            interrupt_handlers[i * 32 + bit](regs);
+        }
+    }
+}
+
+/// Runs pending softirqs with interrupts enabled. Called, and returns, with interrupts off and the kernel lock held.
+/// Interrupts that arrive meanwhile are acknowledged straight away, but their handlers wait until softirq work
+/// stops (see irq_handler()), so neither can see the other half way through changing something.
+static void softirq_run(cpu_t *cpu, registers_t *regs)
+{
+    uint64_t start = irq_timestamp();
+    cpu->in_softirq = TRUE;
+
+    irq_replay_deferred(cpu, regs);
+    uint32_t rounds = 0;
+    while(cpu->softirq_pending && rounds++ < SOFTIRQ_MAX_ROUNDS){
+        uint32_t pending = cpu->softirq_pending;
+        cpu->softirq_pending = 0;
+
+        asm volatile("sti" : : : "memory");
+        for(uint32_t i = 0; i < NUM_SOFTIRQS; i++){
+            if((pending & (1 << i)) && softirq_handlers[i]){
+                softirq_handlers[i]();
+            }
+        }
+        asm volatile("cli" : : : "memory");
+
+        irq_replay_deferred(cpu, regs);
+    }
+
+    cpu->in_softirq = FALSE;
+    max_softirq_cycles = MAX(max_softirq_cycles, irq_timestamp() - start);
+}
+
+void irq_exit(registers_t *regs)
+{
+    cpu_t *cpu = this_cpu();
+    if(cpu->softirq_pending){
+        softirq_run(cpu, regs);
+    }
+    if(cpu->need_resched){
+        cpu->need_resched = FALSE;
+        run_scheduler(TRUE, TRUE);
+    }
+}
+
+/// \returns cycles in nanoseconds, capped so it can be printed
+static uint32_t report_ns(uint64_t cycles)
+{
+    return (uint32_t)MIN(clock_tsc_to_ns(cycles), uint32_t_MAX);
+}
+
+void irq_report_impl()
+{
+    if(!clock_uses_tsc()){
+        kprintf("Interrupt latency is only measured with the TSC as clocksource \n");
+        return;
+    }
+    kprintf("Longest with interrupts disabled in a handler: %u ns \n", report_ns(max_hard_cycles));
+    kprintf("Longest wait for a handler deferred by softirqs: %u ns (%u deferred) \n",
+            report_ns(max_deferred_cycles), deferred_count);
+    kprintf("Longest softirq run: %u ns \n", report_ns(max_softirq_cycles));
+}
+
 // This gets called from our ASM interrupt handler stub.
 void isr_handler(registers_t regs)
 {
+    // User code can leave the direction flag set, and the kernel's string instructions (its own and the compiler's)
+    // all count on it being clear. This is the first C code on the way in from the stubs, for exceptions and system
+    // calls alike.
+    asm volatile("cld" : : : "memory");
     uint8_t int_no = regs.int_no & 0xFF;
     if (interrupt_handlers[int_no] != 0)
     {
         isr_t handler = interrupt_handlers[int_no];
+        // CPU exceptions can happen while the kernel lock is already held, and all of them end in a panic anyway.
+        if (int_no < IRQ0)
+        {
+            handler(&regs);
+            return;
+        }
+        kernel_enter();
         handler(&regs);
+        irq_exit(&regs);
+        kernel_exit();
     }
     else
     {
         monitor_write("unhandled interrupt: ");
         monitor_write_hex(int_no);
         monitor_put('\n');
+        monitor_flush();
         for(;;);
     }
 }
@@ -37,20 +203,71 @@ void isr_handler(registers_t regs)
 // This gets called from our ASM interrupt handler stub.
 void irq_handler(registers_t regs)
 {
-    // Send an EOI (end of interrupt) signal to the PICs.
-    // If this interrupt involved the slave.
-    if (regs.int_no >= 40)
+    // An IRQ can interrupt user code with the direction flag set, too.
+    asm volatile("cld" : : : "memory");
+    uint64_t start = irq_timestamp();
+
+    if (regs.int_no >= APIC_TIMER || ioapic_enabled)
+    {
+        // Delivered by the local APIC, not the PICs. This is just one write to its EOI register.
+        lapic_eoi();
+    }
+    else
     {
-        // Send reset signal to slave.
-        outb(0xA0, 0x20);
+        // Send an EOI (end of interrupt) signal to the PICs.
+        // If this interrupt involved the slave.
+        if (regs.int_no >= 40)
+        {
+            // Send reset signal to slave.
+            outb(0xA0, 0x20);
+        }
+        // Send reset signal to master. (As well as slave, if necessary).
+        outb(0x20, 0x20);
     }
-    // Send reset signal to master. (As well as slave, if necessary).
-    outb(0x20, 0x20);
 
+    if (regs.int_no == IRQ0 || regs.int_no == APIC_TIMER)
+    {
+        // The profiler samples here rather than in the timer handlers, since those run later, with another
+        // context's registers, when this interrupted softirq work.
+        profile_tick(&regs);
+    }
+
+    cpu_t *cpu = this_cpu();
+    if (cpu->in_softirq)
+    {
+        // This CPU already holds the kernel lock, and is part way through some softirq. The handler runs once
+        // that's done.
+        if (interrupt_handlers[regs.int_no] != 0)
+        {
+            if (!cpu->irqs_deferred)
+            {
+                cpu->irqs_deferred = TRUE;
+                cpu->deferred_since = start;
+            }
+            cpu->deferred_irqs[regs.int_no / 32] |= 1 << (regs.int_no % 32);
+            deferred_count++;
+        }
+        return;
+    }
+    if (cpu->kernel_locked)
+    {
+        // This CPU interrupted a system call, which already holds the kernel lock. The handler itself is safe to
+        // run, but whatever it leaves for later waits for the system call to reach a preempt_point() or return.
+        if (interrupt_handlers[regs.int_no] != 0)
+        {
+            interrupt_handlers[regs.int_no](&regs);
+        }
+        max_hard_cycles = MAX(max_hard_cycles, irq_timestamp() - start);
+        return;
+    }
+
+    kernel_enter();
     if (interrupt_handlers[regs.int_no] != 0)
     {
         isr_t handler = interrupt_handlers[regs.int_no];
         handler(&regs);
     }
-
+    max_hard_cycles = MAX(max_hard_cycles, irq_timestamp() - start);
+    irq_exit(&regs);
+    kernel_exit();
 }
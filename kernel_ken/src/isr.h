@@ -26,6 +26,11 @@
 #define IRQ14 46
 #define IRQ15 47
 
+// Vectors used by the local APIC. They sit well above the remapped PIC range.
+#define APIC_TIMER 0xEF
+#define IPI_RESCHEDULE 0xF0
+#define APIC_SPURIOUS 0xFF
+
 typedef struct registers
 {
     uint32_t ds;                  // Data segment selector
@@ -40,5 +45,42 @@ typedef struct registers
 typedef void (*isr_t)(registers_t*);
 void register_interrupt_handler(uint8_t n, isr_t handler);
 
+// Softirqs: work an interrupt handler leaves to run on its way out of the kernel, with interrupts enabled again.
+// Lower numbers run first.
+#define SOFTIRQ_TIMER   0
+#define SOFTIRQ_TASKLET 1
+#define NUM_SOFTIRQS    2
+
+typedef void (*softirq_t)();
+
+/// Sets the function that runs when softirq n is raised.
+void register_softirq(uint8_t n, softirq_t handler);
+
+/// Marks softirq n as pending on this CPU. It runs before the interrupt (or system call) being handled returns.
+void softirq_raise(uint8_t n);
+
+/// A one-off piece of deferred work, eg. a driver's completion handling. It can be scheduled again as soon as it
+/// has started running.
+typedef struct tasklet
+{
+    void (*func)(void *data);
+    void *data;
+    struct tasklet *next;
+    volatile uint32_t scheduled;
+} tasklet_t;
+
+/// The last thing done before leaving the kernel after an interrupt or system call: runs the work handlers left
+/// for later, then the scheduler if anything asked for it. Called with interrupts off and the kernel lock held.
+/// \param [in] regs the registers of the interrupt or system call being returned from
+void irq_exit(registers_t *regs);
+
+/// Queues tasklet to run on this CPU from the tasklet softirq. Does nothing if it is already queued.
+void tasklet_schedule(tasklet_t *tasklet);
+
+/// Prints the longest times spent handling interrupts since boot: with interrupts disabled in a handler (including
+/// waiting for the kernel lock), waiting for a handler that arrived during softirq work, and running softirqs.
+/// They're measured with the TSC, so only when it's the clocksource.
+void irq_report_impl();
+
 
 #endif
\ No newline at end of file
@@ -8,28 +8,42 @@
 #include "monitor.h"
 #include "descriptor_tables.h"
 #include "timer.h"
+#include "smp.h"
+#include "clock.h"
+#include "apic.h"
+#include "serial.h"
+#include "print.h"
+#include "algorithm.h"
 
 // Output a null-terminated ASCII string to the monitor
 void print(const char *c)
 {
-    syscall_monitor_write(c);
+    stdout_write(c, strlen(c));
 }
 
 // Print an unsigned integer to the monitor in base 16
 void print_hex(unsigned int n)
 {
-    syscall_monitor_write_hex(n);
+    char result[32] = "0x";
+    utoa(n, result + 2, 16);
+    stdout_write(result, strlen(result));
 }
 
 // Print an unsigned integer to the monitor in base 10
 void print_dec(unsigned int n)
 {
-    syscall_monitor_write_dec(n);
+    char result[32];
+    utoa(n, result, 10);
+    stdout_write(result, strlen(result));
 }
 
 int fork()
 {
-    return syscall_fork_impl();
+    // Otherwise the child would get its own copy of anything still buffered, and print it again.
+    stdout_fork_begin();
+    int pid = syscall_fork_impl();
+    stdout_fork_end();
+    return pid;
 }
 
 int getpid()
@@ -37,6 +51,14 @@ int getpid()
     return syscall_getpid_impl();
 }
 
+/// \returns TRUE if CPUID says there's SSE2, and with it the movnti instruction memset() streams with
+static int sse2_present()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return (edx & (1 << 26)) != 0;
+}
+
 ///
 /// Due to some confusion on how exactly things should be laid out, I ended up putting my OS
 /// initialization in here. With the addition of a user_app.c (and .h) file, this is not really
@@ -53,20 +75,29 @@ void initialise_tasking()
     already_called = TRUE;
 
     init_descriptor_tables();
+    memory_use_nontemporal(sse2_present());
+    serial_init(SERIAL_BAUD);
     monitor_clear();
-    asm volatile("sti");
+    asm volatile("sti" : : : "memory");
     init_timer(TICKS_PER_SECOND);
+    clock_init();
+    smp_detect();
     initialise_paging();
+    apic_init();
     initialise_scheduler();
     initialise_syscalls();
+    smp_init();
+    timer_init_lapic();
     switch_to_user_mode();
 
-    // I think this is kind of dumb, but I don't see a way around it right now.
-    // For the first process created (the parent of everything) just sit in a spinlock
-    // this is only scheduled if nothing else is running (due to having a fixed priority of 11)
+    // The first process created is the parent of everything, but has nothing to do itself. It blocks on a
+    // semaphore that's never signalled, so whenever nothing else is running the CPU halts in its idle task.
     if(fork() != 0) {
         assert(getpid() == 1);
-        for(;;);
+        int never = open_sem(0);
+        for(;;) {
+            wait(never);
+        }
     }
 
 }
@@ -88,6 +119,7 @@ void free(void *p)
 
 void exit()
 {
+    stdout_flush();
     syscall_exit_impl();
 }
 
@@ -4,9 +4,11 @@
 
 #include "print.h"
 #include "algorithm.h"
+#include "klog.h"
 
 #define ksnprintf(buf,size,fmt,...) __snprintf__internal((uint32_t)buf, (uint32_t)size, (uint32_t)fmt, ##__VA_ARGS__)
 #define kprintf(fmt, ...) __kernel__printf__internal((uint32_t)fmt, ##__VA_ARGS__)
+#define klog(level, fmt, ...) __klog__internal((uint32_t)level, (uint32_t)fmt, ##__VA_ARGS__)
 
 
 
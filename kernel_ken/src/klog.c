@@ -0,0 +1,162 @@
+// klog.c -- The kernel log.
+
+#include "klog.h"
+#include "algorithm.h"
+#include "monitor.h"
+#include "clock.h"
+#include "smp.h"
+
+typedef struct
+{
+    // Sequence number of the message in the entry, set before it's written. Complete once done is TRUE as well.
+    volatile uint32_t seq;
+    volatile uint32_t done;
+    uint8_t level;
+    uint8_t cpu;
+    uint16_t length;
+    uint64_t time_ns;
+    char text[KLOG_TEXT_SIZE];
+} klog_entry_t;
+
+static klog_entry_t entries[KLOG_ENTRIES];
+// Sequence number of the next message. Message seq goes in entries[seq % KLOG_ENTRIES].
+static volatile uint32_t next_seq = 0;
+// The cursor dmesg() uses when it isn't given one.
+static uint32_t drain_seq = 0;
+static int console_level = KLOG_CONSOLE_LEVEL;
+
+static const char *level_names[] = {"ERR", "WARN", "INFO", "DEBUG"};
+
+void klog_write(uint32_t level, const char *text)
+{
+    level = MIN(level, KLOG_DEBUG);
+
+    // Taking a sequence number is the only thing writers have to agree on, and it's a single locked instruction.
+    // Anyone logging at the same time (another CPU, or an interrupt handler on this one) gets a different entry.
+    uint32_t seq = __sync_fetch_and_add(&next_seq, 1);
+    klog_entry_t *entry = &entries[seq % KLOG_ENTRIES];
+    entry->done = FALSE;
+    asm volatile("" : : : "memory");
+    entry->seq = seq;
+
+    entry->time_ns = clock_monotonic_ns();
+    entry->level = level;
+    entry->cpu = this_cpu()->index;
+    uint32_t length = 0;
+    while(length < KLOG_TEXT_SIZE - 1 && text[length]){
+        entry->text[length] = text[length];
+        length++;
+    }
+    entry->text[length] = '\0';
+    entry->length = length;
+
+    asm volatile("" : : : "memory");
+    entry->done = TRUE;
+
+    if((int)level <= console_level){
+        monitor_write(text);
+    }
+}
+
+/// Writes n to out in decimal, padded with zeros to at least digits digits.
+/// \returns how many characters were written
+static uint32_t format_padded(char *out, uint32_t n, uint32_t digits)
+{
+    char reversed[10];
+    uint32_t count = 0;
+    do {
+        reversed[count++] = '0' + n % 10;
+        n /= 10;
+    } while(n);
+    while(count < digits){
+        reversed[count++] = '0';
+    }
+    for(uint32_t i = 0; i < count; i++){
+        out[i] = reversed[count - 1 - i];
+    }
+    return count;
+}
+
+/// Formats one message as a line of dmesg() output.
+/// \returns the length of the line, which is never more than KLOG_TEXT_SIZE + 32
+static uint32_t format_entry(const klog_entry_t *entry, char *out)
+{
+    uint32_t seconds = udiv64(entry->time_ns, NS_PER_SECOND);
+    uint32_t micros = (uint32_t)(entry->time_ns - (uint64_t)seconds * NS_PER_SECOND) / 1000;
+
+    uint32_t n = 0;
+    out[n++] = '[';
+    n += format_padded(out + n, seconds, 1);
+    out[n++] = '.';
+    n += format_padded(out + n, micros, 6);
+    out[n++] = ']';
+    out[n++] = ' ';
+    for(const char *name = level_names[entry->level]; *name; name++){
+        out[n++] = *name;
+    }
+    out[n++] = ':';
+    out[n++] = ' ';
+    memcpy(out + n, entry->text, entry->length);
+    n += entry->length;
+    if(entry->length == 0 || entry->text[entry->length - 1] != '\n'){
+        out[n++] = '\n';
+    }
+    return n;
+}
+
+int dmesg_impl(char *buf, uint32_t size, uint32_t *cursor)
+{
+    if(!buf || size == 0){
+        return -1;
+    }
+
+    uint32_t *pos = cursor ? cursor : &drain_seq;
+    uint32_t end = next_seq;
+    if(end - *pos > KLOG_ENTRIES){
+        // Everything before this has been written over.
+        *pos = end - KLOG_ENTRIES;
+    }
+
+    uint32_t used = 0;
+    char line[KLOG_TEXT_SIZE + 32];
+    while(*pos != end){
+        const klog_entry_t *entry = &entries[*pos % KLOG_ENTRIES];
+        // Signed, since sequence numbers wrap.
+        int32_t age = (int32_t)(*pos - entry->seq);
+        if(age > 0 || (age == 0 && !entry->done)){
+            // Not written yet, or still being written. It'll be there next time.
+            break;
+        }
+        if(age < 0){
+            // Written over by a newer message since end was read.
+            (*pos)++;
+            continue;
+        }
+
+        uint32_t length = format_entry(entry, line);
+        asm volatile("" : : : "memory");
+        if(!entry->done || entry->seq != *pos){
+            // A newer message started going in while this one was being copied, so the copy could be of either.
+            (*pos)++;
+            continue;
+        }
+        if(used + length >= size){
+            break;
+        }
+        memcpy(buf + used, line, length);
+        used += length;
+        (*pos)++;
+    }
+    buf[used] = '\0';
+    return used;
+}
+
+int klog_set_console_level_impl(int level)
+{
+    if(level < KLOG_ERR || level > KLOG_DEBUG){
+        return -1;
+    }
+    int previous = console_level;
+    console_level = level;
+    return previous;
+}
@@ -0,0 +1,44 @@
+// klog.h -- The kernel log: a fixed-size ring of timestamped messages with severity levels, read back with the
+//           dmesg() system call. kprintf() logs at KLOG_INFO, and klog() (klib.h) at any level.
+
+#ifndef KLOG_H
+#define KLOG_H
+
+#include "common.h"
+
+// Severity levels, most severe first.
+#define KLOG_ERR    0
+#define KLOG_WARN   1
+#define KLOG_INFO   2
+#define KLOG_DEBUG  3
+
+// Messages at this level or more severe are also printed to the console. Change it with klog_set_console_level().
+#ifndef KLOG_CONSOLE_LEVEL
+    #define KLOG_CONSOLE_LEVEL KLOG_INFO
+#endif
+
+#define KLOG_ENTRIES    256
+// Longer messages are cut short in the log (but not on the console).
+#define KLOG_TEXT_SIZE  112
+
+/// Adds a message to the log, and prints it if level is at or above the console level. Adding it never waits for
+/// other writers, so that much is safe from anywhere, including interrupt handlers. Printing it goes through
+/// monitor_write(), which needs the kernel lock, and mustn't interrupt another monitor_write() on the same CPU. So
+/// anything that can run without the lock (or in a handler that interrupted a system call) should log below the
+/// console level.
+void klog_write(uint32_t level, const char *text);
+
+/// Copies log messages into buf as text, one line each: "[seconds.microseconds] LEVEL: message".
+/// \param [in] buf where the lines go. It's always null terminated.
+/// \param [in] size size of buf in bytes
+/// \param [in,out] cursor sequence number of the next message to read, updated to the one after the last message
+/// copied. Start from 0. If NULL, the log's own cursor is used, so every message is only read once (draining it).
+/// Messages that have already been overwritten are skipped.
+/// \returns how many bytes were copied (not counting the null terminator), or -1 if buf is NULL or size is 0
+int dmesg_impl(char *buf, uint32_t size, uint32_t *cursor);
+
+/// Sets which messages are printed to the console as well as logged: level and everything more severe.
+/// \returns the previous level, or -1 if level isn't a KLOG_* level
+int klog_set_console_level_impl(int level);
+
+#endif
@@ -0,0 +1,43 @@
+// ksyms.c -- Looks addresses up in the kernel's symbol table.
+
+#include "ksyms.h"
+
+const char *ksym_lookup(uint32_t address, uint32_t *offset)
+{
+    if(ksyms_count == 0 || address < ksyms[0].address || address >= ksyms[ksyms_count].address){
+        return NULL;
+    }
+
+    // Find the last symbol at or below address.
+    uint32_t low = 0;
+    uint32_t high = ksyms_count;
+    while(high - low > 1){
+        uint32_t middle = low + (high - low) / 2;
+        if(ksyms[middle].address <= address){
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+
+    if(offset){
+        *offset = address - ksyms[low].address;
+    }
+    return &ksym_names[ksyms[low].name];
+}
+
+int ksym_name_impl(uint32_t address, char *buf, uint32_t size)
+{
+    uint32_t offset;
+    const char *name = ksym_lookup(address, &offset);
+    if(!name || !buf || size == 0){
+        return -1;
+    }
+
+    uint32_t i = 0;
+    for(; name[i] && i < size - 1; i++){
+        buf[i] = name[i];
+    }
+    buf[i] = '\0';
+    return offset;
+}
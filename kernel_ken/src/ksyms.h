@@ -0,0 +1,30 @@
+// ksyms.h -- The kernel's own symbol table, so that it can name the functions addresses are in. The table itself
+//            (ksyms_table.c) is generated from the linked kernel by gen_ksyms.sh; see the Makefile's link rule.
+
+#ifndef KSYMS_H
+#define KSYMS_H
+
+#include "common.h"
+
+typedef struct
+{
+    uint32_t address;
+    uint32_t name;      // Offset of the name in ksym_names
+} ksym_t;
+
+// Every function in the kernel, lowest address first. There's one more entry than ksyms_count, whose address is
+// where the last function ends.
+extern ksym_t ksyms[];
+extern uint32_t ksyms_count;
+extern char ksym_names[];
+
+/// Finds the function address is in.
+/// \param [out] offset how far into the function address is. May be NULL.
+/// \returns the function's name, or NULL if address isn't in any
+const char *ksym_lookup(uint32_t address, uint32_t *offset);
+
+/// Copies the name of the function address is in into buf, truncated to fit and null terminated.
+/// \returns how far into the function address is, or -1 if it isn't in one (or buf is NULL or size is 0)
+int ksym_name_impl(uint32_t address, char *buf, uint32_t size);
+
+#endif
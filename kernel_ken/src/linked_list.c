@@ -77,6 +77,25 @@ int list_add_front(list_t *list, void *value)
     return 0;
 }
 
+int list_insert_before(list_t *list, struct linked_list_node *node, void *value)
+{
+    if (!list)
+        return -1;
+
+    if (!node)
+        return list_add_back(list, value);
+    if (node == list->front)
+        return list_add_front(list, value);
+
+    struct linked_list_node *new_node = list_node_init(value);
+    new_node->previous = node->previous;
+    new_node->next = node;
+    node->previous->next = new_node;
+    node->previous = new_node;
+
+    return 0;
+}
+
 void *list_remove_front(list_t *list)
 {
     if(list_is_empty(list))
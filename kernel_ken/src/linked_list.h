@@ -23,6 +23,8 @@ list_t *list_init();
 int list_destroy(list_t *list);
 int list_add_back(list_t *list, void *value);
 int list_add_front(list_t *list, void *value);
+/// Inserts value just before node, or at the back if node is NULL.
+int list_insert_before(list_t *list, struct linked_list_node *node, void *value);
 void *list_remove_front(list_t *list);
 void *list_remove_back(list_t *list);
 int list_is_empty(list_t *list);
@@ -3,6 +3,7 @@
 //             but rewritten for JamesM's kernel tutorials.
 
 #include "monitor.h"
+#include "serial.h"
 
 // The VGA framebuffer starts at 0xB8000.
 uint16_t *video_memory = (uint16_t *)0xB8000;
@@ -10,6 +11,24 @@ uint16_t *video_memory = (uint16_t *)0xB8000;
 uint8_t cursor_x = 0;
 uint8_t cursor_y = 0;
 
+// Everything is drawn into this copy of the screen in RAM, and only copied to video memory (slow, uncached MMIO) by
+// monitor_flush(). Its rows are a ring: screen row y is shadow[(top_row + y) % 25], so scrolling just moves top_row.
+static uint16_t shadow[25][80];
+static uint32_t top_row = 0;
+// Bit y set if screen row y has changed since the last flush.
+static uint32_t dirty_rows = 0;
+static int cursor_moved = FALSE;
+// Set while a process has the screen (see screen.c). Output still goes into the shadow.
+static int suspended = FALSE;
+
+#define ALL_ROWS ((1 << 25) - 1)
+
+// \returns screen row y of the shadow
+static uint16_t *shadow_row(uint32_t y)
+{
+    return shadow[(top_row + y) % 25];
+}
+
 // Updates the hardware cursor.
 static void move_cursor()
 {
@@ -32,27 +51,26 @@ static void scroll()
     // Row 25 is the end, this means we need to scroll up
     if(cursor_y >= 25)
     {
-        // Move the current text chunk that makes up the screen
-        // back in the buffer by a line
-        int i;
-        for (i = 0*80; i < 24*80; i++)
-        {
-            video_memory[i] = video_memory[i+80];
-        }
+        // The old top row becomes the new bottom row.
+        top_row = (top_row + 1) % 25;
 
         // The last line should now be blank. Do this by writing
         // 80 spaces to it.
-        for (i = 24*80; i < 25*80; i++)
+        uint16_t *row = shadow_row(24);
+        int i;
+        for (i = 0; i < 80; i++)
         {
-            video_memory[i] = blank;
+            row[i] = blank;
         }
+        // Every row of video memory has to move up.
+        dirty_rows = ALL_ROWS;
         // The cursor should now be on the last line.
         cursor_y = 24;
     }
 }
 
-// Writes a single character out to the screen.
-void monitor_put(char c)
+// Writes a single character into the shadow screen.
+static void put_char(char c)
 {
     // The background colour is black (0), the foreground is white (15).
     uint8_t backColour = 0;
@@ -64,7 +82,6 @@ void monitor_put(char c)
     // The attribute byte is the top 8 bits of the word we have to send to the
     // VGA board.
     uint16_t attribute = attributeByte << 8;
-    uint16_t *location;
 
     // Handle a backspace, by moving the cursor back one space
     if (c == 0x08 && cursor_x)
@@ -94,8 +111,8 @@ void monitor_put(char c)
     // Handle any other printable character.
     else if(c >= ' ')
     {
-        location = video_memory + (cursor_y*80 + cursor_x);
-        *location = c | attribute;
+        shadow_row(cursor_y)[cursor_x] = c | attribute;
+        dirty_rows |= 1 << cursor_y;
         cursor_x++;
     }
 
@@ -109,9 +126,14 @@ void monitor_put(char c)
 
     // Scroll the screen if needed.
     scroll();
-    // Move the hardware cursor.
-    move_cursor();
+    cursor_moved = TRUE;
+}
 
+// Writes a single character out to the screen.
+void monitor_put(char c)
+{
+    put_char(c);
+    serial_write_n(&c, 1);
 }
 
 // Clears the screen, by copying lots of spaces to the framebuffer.
@@ -121,30 +143,119 @@ void monitor_clear()
     uint8_t attributeByte = (0 /*black*/ << 4) | (15 /*white*/ & 0x0F);
     uint16_t blank = 0x20 /* space */ | (attributeByte << 8);
 
-    int i;
-    for (i = 0; i < 80*25; i++)
+    for (int y = 0; y < SCREEN_HEIGHT; y++)
     {
-        video_memory[i] = blank;
+        for (int x = 0; x < SCREEN_WIDTH; x++)
+        {
+            shadow[y][x] = blank;
+        }
     }
+    top_row = 0;
+    dirty_rows = ALL_ROWS;
 
     // Move the hardware cursor back to the start.
     cursor_x = 0;
     cursor_y = 0;
-    move_cursor();
+    cursor_moved = TRUE;
+}
+
+int monitor_blit_impl(const uint16_t *cells, const screen_rect_t *dirty)
+{
+    if(!cells)
+    {
+        return -1;
+    }
+    screen_rect_t rect = {0, 0, SCREEN_WIDTH, SCREEN_HEIGHT};
+    if(dirty)
+    {
+        rect = *dirty;
+    }
+    if(rect.width < 0 || rect.height < 0)
+    {
+        return -1;
+    }
+
+    // The far edges are worked out in 64 bits, since x + width can be past INT_MAX.
+    int left = MIN(MAX(rect.x, 0), SCREEN_WIDTH);
+    int top = MIN(MAX(rect.y, 0), SCREEN_HEIGHT);
+    int right = (int)MAX(MIN((int64_t)rect.x + rect.width, SCREEN_WIDTH), 0);
+    int bottom = (int)MAX(MIN((int64_t)rect.y + rect.height, SCREEN_HEIGHT), 0);
+    for (int y = top; y < bottom && left < right; y++)
+    {
+        memcpy(shadow_row(y) + left, cells + y * SCREEN_WIDTH + left, (right - left) * sizeof(uint16_t));
+        dirty_rows |= 1 << y;
+    }
+    return 0;
+}
+
+void monitor_suspend()
+{
+    suspended = TRUE;
+}
+
+void monitor_resume()
+{
+    suspended = FALSE;
+    // Whatever the process drew is still in video memory.
+    dirty_rows = ALL_ROWS;
+    cursor_moved = TRUE;
+}
+
+void monitor_flush()
+{
+    if(suspended)
+    {
+        return;
+    }
+    if(dirty_rows)
+    {
+        for (uint32_t y = 0; y < 25; y++)
+        {
+            if (dirty_rows & (1 << y))
+            {
+                memcpy(video_memory + y * 80, shadow_row(y), 80 * sizeof(uint16_t));
+            }
+        }
+        dirty_rows = 0;
+    }
+    if(cursor_moved)
+    {
+        move_cursor();
+        cursor_moved = FALSE;
+    }
+}
+
+// \returns TRUE if c is exactly one character short of filling the whole screen. Only looks that far into c.
+static int is_full_screen(const char *c)
+{
+    for (int i = 0; i < 80 * 25 - 1; i++)
+    {
+        if (!c[i])
+        {
+            return FALSE;
+        }
+    }
+    return c[80 * 25 - 1] == '\0';
 }
 
 // Outputs a null-terminated ASCII string to the monitor.
 void monitor_write(const char *c)
 {
-    if(strlen(c) == 80 * 25 - 1){
+    // A whole screen's worth is a redraw (see maze and perlin_noise), so it starts from the top left corner.
+    if(is_full_screen(c)){
         monitor_clear();
     }
 
-    int i = 0;
-    while (c[i])
+    monitor_write_n(c, uint32_t_MAX);
+}
+
+void monitor_write_n(const char *c, uint32_t length)
+{
+    for (uint32_t i = 0; i < length && c[i]; i++)
     {
-        monitor_put(c[i++]);
+        put_char(c[i]);
     }
+    serial_write_n(c, length);
 }
 
 void monitor_write_hex(uint32_t n)
@@ -169,10 +280,8 @@ void monitor_colour(int x, int y, unsigned int colour)
     uint16_t clearing_bitmask = 0x7F;
     uint16_t colour_set_bitmask = (uint16_t)(colour << 12);
 
-    uint16_t *memory_location = video_memory + (y * 80) + x;
+    uint16_t *memory_location = shadow_row(y) + x;
 
     *memory_location = ((*memory_location & clearing_bitmask) | colour_set_bitmask);
-
-
-
+    dirty_rows |= 1 << y;
 }
@@ -6,6 +6,25 @@
 
 #include "common.h"
 
+#define SCREEN_WIDTH 80
+#define SCREEN_HEIGHT 25
+
+/// One character cell of the screen, as video memory stores it: the character, then its foreground and background
+/// colours (COLOUR_*).
+#define SCREEN_CELL(c, fore, back) ((uint16_t)((uint8_t)(c) | (((fore) & 0xF) << 8) | (((back) & 0xF) << 12)))
+
+/// A rectangle of the screen, in character cells.
+typedef struct
+{
+    int x;
+    int y;
+    int width;
+    int height;
+} screen_rect_t;
+
+// Everything below draws into a copy of the screen in RAM, and text output is also sent to COM1 (see serial.h). It reaches video memory (and the hardware cursor moves)
+// on monitor_flush(), which the timer softirq calls every tick.
+
 // Write a single character out to the screen.
 void monitor_put(char c);
 
@@ -15,6 +34,9 @@ void monitor_clear();
 /// Output a null-terminated ASCII string to the monitor.
 void monitor_write(const char *c);
 
+/// Output at most length characters of c (stopping early at a null terminator) to the monitor.
+void monitor_write_n(const char *c, uint32_t length);
+
 ///
 void monitor_write_hex(uint32_t n);
 
@@ -22,5 +44,20 @@ void monitor_write_dec(uint32_t n);
 
 void monitor_colour(int x, int y, unsigned int colour);
 
+/// Copies a rectangle of cells onto the screen. Backs the monitor_blit() system call.
+/// \param [in] cells a whole screen's worth of cells, SCREEN_WIDTH per row
+/// \param [in] dirty the part of cells to copy, or NULL for all of it. It's clipped to the screen.
+/// \returns 0 on success, or -1 if cells is NULL or dirty has a negative width or height
+int monitor_blit_impl(const uint16_t *cells, const screen_rect_t *dirty);
+
+/// Stops monitor_flush() from touching video memory, while a process has the screen.
+void monitor_suspend();
+
+/// Lets monitor_flush() draw again, starting with the whole shadow screen.
+void monitor_resume();
+
+/// Copies the rows that changed since the last flush to video memory, and moves the hardware cursor if it moved.
+void monitor_flush();
+
 
 #endif // MONITOR_H
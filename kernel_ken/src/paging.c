@@ -5,13 +5,14 @@
 #include "kheap.h"
 #include "monitor.h"
 #include "klib.h"
+#include "smp.h"
+#include "apic.h"
+#include "task.h"
+#include "trace.h"
 
 // The kernel's page directory
 page_directory_t *kernel_directory=0;
 
-// The current page directory;
-page_directory_t *current_directory=0;
-
 // A block of memory we can jump to when we have to clean up processes.
 // Effectively an always available kernel stack, if you will.
 uint32_t kernel_cleanup_stack = NULL;
@@ -241,6 +242,7 @@ void alloc_frame(page_t *page, int is_kernel, int is_writeable)
             // PANIC! no free frames!!
         }
         set_frame(idx*0x1000);
+        TRACE(TRACE_FRAME_ALLOC, idx*0x1000, 0, 0);
 
         page_set_present(page, 1);
         page_set_rw(page, (is_writeable)?1:0);
@@ -249,6 +251,17 @@ void alloc_frame(page_t *page, int is_kernel, int is_writeable)
     }
 }
 
+void map_mmio(uint32_t address, page_directory_t *dir)
+{
+    page_t *page = get_page(address, 1, dir);
+    page_set_frame(page, address / PAGE_SIZE);
+    page_set_present(page, 1);
+    page_set_rw(page, 1);
+    page_set_user(page, 0);
+    // PWT | PCD: device registers must never be cached.
+    page->contents |= 0x18;
+}
+
 // Function to deallocate a frame.
 void free_frame(page_t *page)
 {
@@ -261,6 +274,7 @@ void free_frame(page_t *page)
     } else {
         ASSERT(test_frame(frame*0x1000)); // Check we're freeing an allocated frame...
         clear_frame(frame*0x1000);
+        TRACE(TRACE_FRAME_FREE, frame*0x1000, 0, 0);
         page_set_present(page, 0);
         ASSERT(!test_frame(frame*0x1000)); // Check we're freeing an allocated frame...
     }
@@ -308,6 +322,9 @@ void initialise_paging()
 
     alloc_frame(get_page(KHEAP_MAX, 1, kernel_directory), FALSE, FALSE);
 
+    // Anything mapped after kernel_directory gets cloned below won't be visible to processes.
+    apic_map_registers();
+
     // Also, while we're at it, we never allocated any of the frames in the kernel heap.
     for(i = KHEAP_START; i < KHEAP_START + KHEAP_INITIAL_SIZE; i += PAGE_SIZE) {
         alloc_frame(get_page(i, 1, kernel_directory), FALSE, FALSE);
@@ -329,11 +346,11 @@ void initialise_paging()
 void switch_page_directory(page_directory_t *dir)
 {
     current_directory = dir;
-    asm volatile("mov %0, %%cr3":: "r"(dir->physicalAddr));
+    asm volatile("mov %0, %%cr3":: "r"(dir->physicalAddr) : "memory");
     uint32_t cr0;
     asm volatile("mov %%cr0, %0": "=r"(cr0));
     cr0 |= 0x80000000; // Enable paging!
-    asm volatile("mov %0, %%cr0":: "r"(cr0));
+    asm volatile("mov %0, %%cr0":: "r"(cr0) : "memory");
 }
 
 page_t *get_page(uint32_t address, int make, page_directory_t *dir)
@@ -406,7 +423,7 @@ void copy_page(page_t *dest, page_t *src)
     // Flush the TLB. I assume there's a better way to do this, but I don't know how right now.
     uint32_t pagedir_addr;
     asm volatile("mov %%cr3, %0" : "=r" (pagedir_addr));
-    asm volatile("mov %0, %%cr3" : : "r" (pagedir_addr));
+    asm volatile("mov %0, %%cr3" : : "r" (pagedir_addr) : "memory");
 
     memcpy(dest_copy_buffer, src_copy_buffer, PAGE_SIZE);
 }
@@ -433,6 +450,10 @@ page_table_t *copy_table(page_table_t *src, uint32_t *physical_addr)
         page_set_user(&table->pages[i], page_get_user(&src->pages[i] ));
 
         copy_page(&table->pages[i], &src->pages[i]);
+
+        // Copying an address space page by page is the longest thing fork() does. Every page is a whole step,
+        // so other tasks (and the timer softirq) can have a turn in between, unless fork_impl() has turned that off.
+        preempt_point();
     }
 
     return table;
@@ -451,6 +472,7 @@ page_directory_t *clone_directory(page_directory_t *src)
     directory->physicalAddr = virtual_to_physical_address((uint32_t)directory->tablesPhysical);
     ASSERT((uint32_t)directory % PAGE_SIZE == 0);
     ASSERT(directory->physicalAddr % PAGE_SIZE == 0);
+    directory->refcount = 1;
 
     int i;
     for(i = 0; i < 1024; i++){
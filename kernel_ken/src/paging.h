@@ -6,6 +6,7 @@
 
 #include "common.h"
 #include "isr.h"
+#include "linked_list.h"
 
 // I can't do this justice. Go read the tutorial at
 // https://wiki.osdev.org/Paging
@@ -48,6 +49,14 @@ typedef struct page_directory
     /// when we get our kernel heap allocated and the directory
     /// may be in a different location in virtual memory.
     uint32_t physicalAddr;
+
+    /// Number of tasks using this address space. A process and all of its threads share one directory (and heap),
+    /// which is only torn down once the last of them exits.
+    uint32_t refcount;
+
+    /// IDs of the tasks using this address space that have exited but haven't been joined yet. NULL until the first
+    /// of them exits while others are still running.
+    list_t *exited_threads;
 } page_directory_t;
 
 uint32_t get_number_free_frames();
@@ -70,6 +79,10 @@ page_t *get_page(uint32_t address, int make, page_directory_t *dir);
 void page_fault(registers_t *regs);
 
 void alloc_frame(page_t *page, int is_kernel, int is_writeable);
+
+/// Identity maps the page containing a memory-mapped device register block, uncached and kernel only.
+/// The frame is outside of physical RAM, so it isn't tracked in the frames bitset.
+void map_mmio(uint32_t address, page_directory_t *dir);
 void free_frame(page_t *page);
 
 
@@ -2,12 +2,13 @@
 #include "kheap.h"
 #include "linked_list.h"
 #include "task.h"
+#include "smp.h"
+#include "trace.h"
 
 #define PIPE_ERROR -1
 
 extern uint32_t pipe_id_generator;
 extern list_t *pipe_list;
-extern task_t *current_process;
 
 static void pipe_destroy(pipe_t *pipe)
 {
@@ -101,14 +102,14 @@ int write_impl(int fildes, const void *buf, unsigned int nbyte)
         return 0; // Not enough space.
     }
 
-    // It's safe to write everything.
+    // It's safe to write everything. That's at most two copies: up to the end of the buffer, then from its start.
     const uint8_t *bytes = buf;
-    for(uint32_t i = 0; i < nbyte; i++){
-        pipe->buffer[pipe->head] = bytes[i];
-        pipe->head = (pipe->head + 1) % PIPE_BUFFER_SIZE;
-
-    }
+    uint32_t first = MIN(nbyte, PIPE_BUFFER_SIZE - pipe->head);
+    memcpy(&pipe->buffer[pipe->head], bytes, first);
+    memcpy(pipe->buffer, bytes + first, nbyte - first);
+    pipe->head = (pipe->head + nbyte) % PIPE_BUFFER_SIZE;
     pipe->bytes_stored += nbyte;
+    TRACE(TRACE_PIPE_WRITE, fildes, nbyte, pipe->bytes_stored);
     return nbyte;
 }
 
@@ -130,11 +131,12 @@ int read_impl(int fildes, void *buf, unsigned int nbyte)
     }
 
     uint8_t *bytes = buf;
-    for(uint32_t i = 0; i < nbyte; i++){
-        bytes[i] = pipe->buffer[pipe->tail];
-        pipe->tail = (pipe->tail + 1) % PIPE_BUFFER_SIZE;
-    }
+    uint32_t first = MIN(nbyte, PIPE_BUFFER_SIZE - pipe->tail);
+    memcpy(bytes, &pipe->buffer[pipe->tail], first);
+    memcpy(bytes + first, pipe->buffer, nbyte - first);
+    pipe->tail = (pipe->tail + nbyte) % PIPE_BUFFER_SIZE;
     pipe->bytes_stored -= nbyte;
+    TRACE(TRACE_PIPE_READ, fildes, nbyte, pipe->bytes_stored);
 
     return nbyte;
 }
@@ -2,6 +2,8 @@
 #include "print.h"
 #include "monitor.h"
 #include "syscall.h"
+#include "klog.h"
+#include "spinlock.h"
 /*
                                                  __----~~~~~~~~~~~------___
                                       .  .   ~~//====......          __--~ ~~
@@ -27,193 +29,343 @@
 
 
 
-// See https://stackoverflow.com/questions/16647278/minimal-implementation-of-sprintf-or-printf
-
-
-// Sadly we don't have access to <stdarg.h> or anything else that might make this half ways sane.
-// So, we have to resort to black magic to get this to work.
-//
-// The arguments SHOULD be located on the stack as follows:
-//      [ Return Address, ... , Last Named Variable, First Vargs Item, Second Vargs Item, ...   ]
-//     0xc000  <---- (Example addresses because 'high' and 'low' are confusing for stacks) ----> 0xc02F
-//
-// This is because the GCC convention is to push parameters to the stack in reverse order
-//
-// Example:
-//
-//          EXAMPLE function declaration: my_func(uint32_t a, ...)
-//          EXAMPLE function call       : my_func(10, 20, 30, 40)
-//
-// So we can do something like this:
-//          uint32_t* vargs_start = (&a) + 1;      // <--- Start of the '...' part
+// The formatter writes straight into the caller's buffer in a single pass, and converts numbers into a few bytes on
+// the stack. Like C's snprintf(), it keeps counting once the
+// buffer is full, so callers get the length the whole output would have had.
 //
-// thus:
-//          print(a)
-//          print(vargs_start[0]
-//          print(vargs_start[1]
-//          print(vargs_start[2]
-//
-// would print out:
-//          10, 20, 30, 40
+// Arguments are read with GCC's <stdarg.h>, which comes with the compiler rather than a C library, so it's there in
+// a freestanding kernel too. The printf macros cast everything to uint32_t on the way in (I can't get varargs to
+// work with a char* as the last named argument), which is harmless on i386.
 
-// Also, for some reason, I can't get varargs to work with a char* as the last named argument, hence the
-// absolutely absurd macros.
+// Big enough for any double ftoa_fixed() produces: up to 309 digits before the point, and 15 after.
+#define FLOAT_BUFFER_SIZE 352
 
 static void ftoa_fixed(char *buffer, double value);
 static void ftoa_sci(char *buffer, double value);
 
+typedef struct
+{
+    char *buffer;
+    uint32_t capacity;  // not counting the null terminator
+    uint32_t length;    // of the whole output, even the part that didn't fit
+} format_output_t;
 
-//
-// These read contents off the stack in a way that doesn't completely suck
-// They more or less replace va_arg from <stdarg.h>, but a lot more janky
-//
-
-int varg_next_int(void **arg)
+typedef struct
+{
+    uint8_t left;       // '-': pad on the right
+    uint8_t zero;       // '0': pad numbers with zeros
+    char sign;          // '+' or ' ' in front of positive numbers, or 0 for nothing
+    int width;
+    int precision;      // -1 if not given
+} format_spec_t;
+
+static void emit(format_output_t *out, char c)
 {
-    int *cast = *arg;
+    if(out->length < out->capacity){
+        out->buffer[out->length] = c;
+    }
+    out->length++;
+}
 
-    uint32_t addr = (uint32_t)*arg;
-    addr += sizeof(uint32_t);
-    *arg = (void*)addr;
+static void emit_chars(format_output_t *out, const char *chars, uint32_t n)
+{
+    if(out->length < out->capacity){
+        // Most runs are a few characters long, too short for a call to memcpy() to pay off.
+        char *dest = out->buffer + out->length;
+        uint32_t room = MIN(n, out->capacity - out->length);
+        for(uint32_t i = 0; i < room; i++){
+            dest[i] = chars[i];
+        }
+    }
+    out->length += n;
+}
 
-    return *cast;
+static void emit_repeat(format_output_t *out, char c, int n)
+{
+    for(; n > 0; n--){
+        emit(out, c);
+    }
 }
 
-uint32_t varg_next_uint32_t(void **arg)
+/// Emits one converted field, padded out to the width: prefix (a sign or 0x), zeros, then body.
+static void emit_field(format_output_t *out, const format_spec_t *spec, const char *prefix, uint32_t prefix_length,
+                       int zeros, const char *body, uint32_t body_length)
 {
-    uint32_t *cast = *arg;
+    int padding = spec->width - (int)(prefix_length + zeros + body_length);
+    if(!spec->left && !spec->zero){
+        emit_repeat(out, ' ', padding);
+    }
+    emit_chars(out, prefix, prefix_length);
+    if(!spec->left && spec->zero){
+        emit_repeat(out, '0', padding);
+    }
+    emit_repeat(out, '0', zeros);
+    emit_chars(out, body, body_length);
+    if(spec->left){
+        emit_repeat(out, ' ', padding);
+    }
+}
 
-    uint32_t addr = (uint32_t)*arg;
-    addr += sizeof(uint32_t);
-    *arg = (void*)addr;
+/// Divides *n by base in place, using only 32 bit divisions so that i386 doesn't need libgcc for 64 bit arguments.
+/// \param [in] base at most 16
+/// \returns the remainder
+static uint32_t divmod64(uint64_t *n, uint32_t base)
+{
+    uint32_t high = (uint32_t)(*n >> 32);
+    uint32_t low = (uint32_t)*n;
+    if(high == 0){
+        *n = low / base;
+        return low % base;
+    }
 
-    return *cast;
+    // Long division, 16 bits at a time after the high word. The remainder is less than base, so it and the next 16
+    // bits always fit in 32.
+    uint32_t quotient_high = high / base;
+    uint32_t part = ((high % base) << 16) | (low >> 16);
+    uint32_t quotient_mid = part / base;
+    part = ((part % base) << 16) | (low & 0xFFFF);
+    uint32_t quotient_low = part / base;
+    *n = ((uint64_t)quotient_high << 32) | (quotient_mid << 16) | quotient_low;
+    return part % base;
 }
 
-char *varg_next_charptr(void **arg)
+static void format_integer(format_output_t *out, format_spec_t *spec, uint64_t value, int negative, uint32_t base,
+                           int upper_case)
 {
-    char **cast = *arg;
+    const char *digit_chars = upper_case ? "0123456789ABCDEF" : "0123456789abcdef";
+    // 2^64 is 20 digits long in decimal.
+    char digits[24];
+    uint32_t start = sizeof(digits);
+    // Zero with a precision of zero prints no digits at all.
+    if(value >> 32){
+        do {
+            digits[--start] = digit_chars[divmod64(&value, base)];
+        } while(value);
+    }
+    else if(value != 0 || spec->precision != 0){
+        // Separate loops so that the compiler can turn the divisions by constants into multiplies and shifts.
+        uint32_t small = (uint32_t)value;
+        if(base == 10){
+            do {
+                digits[--start] = '0' + small % 10;
+                small /= 10;
+            } while(small);
+        }
+        else {
+            do {
+                digits[--start] = digit_chars[small & 0xF];
+                small >>= 4;
+            } while(small);
+        }
+    }
+    uint32_t count = sizeof(digits) - start;
 
-    uint32_t addr = (uint32_t)*arg;
-    addr += sizeof(char *);
-    *arg = (void*)addr;
+    char prefix[3];
+    uint32_t prefix_length = 0;
+    if(negative){
+        prefix[prefix_length++] = '-';
+    }
+    else if(spec->sign && base == 10){
+        prefix[prefix_length++] = spec->sign;
+    }
+    if(base == 16 && count){
+        // %x has always printed the 0x here, unlike C's. Zero with a precision of zero prints nothing, 0x included.
+        prefix[prefix_length++] = '0';
+        prefix[prefix_length++] = upper_case ? 'X' : 'x';
+    }
 
-    return *cast;
+    int zeros = 0;
+    if(spec->precision >= 0){
+        zeros = MAX(spec->precision - (int)count, 0);
+        spec->zero = FALSE;
+    }
+    emit_field(out, spec, prefix, prefix_length, zeros, digits + start, count);
 }
 
-double varg_next_double(void **arg)
+/// %f and %e. The precision cuts digits off the end (without rounding). ftoa_fixed() and ftoa_sci() need a lot of
+/// stack, so this is kept out of __vsnprintf__internal() to spare the common case.
+static __attribute__((noinline)) void format_double(format_output_t *out, format_spec_t *spec, double value,
+                                                    int scientific)
 {
-    double *cast = *arg;
+    char buffer[FLOAT_BUFFER_SIZE];
+    if(scientific){
+        ftoa_sci(buffer, value);
+    }
+    else {
+        ftoa_fixed(buffer, value);
+    }
 
-    uint32_t addr = (uint32_t)*arg;
-    addr += sizeof(double);
-    *arg = (void*)addr;
+    uint32_t length = strlen(buffer);
+    char *point = NULL;
+    char *exponent = buffer + length;
+    for(char *c = buffer; *c; c++){
+        if(*c == '.'){
+            point = c;
+        }
+        else if(*c == 'e'){
+            exponent = c;
+        }
+    }
+    if(point && spec->precision >= 0){
+        char *cut = point + (spec->precision ? 1 + spec->precision : 0);
+        if(cut < exponent){
+            memmove(cut, exponent, buffer + length - exponent);
+            length -= exponent - cut;
+        }
+    }
 
-    return *cast;
+    char *body = buffer;
+    char prefix = buffer[0] == '-' ? '-' : spec->sign;
+    if(buffer[0] == '-'){
+        body++;
+        length--;
+    }
+    spec->precision = -1;
+    emit_field(out, spec, &prefix, prefix ? 1 : 0, 0, body, length);
 }
 
-// The rest of the implementation ...
-
-static int __internal__vfprintf(char* output, int size, char const *fmt, void *arg)
+int __vsnprintf__internal(char *buffer, uint32_t size, const char *fmt, va_list args)
 {
-    if(size == 0)
-        return 0; // Well, we can't really write anything. May as well exit early.
+    format_output_t out = {buffer, size ? size - 1 : 0, 0};
+
+    while(*fmt){
+        while(*fmt && *fmt != '%'){
+            emit(&out, *fmt++);
+        }
+        if(!*fmt){
+            break;
+        }
+        fmt++;
+
+        format_spec_t spec = {FALSE, FALSE, 0, 0, -1};
+        for(;; fmt++){
+            if(*fmt == '-') spec.left = TRUE;
+            else if(*fmt == '0') spec.zero = TRUE;
+            else if(*fmt == '+') spec.sign = '+';
+            else if(*fmt == ' ' && !spec.sign) spec.sign = ' ';
+            else if(*fmt != ' ' && *fmt != '#') break;
+        }
+
+        if(*fmt == '*'){
+            spec.width = va_arg(args, int);
+            if(spec.width < 0){
+                spec.left = TRUE;
+                spec.width = -spec.width;
+            }
+            fmt++;
+        }
+        for(; *fmt >= '0' && *fmt <= '9'; fmt++){
+            spec.width = spec.width * 10 + (*fmt - '0');
+        }
+        if(*fmt == '.'){
+            fmt++;
+            spec.precision = 0;
+            if(*fmt == '*'){
+                spec.precision = MAX(va_arg(args, int), -1);
+                fmt++;
+            }
+            for(; *fmt >= '0' && *fmt <= '9'; fmt++){
+                spec.precision = spec.precision * 10 + (*fmt - '0');
+            }
+        }
+        if(spec.left){
+            spec.zero = FALSE;
+        }
 
-    size--;
+        // h and hh arguments arrive promoted to int, so only l, ll and z change what gets read. h and hh cut it back
+        // down to size afterwards.
+        int longs = 0;
+        int shorts = 0;
+        int size_type = FALSE;
+        for(;; fmt++){
+            if(*fmt == 'l') longs++;
+            else if(*fmt == 'h') shorts++;
+            else if(*fmt == 'z') size_type = TRUE;
+            else break;
+        }
 
-    int output_index = 0;
+        char conversion = *fmt++;
+        switch(conversion){
+            case 'd':
+            case 'i': {
+                int64_t value;
+                if(longs >= 2) value = va_arg(args, long long);
+                else if(longs == 1) value = va_arg(args, long);
+                else if(size_type) value = va_arg(args, __PTRDIFF_TYPE__);
+                else value = va_arg(args, int);
+                if(shorts >= 2) value = (signed char)value;
+                else if(shorts == 1) value = (short)value;
+                // Negating as unsigned gets INT64_MIN right too.
+                uint64_t magnitude = value < 0 ? -(uint64_t)value : (uint64_t)value;
+                format_integer(&out, &spec, magnitude, value < 0, 10, FALSE);
+                break;
+            }
 
-    int int_temp;
-    char char_temp;
-    char *string_temp;
-    double double_temp;
+            case 'u':
+            case 'x':
+            case 'X': {
+                uint64_t value;
+                if(longs >= 2) value = va_arg(args, unsigned long long);
+                else if(longs == 1) value = va_arg(args, unsigned long);
+                else if(size_type) value = va_arg(args, __SIZE_TYPE__);
+                else value = va_arg(args, unsigned int);
+                if(shorts >= 2) value = (unsigned char)value;
+                else if(shorts == 1) value = (unsigned short)value;
+                format_integer(&out, &spec, value, FALSE, conversion == 'u' ? 10 : 16, conversion == 'X');
+                break;
+            }
 
-    char ch;
-    int length = 0;
-    char buffer[512];
+            case 'p':
+                format_integer(&out, &spec, (__UINTPTR_TYPE__)va_arg(args, void*), FALSE, 16, FALSE);
+                break;
 
-    while (output_index < size && (ch = *fmt++)) {
-        if ( '%' == ch ) {
-            switch (ch = *fmt++) {
-                /* %% - print out a single %    */
-                case '%':
-                    output[output_index++] = '%';
-                    length++;
-                    break;
+            case 'c': {
+                char c = (char)va_arg(args, int);
+                spec.zero = FALSE;
+                emit_field(&out, &spec, NULL, 0, 0, &c, 1);
+                break;
+            }
 
-                    /* %c: print out a character    */
-                case 'c':
-                    char_temp = varg_next_int(&arg);
-                    output[output_index++] = char_temp;
+            case 's': {
+                const char *string = va_arg(args, const char*);
+                if(!string){
+                    string = "(null)";
+                }
+                uint32_t length = 0;
+                while(string[length] && (spec.precision < 0 || length < (uint32_t)spec.precision)){
                     length++;
-                    break;
-
-                    /* %s: print out a string       */
-                case 's':
-                    string_temp = varg_next_charptr(&arg);
-                    for(int i = 0; i < strlen(string_temp) && output_index < size; i++){
-                        output[output_index++] = string_temp[i];
-                    }
-                    length += strlen(string_temp);
-                    break;
-
-                    /* %d: print out an int         */
-                case 'u':
-                    int_temp = varg_next_int(&arg);
-                    utoa(int_temp, buffer, 10);
-                    for(int i = 0; i < strlen(buffer) && output_index < size; i++){
-                        output[output_index++] = buffer[i];
-                    }
-                    length += strlen(buffer);
-                    break;
-
-                case 'd':
-                    int_temp = varg_next_int(&arg);
-                    itoa(int_temp, buffer, 10);
-                    for(int i = 0; i < strlen(buffer) && output_index < size; i++){
-                        output[output_index++] = buffer[i];
-                    }
-                    length += strlen(buffer);
-                    break;
-
-                    /* %x: print out an int in hex  */
-                case 'x':
-                    output[output_index++] = '0';
-                    output[output_index++] = 'x';
-                    int_temp = varg_next_int(&arg);
-                    utoa(int_temp, buffer, 16);
-                    for(int i = 0; i < strlen(buffer) && output_index < size; i++){
-                        output[output_index++] = buffer[i];
-                    }
-                    length += strlen(buffer);
-                    break;
-
-                case 'f':
-                    double_temp =  varg_next_double(&arg);
-                    ftoa_fixed(buffer, double_temp);
-                    for(int i = 0; i < strlen(buffer) && output_index < size; i++){
-                        output[output_index++] = buffer[i];
-                    }
-                    length += strlen(buffer);
-                    break;
-
-                case 'e':
-                    double_temp = varg_next_double(&arg);
-                    ftoa_sci(buffer, double_temp);
-                    for(int i = 0; i < strlen(buffer) && output_index < size; i++){
-                        output[output_index++] = buffer[i];
-                    }
-                    length += strlen(buffer);
-                    break;
+                }
+                spec.zero = FALSE;
+                emit_field(&out, &spec, NULL, 0, 0, string, length);
+                break;
             }
-        }
-        else {
-            output[output_index++] = (ch);
-            length++;
+
+            case 'f':
+            case 'e':
+                format_double(&out, &spec, va_arg(args, double), conversion == 'e');
+                break;
+
+            case '%':
+                emit(&out, '%');
+                break;
+
+            case '\0':
+                // A % at the very end of the format.
+                fmt--;
+                break;
+
+            default:
+                // Not something we know how to print, so print it as it was written.
+                emit(&out, '%');
+                emit(&out, conversion);
+                break;
         }
     }
-    output[output_index] = '\0';
-    return length;
+
+    if(size){
+        buffer[MIN(out.length, out.capacity)] = '\0';
+    }
+    return out.length;
 }
 
 static int normalize(double *val) {
@@ -324,47 +476,131 @@ void ftoa_sci(char *buffer, double value) {
 
 int __kernel__printf__internal(uint32_t fmt,...)
 {
-    void *arg_start = (void*)((uint32_t)&fmt + sizeof(fmt));
+    va_list args;
+    va_start(args, fmt);
+    char buffer[512];
+    int length = __vsnprintf__internal(buffer, sizeof(buffer), (const char*)fmt, args);
+    va_end(args);
 
-    int length;
-    char buffer[512] = "";
-    length = __internal__vfprintf(buffer, 512, (char*)fmt, arg_start);
+    klog_write(KLOG_INFO, buffer);
 
-    for(int i = 0; i < strlen(buffer); i++){
-        monitor_put(buffer[i]);
-    }
+    return length;
+}
+
+int __klog__internal(uint32_t level, uint32_t fmt,...)
+{
+    va_list args;
+    va_start(args, fmt);
+    char buffer[512];
+    int length = __vsnprintf__internal(buffer, sizeof(buffer), (const char*)fmt, args);
+    va_end(args);
+
+    klog_write(level, buffer);
 
     return length;
 }
 
 int __user__printf__internal(uint32_t fmt,...)
 {
-    void *arg_start = (void*)((uint32_t)&fmt + sizeof(fmt));
-
-    int length;
-    char buffer[512] = "";
-    length = __internal__vfprintf(buffer, 512, (char*)fmt, arg_start);
+    va_list args;
+    va_start(args, fmt);
+    char buffer[512];
+    int length = __vsnprintf__internal(buffer, sizeof(buffer), (const char*)fmt, args);
+    va_end(args);
 
-    syscall_monitor_write(buffer);
+    stdout_write(buffer, MIN((uint32_t)length, sizeof(buffer) - 1));
 
     return length;
 }
 
 int __snprintf__internal(uint32_t buf, uint32_t size, uint32_t fmt,...)
 {
-    void *arg_start = (void*)((uint32_t)&fmt + sizeof(fmt));
-
-    int length;
-    char *buffer = (char*)buf;
-    length = __internal__vfprintf(buffer, size, (char*)fmt, arg_start);
+    va_list args;
+    va_start(args, fmt);
+    int length = __vsnprintf__internal((char*)buf, size, (const char*)fmt, args);
+    va_end(args);
 
     return length;
 }
 
+typedef struct
+{
+    spinlock_t lock;
+    uint32_t mode;
+    uint32_t length;
+    // One byte is kept back for the null terminator the monitor_write system call needs.
+    char data[PAGE_SIZE - 3 * sizeof(uint32_t)];
+} stdout_buffer_t;
+
+/// The kernel maps a page for this at the same address in every process, so each process has its own buffer, shared
+/// by its threads.
+#define STDOUT ((stdout_buffer_t*)USTDOUT_START)
+#define STDOUT_CAPACITY (sizeof(STDOUT->data) - 1)
+
+/// Takes the stdout lock. The holder might be another thread on this CPU that was preempted in the middle of a flush,
+/// so give it the CPU rather than spinning.
+static void stdout_lock()
+{
+    while(!spin_trylock(&STDOUT->lock)){
+        syscall_yield_impl();
+    }
+}
 
+/// Writes out the buffer. The caller holds the lock.
+static void stdout_flush_locked()
+{
+    if(STDOUT->length){
+        STDOUT->data[STDOUT->length] = '\0';
+        syscall_monitor_write(STDOUT->data);
+        STDOUT->length = 0;
+    }
+}
 
+void stdout_write(const char *text, uint32_t length)
+{
+    stdout_lock();
+    int newline = FALSE;
+    while(length){
+        uint32_t n = MIN(length, STDOUT_CAPACITY - STDOUT->length);
+        for(uint32_t i = 0; i < n; i++){
+            newline |= text[i] == '\n';
+        }
+        memcpy(STDOUT->data + STDOUT->length, text, n);
+        STDOUT->length += n;
+        text += n;
+        length -= n;
+        if(STDOUT->length == STDOUT_CAPACITY){
+            stdout_flush_locked();
+        }
+    }
+    if(STDOUT->mode == STDOUT_UNBUFFERED || (STDOUT->mode == STDOUT_LINE_BUFFERED && newline)){
+        stdout_flush_locked();
+    }
+    spin_unlock(&STDOUT->lock);
+}
 
+void stdout_flush()
+{
+    stdout_lock();
+    stdout_flush_locked();
+    spin_unlock(&STDOUT->lock);
+}
 
+void stdout_fork_begin()
+{
+    stdout_lock();
+    stdout_flush_locked();
+}
 
+void stdout_fork_end()
+{
+    spin_unlock(&STDOUT->lock);
+}
 
-
+void stdout_set_mode(uint32_t mode)
+{
+    stdout_lock();
+    stdout_flush_locked();
+    STDOUT->mode = mode;
+    spin_unlock(&STDOUT->lock);
+}
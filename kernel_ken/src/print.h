@@ -2,9 +2,41 @@
 #define PRINT_H
 
 #include "common.h"
+#include <stdarg.h>
 
 int __user__printf__internal(uint32_t fmt,...);
 int __kernel__printf__internal(uint32_t fmt,...);
+int __klog__internal(uint32_t level, uint32_t fmt,...);
 int __snprintf__internal(uint32_t buf, uint32_t size, uint32_t fmt,...);
 
+/// The formatter behind all of the printf functions. Supports the flags - 0 + and space, widths and precisions
+/// (including *), the length modifiers h hh l ll and z, and %d %i %u %x %X %p %c %s %f %e and %%. %x, %X and %p
+/// print a 0x in front of the digits. Precisions on %f and %e truncate rather than round.
+/// \returns the length of the whole output, even if only size - 1 characters of it fit in buffer. The output is
+/// always null terminated unless size is 0.
+int __vsnprintf__internal(char *buffer, uint32_t size, const char *fmt, va_list args);
+
+// How a process's stdout is flushed to the screen. The kernel clears the buffer when it sets up a process, so line
+// buffering is the default.
+#define STDOUT_LINE_BUFFERED    0   // whenever a newline is written
+#define STDOUT_FULLY_BUFFERED   1   // only when the buffer is full, or on stdout_flush()
+#define STDOUT_UNBUFFERED       2   // after every write
+
+/// Writes length bytes of text to the calling process's stdout buffer, which printf(), print(), print_dec() and
+/// print_hex() all go through. The buffer is written to the screen with a single system call when it's flushed.
+void stdout_write(const char *text, uint32_t length);
+
+/// Writes whatever is in the stdout buffer to the screen. fork() and exit() do this first, so that nothing is printed
+/// twice or lost.
+void stdout_flush();
+
+/// Flushes stdout and keeps it locked until stdout_fork_end(), which both the parent and the child call once the fork
+/// system call returns. Otherwise the child could get a copy of the buffer with the lock held by another thread that
+/// isn't there to release it.
+void stdout_fork_begin();
+void stdout_fork_end();
+
+/// Sets when stdout is flushed to one of the STDOUT_* modes, flushing anything already buffered.
+void stdout_set_mode(uint32_t mode);
+
 #endif
\ No newline at end of file
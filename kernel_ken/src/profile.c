@@ -0,0 +1,126 @@
+// profile.c -- Sampling profiler.
+
+#include "profile.h"
+#include "ring.h"
+#include "smp.h"
+#include "clock.h"
+
+// Each CPU's samples, written by its timer interrupt and read by profile_read_impl() from any CPU.
+static ring_t rings[MAX_CPUS];
+// When each CPU's next sample is due. profile_tick() runs before the kernel lock is taken, so it can't go through
+// clock_monotonic_ns(): this is a TSC value if the TSC is the clocksource, and otherwise a countdown of timer
+// interrupts.
+static uint64_t next_sample[MAX_CPUS];
+// TSC cycles or timer interrupts from one sample to the next. Only read while profiling is set.
+static uint64_t period = 0;
+static volatile uint32_t profiling = FALSE;
+
+/// Follows the saved EBPs up a stack, recording each return address, as long as they stay in [low, high).
+static void profile_walk(profile_sample_t *sample, uint32_t ebp, uint32_t low, uint32_t high)
+{
+    while(sample->depth < PROFILE_MAX_DEPTH && ebp >= low && ebp <= high - 8 && ebp % 4 == 0){
+        uint32_t *frame = (uint32_t *)ebp;
+        if(!frame[1]){
+            break;
+        }
+        sample->stack[sample->depth++] = frame[1];
+        // The caller's frame is always further up the stack. Anything else isn't a frame pointer.
+        if(frame[0] <= ebp){
+            break;
+        }
+        ebp = frame[0];
+    }
+}
+
+/// Works out which stack the interrupted code was using and walks it. Without frame pointers (the release profile),
+/// this finds nonsense, but never leaves the stack.
+static void profile_walk_interrupted(profile_sample_t *sample, registers_t *regs, task_t *task)
+{
+    if(sample->user){
+        // A process's first task has its stack below KSTACK_START; the stacks of threads are in the heap.
+        uint32_t low = task->user_stack ? task->user_stack : KSTACK_START - KSTACK_SIZE;
+        uint32_t high = task->user_stack ? task->heap->end_address : KSTACK_START;
+        if(regs->useresp >= low && regs->useresp < high){
+            profile_walk(sample, regs->ebp, regs->useresp, high);
+        }
+    } else {
+        uint32_t low = (uint32_t)regs;
+        uint32_t high = task->kernel_stack + KERNEL_STACK_SIZE;
+        if(low >= task->kernel_stack && low < high){
+            profile_walk(sample, regs->ebp, low, high);
+        }
+    }
+}
+
+void profile_tick(registers_t *regs)
+{
+    if(!profiling){
+        return;
+    }
+    cpu_t *cpu = this_cpu();
+    if(!rings[cpu->index].slots){
+        return;
+    }
+    if(clock_uses_tsc()){
+        uint64_t now = read_tsc();
+        if(now < next_sample[cpu->index]){
+            return;
+        }
+        next_sample[cpu->index] = now + period;
+    } else {
+        if(next_sample[cpu->index] > 1){
+            next_sample[cpu->index]--;
+            return;
+        }
+        next_sample[cpu->index] = period;
+    }
+
+    profile_sample_t *sample = ring_reserve(&rings[cpu->index]);
+    if(!sample){
+        return;
+    }
+    task_t *task = cpu->current;
+    sample->pid = task ? task->id : 0;
+    sample->cpu = cpu->index;
+    sample->user = (regs->cs & 3) == 3;
+    sample->depth = 1;
+    sample->stack[0] = regs->eip;
+    if(task){
+        profile_walk_interrupted(sample, regs, task);
+    }
+    ring_commit(&rings[cpu->index]);
+}
+
+int profile_start_impl(uint32_t hz)
+{
+    if(hz > TICKS_PER_SECOND){
+        return -1;
+    }
+
+    profiling = FALSE;
+    if(!hz){
+        return 0;
+    }
+    for(uint32_t i = 0; i < cpu_count; i++){
+        ring_reset(&rings[i], PROFILE_SAMPLES_PER_CPU, sizeof(profile_sample_t));
+        next_sample[i] = 0;
+    }
+    if(clock_uses_tsc()){
+        uint64_t now = clock_monotonic_ns();
+        period = clock_ns_to_tsc(now + NS_PER_SECOND / hz) - clock_ns_to_tsc(now);
+    } else {
+        // Without the TSC, all there is to go on is the timer's own rate.
+        period = TICKS_PER_SECOND / hz;
+    }
+    asm volatile("" : : : "memory");
+    profiling = TRUE;
+    return 0;
+}
+
+int profile_read_impl(profile_sample_t *samples, uint32_t max)
+{
+    if(!samples){
+        return -1;
+    }
+    return ring_read_cpus(rings, samples, max, "profile");
+}
@@ -0,0 +1,39 @@
+// profile.h -- Sampling profiler. On every timer interrupt that's due for one, a CPU records where it was: the PID,
+//              whether it was in user or kernel mode, the interrupted EIP and the return addresses found by following
+//              the frame pointers. Samples are kept per CPU until profile_read() collects them.
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "common.h"
+#include "isr.h"
+
+// Frames recorded per sample, counting the interrupted EIP.
+#define PROFILE_MAX_DEPTH       12
+// Samples each CPU holds before it starts dropping them.
+#define PROFILE_SAMPLES_PER_CPU 1024
+
+typedef struct
+{
+    uint32_t pid;
+    uint8_t cpu;
+    uint8_t user;                       // TRUE if the CPU was running user code
+    uint8_t depth;                      // How much of stack is filled in
+    uint32_t stack[PROFILE_MAX_DEPTH];  // The interrupted EIP first, then the return address of each caller
+} profile_sample_t;
+
+/// Records a sample if profiling is on and this CPU is due one. Called with interrupts off, from irq_handler() for
+/// every timer interrupt.
+void profile_tick(registers_t *regs);
+
+/// Starts profiling at hz samples per second on each CPU, throwing away any samples not yet read, or stops it if hz
+/// is 0. A CPU only samples on its timer ticks, so hz can't be more than the tick rate (TICKS_PER_SECOND), and only
+/// CPUs that are busy get ticks.
+/// \returns 0 on success, -1 if hz is too high
+int profile_start_impl(uint32_t hz);
+
+/// Moves up to max samples, from every CPU, into samples.
+/// \returns how many were moved, or -1 if samples is NULL
+int profile_read_impl(profile_sample_t *samples, uint32_t max);
+
+#endif
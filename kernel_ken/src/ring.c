@@ -0,0 +1,63 @@
+// ring.c -- Per-CPU rings of fixed size records.
+
+#include "ring.h"
+#include "smp.h"
+#include "kheap.h"
+#include "klib.h"
+
+void ring_reset(ring_t *ring, uint32_t capacity, uint32_t slot_size)
+{
+    if(!ring->slots){
+        ring->slots = kmalloc(capacity * slot_size);
+        ring->capacity = capacity;
+        ring->slot_size = slot_size;
+    }
+    ring->tail = ring->head;
+    ring->dropped = 0;
+}
+
+void *ring_reserve(ring_t *ring)
+{
+    if(!ring->slots){
+        return NULL;
+    }
+    if(ring->head - ring->tail >= ring->capacity){
+        ring->dropped++;
+        return NULL;
+    }
+    return (uint8_t *)ring->slots + (ring->head % ring->capacity) * ring->slot_size;
+}
+
+void ring_commit(ring_t *ring)
+{
+    // The record has to be complete before the reader can see it.
+    asm volatile("" : : : "memory");
+    ring->head++;
+}
+
+uint32_t ring_read_cpus(ring_t *rings, void *records, uint32_t max, const char *name)
+{
+    uint8_t *out = records;
+    uint32_t count = 0;
+    for(uint32_t i = 0; i < cpu_count && count < max; i++){
+        ring_t *ring = &rings[i];
+        if(!ring->slots){
+            continue;
+        }
+        uint32_t head = ring->head;
+        asm volatile("" : : : "memory");
+        while(ring->tail != head && count < max){
+            memcpy(out + count * ring->slot_size,
+                   (uint8_t *)ring->slots + (ring->tail % ring->capacity) * ring->slot_size, ring->slot_size);
+            count++;
+            // Only hand the slot back once it's been copied.
+            asm volatile("" : : : "memory");
+            ring->tail++;
+        }
+        if(ring->dropped){
+            klog(KLOG_WARN, "%s: CPU %u dropped %u records, read them more often \n", name, i, ring->dropped);
+            ring->dropped = 0;
+        }
+    }
+    return count;
+}
@@ -0,0 +1,35 @@
+// ring.h -- Per-CPU rings of fixed size records, for the profiler and the tracer. Each ring has one writer (whatever
+//           runs on its CPU, with interrupts off) and one reader (a system call on any CPU), so head and tail are all
+//           the two have to agree on. A writer that finds its ring full counts the record as dropped instead.
+
+#ifndef RING_H
+#define RING_H
+
+#include "common.h"
+
+typedef struct
+{
+    void *slots;                // NULL until the first ring_reset()
+    uint32_t slot_size;
+    uint32_t capacity;          // In records
+    volatile uint32_t head;     // Written by the writer, the next record goes at head % capacity
+    volatile uint32_t tail;     // Written by the reader
+    uint32_t dropped;           // Records that didn't fit since the last read
+} ring_t;
+
+/// Allocates the ring's slots, the first time, and throws away anything in it.
+void ring_reset(ring_t *ring, uint32_t capacity, uint32_t slot_size);
+
+/// \returns the slot to fill in for the next record, or NULL if the ring hasn't been allocated or is full (which
+/// counts as a drop). The record can't be read until ring_commit().
+void *ring_reserve(ring_t *ring);
+
+/// Hands the slot from the last ring_reserve() over to the reader.
+void ring_commit(ring_t *ring);
+
+/// Moves up to max records out of the first cpu_count rings into records, each CPU's in order. Any CPU that dropped
+/// records since the last read gets a warning in the kernel log, starting with name.
+/// \returns how many records were moved
+uint32_t ring_read_cpus(ring_t *rings, void *records, uint32_t max, const char *name);
+
+#endif
@@ -0,0 +1,65 @@
+// screen.c -- Lends the VGA text buffer to one process at a time, mapped straight into its address space.
+
+#include "screen.h"
+#include "monitor.h"
+#include "smp.h"
+
+// The address space holding the screen, or NULL while the kernel has it.
+static page_directory_t *screen_owner = NULL;
+
+void *screen_acquire_impl()
+{
+    page_directory_t *dir = current_directory;
+    if(screen_owner == dir){
+        return (void *)SCREEN_MAP_ADDR;
+    }
+    if(screen_owner){
+        return NULL;
+    }
+
+    page_t *page = get_page(SCREEN_MAP_ADDR, TRUE, dir);
+    page_set_frame(page, VGA_TEXT_ADDR / PAGE_SIZE);
+    page_set_present(page, 1);
+    page_set_rw(page, 1);
+    page_set_user(page, 1);
+    screen_owner = dir;
+
+    // Get whatever the kernel printed last onto the screen, then stop drawing over the process.
+    monitor_flush();
+    monitor_suspend();
+    return (void *)SCREEN_MAP_ADDR;
+}
+
+int screen_release_impl()
+{
+    if(!screen_owner || screen_owner != current_directory){
+        return -1;
+    }
+    // Another thread of the process, in user mode on another CPU, would keep writing to the text buffer through its
+    // TLB until it next entered the kernel. Every task switch reloads CR3, so a CPU with some other directory loaded
+    // can't have the mapping cached.
+    for(uint32_t i = 0; i < cpu_count; i++){
+        if(&cpus[i] != this_cpu() && cpus[i].directory == screen_owner){
+            return 1;
+        }
+    }
+    screen_release_directory(screen_owner);
+    return 0;
+}
+
+void screen_release_directory(page_directory_t *dir)
+{
+    if(screen_owner != dir){
+        return;
+    }
+
+    // The page table stays. It's part of the address space now, and goes with it.
+    page_t *page = get_page(SCREEN_MAP_ADDR, FALSE, dir);
+    ASSERT(page);
+    page->contents = 0;
+    asm volatile("invlpg (%0)" : : "r" (SCREEN_MAP_ADDR) : "memory");
+    // No other CPU has dir loaded: either screen_release_impl() checked, or dir's last task is exiting.
+    screen_owner = NULL;
+
+    monitor_resume();
+}
@@ -0,0 +1,29 @@
+// screen.h -- Lends the VGA text buffer to one process at a time, mapped straight into its address space.
+
+#ifndef SCREEN_H
+#define SCREEN_H
+
+#include "common.h"
+#include "paging.h"
+
+// Physical address of the VGA text buffer, and where a process holding the screen sees it.
+#define VGA_TEXT_ADDR   0xB8000
+#define SCREEN_MAP_ADDR 0xA0000000
+
+/// Gives the calling process the screen: the text buffer is mapped, user writable, at SCREEN_MAP_ADDR (SCREEN_WIDTH
+/// by SCREEN_HEIGHT cells, see SCREEN_CELL()). Until it's released, the kernel's own output only goes into the
+/// console's shadow screen, which is shown again afterwards. All threads of the process share the lease, but a
+/// forked child only gets a private copy of the page.
+/// \returns SCREEN_MAP_ADDR, or NULL if another process already has the screen
+void *screen_acquire_impl();
+
+/// Gives the screen back to the kernel.
+/// \returns 0 on success, -1 if the calling process didn't have it, or 1 if another of its threads is running on
+/// another CPU at the moment, in which case it should try again
+int screen_release_impl();
+
+/// Releases the screen if dir's process has it. Called when an address space goes away, before
+/// destroy_directory() could mistake the text buffer for a frame of the process's own.
+void screen_release_directory(page_directory_t *dir);
+
+#endif
@@ -3,11 +3,11 @@
 #include "linked_list.h"
 #include "task.h"
 #include "klib.h"
+#include "smp.h"
+#include "trace.h"
 
 #define SEM_ERROR 0
 
-extern list_t *ready_queue;
-extern task_t *current_process;
 extern uint32_t sem_id_generator;
 extern list_t *semaphores_list;
 
@@ -107,7 +107,8 @@ int wait_impl(int s)
     if(sem->counter < 0){
         current_process->state = state_waiting;
         queue_enqueue(sem->wait_queue, (void*)current_process->id);
-        run_scheduler(FALSE, TRUE, FALSE);
+        TRACE(TRACE_SEM_BLOCK, s, sem->counter, 0);
+        run_scheduler(FALSE, TRUE);
     }
 
     sem_t *sem2 = get_semaphore_by_id(s);
@@ -137,11 +138,11 @@ int signal_impl(int s)
 
         task_t *task = get_task_by_pid(pid);
         ASSERT(task);
+        TRACE(TRACE_SEM_WAKE, s, pid, 0);
 
-        task->state = state_ready;
-        list_add_back(ready_queue, task);
+        sched_enqueue(task);
 
-        run_scheduler(TRUE, TRUE, FALSE);
+        run_scheduler(TRUE, TRUE);
     }
 
     return s;
@@ -166,9 +167,9 @@ int close_sem_impl(int s)
 
         task_t *task = get_task_by_pid(pid);
         ASSERT(task);
+        TRACE(TRACE_SEM_WAKE, s, pid, 0);
 
-        task->state = state_ready;
-        list_add_back(ready_queue, task);
+        sched_enqueue(task);
     }
 
     sem_destroy(sem);
@@ -0,0 +1,151 @@
+// serial.c -- Interrupt driven driver for the 16550 UART on COM1.
+
+#include "serial.h"
+#include "isr.h"
+
+// Register offsets from COM1_PORT. With DLAB set in the line control register, the first two are the divisor.
+#define UART_DATA               0
+#define UART_IER                1
+#define UART_IIR                2
+#define UART_FCR                2
+#define UART_LCR                3
+#define UART_MCR                4
+#define UART_LSR                5
+#define UART_SCRATCH            7
+
+#define UART_IER_RX             0x01
+#define UART_IER_TX_EMPTY       0x02
+#define UART_IIR_NONE           0x01
+#define UART_LCR_8N1            0x03
+#define UART_LCR_DLAB           0x80
+// Enable and clear both FIFOs, and interrupt once 14 bytes have been received.
+#define UART_FCR_ENABLE         0xC7
+// DTR, RTS and OUT2. OUT2 is what connects the UART's interrupt line to the PIC.
+#define UART_MCR_IRQ            0x0B
+#define UART_LSR_DATA_READY     0x01
+#define UART_LSR_TX_EMPTY       0x20
+
+// How many bytes the transmit FIFO holds once the THR empty interrupt fires.
+#define UART_FIFO_SIZE          16
+
+static int serial_present = FALSE;
+
+// Both rings are written at head and read at tail. One slot is always left empty, so head == tail means empty.
+static uint8_t tx_buffer[SERIAL_TX_BUFFER_SIZE];
+static volatile uint32_t tx_head = 0;
+static volatile uint32_t tx_tail = 0;
+
+static uint8_t rx_buffer[SERIAL_RX_BUFFER_SIZE];
+static volatile uint32_t rx_head = 0;
+static volatile uint32_t rx_tail = 0;
+
+/// Moves as much of the transmit ring into the UART as its FIFO takes. The TX empty interrupt is only left enabled
+/// while there's more to send, or it would keep firing. Call with interrupts off.
+static void serial_fill_fifo()
+{
+    if(!(inb(COM1_PORT + UART_LSR) & UART_LSR_TX_EMPTY)){
+        // Still sending. The interrupt comes when the FIFO is empty.
+        return;
+    }
+    for(uint32_t i = 0; i < UART_FIFO_SIZE && tx_tail != tx_head; i++){
+        outb(COM1_PORT + UART_DATA, tx_buffer[tx_tail]);
+        tx_tail = (tx_tail + 1) % SERIAL_TX_BUFFER_SIZE;
+    }
+    outb(COM1_PORT + UART_IER, UART_IER_RX | (tx_tail != tx_head ? UART_IER_TX_EMPTY : 0));
+}
+
+static void serial_callback(registers_t *regs)
+{
+    // Keep going until the UART has no more reasons to interrupt.
+    while(!(inb(COM1_PORT + UART_IIR) & UART_IIR_NONE)){
+        while(inb(COM1_PORT + UART_LSR) & UART_LSR_DATA_READY){
+            uint8_t byte = inb(COM1_PORT + UART_DATA);
+            uint32_t next = (rx_head + 1) % SERIAL_RX_BUFFER_SIZE;
+            // Once the ring is full, newer bytes are lost rather than older ones.
+            if(next != rx_tail){
+                rx_buffer[rx_head] = byte;
+                rx_head = next;
+            }
+        }
+        serial_fill_fifo();
+    }
+}
+
+void serial_init(uint32_t baud)
+{
+    // No UART at all reads back as 0xFF. The scratch register tells a UART from anything else.
+    outb(COM1_PORT + UART_SCRATCH, 0x5A);
+    if(inb(COM1_PORT + UART_SCRATCH) != 0x5A){
+        return;
+    }
+
+    uint32_t divisor = SERIAL_MAX_BAUD / MAX(MIN(baud, SERIAL_MAX_BAUD), 1);
+    outb(COM1_PORT + UART_IER, 0);
+    outb(COM1_PORT + UART_LCR, UART_LCR_DLAB);
+    outb(COM1_PORT + UART_DATA, divisor & 0xFF);
+    outb(COM1_PORT + UART_IER, (divisor >> 8) & 0xFF);
+    outb(COM1_PORT + UART_LCR, UART_LCR_8N1);
+    outb(COM1_PORT + UART_FCR, UART_FCR_ENABLE);
+    outb(COM1_PORT + UART_MCR, UART_MCR_IRQ);
+
+    register_interrupt_handler(IRQ4, &serial_callback);
+    serial_present = TRUE;
+    outb(COM1_PORT + UART_IER, UART_IER_RX);
+}
+
+/// Adds a byte to the transmit ring. Call with interrupts off.
+static void serial_queue(uint8_t byte)
+{
+    uint32_t next = (tx_head + 1) % SERIAL_TX_BUFFER_SIZE;
+    if(next == tx_tail){
+        return;
+    }
+    tx_buffer[tx_head] = byte;
+    tx_head = next;
+}
+
+void serial_write_n(const char *c, uint32_t length)
+{
+    if(!serial_present){
+        return;
+    }
+
+    // The interrupt handler takes from the same ring.
+    uint32_t flags = irq_save();
+    for(uint32_t i = 0; i < length && c[i]; i++){
+        if(c[i] == '\n'){
+            serial_queue('\r');
+        }
+        serial_queue(c[i]);
+    }
+    serial_fill_fifo();
+    irq_restore(flags);
+}
+
+void serial_drain()
+{
+    if(!serial_present){
+        return;
+    }
+    uint32_t flags = irq_save();
+    while(tx_tail != tx_head){
+        serial_fill_fifo();
+    }
+    irq_restore(flags);
+}
+
+int serial_read_impl(void *buf, uint32_t nbyte)
+{
+    if(!buf){
+        return 0;
+    }
+    uint8_t *bytes = buf;
+    uint32_t flags = irq_save();
+    uint32_t count = 0;
+    while(count < nbyte && rx_tail != rx_head){
+        bytes[count++] = rx_buffer[rx_tail];
+        rx_tail = (rx_tail + 1) % SERIAL_RX_BUFFER_SIZE;
+    }
+    irq_restore(flags);
+    return count;
+}
@@ -0,0 +1,37 @@
+// serial.h -- Interrupt driven driver for the 16550 UART on COM1. The console is mirrored to it, so a headless
+//             QEMU (-nographic or -serial stdio) can capture everything the kernel prints.
+
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include "common.h"
+
+#define COM1_PORT 0x3F8
+
+// The UART's clock divided by 16, which every baud rate divides.
+#define SERIAL_MAX_BAUD 115200
+
+// Override with -DSERIAL_BAUD=... to run the port at another speed.
+#ifndef SERIAL_BAUD
+    #define SERIAL_BAUD SERIAL_MAX_BAUD
+#endif
+
+#define SERIAL_TX_BUFFER_SIZE 8192
+#define SERIAL_RX_BUFFER_SIZE 1024
+
+/// Sets COM1 up at baud (8 data bits, no parity, 1 stop bit) and takes over its interrupt. Does nothing if there's no
+/// UART there, in which case the other functions don't do anything either. Call after init_descriptor_tables().
+void serial_init(uint32_t baud);
+
+/// Queues up to length characters of c (stopping early at a null terminator) for sending, with "\n" sent as "\r\n".
+/// Never waits: the transmit buffer is drained from the UART's interrupt, and anything that doesn't fit is dropped.
+void serial_write_n(const char *c, uint32_t length);
+
+/// Waits until everything queued has been sent. Only for when interrupts can't be relied on, eg. in panic().
+void serial_drain();
+
+/// Copies up to nbyte received bytes into buf. Never waits.
+/// \returns how many bytes were copied
+int serial_read_impl(void *buf, uint32_t nbyte);
+
+#endif
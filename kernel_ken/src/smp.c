@@ -0,0 +1,383 @@
+// smp.c -- Multiprocessor support. CPUs are discovered through the Intel MultiProcessor Specification
+//          (v1.4) tables, and the application processors are started with the INIT-SIPI-SIPI sequence.
+
+#include "smp.h"
+#include "apic.h"
+#include "isr.h"
+#include "timer.h"
+#include "clock.h"
+#include "kheap.h"
+#include "descriptor_tables.h"
+
+// The MP floating pointer structure, found by scanning for "_MP_" on a 16 byte boundary.
+typedef struct
+{
+    char signature[4];
+    uint32_t config_table;        // Physical address of the configuration table header.
+    uint8_t length;               // In 16 byte units.
+    uint8_t spec_rev;
+    uint8_t checksum;
+    uint8_t config_type;          // Non-zero means a default configuration with no table.
+    uint8_t imcr;
+    uint8_t reserved[3];
+} __attribute__((packed)) mp_floating_t;
+
+typedef struct
+{
+    char signature[4];            // "PCMP"
+    uint16_t length;
+    uint8_t spec_rev;
+    uint8_t checksum;
+    char oem_id[8];
+    char product_id[12];
+    uint32_t oem_table;
+    uint16_t oem_table_size;
+    uint16_t entry_count;
+    uint32_t lapic_address;
+    uint16_t extended_length;
+    uint8_t extended_checksum;
+    uint8_t reserved;
+} __attribute__((packed)) mp_config_t;
+
+typedef struct
+{
+    uint8_t type;                 // MP_ENTRY_PROCESSOR
+    uint8_t apic_id;
+    uint8_t apic_version;
+    uint8_t flags;
+    uint32_t signature;
+    uint32_t features;
+    uint32_t reserved[2];
+} __attribute__((packed)) mp_processor_t;
+
+typedef struct
+{
+    uint8_t type;                 // MP_ENTRY_IOAPIC
+    uint8_t id;
+    uint8_t version;
+    uint8_t flags;
+    uint32_t address;
+} __attribute__((packed)) mp_ioapic_t;
+
+typedef struct
+{
+    uint8_t type;                 // MP_ENTRY_BUS
+    uint8_t id;
+    char type_name[6];            // eg. "ISA   " or "PCI   "
+} __attribute__((packed)) mp_bus_t;
+
+typedef struct
+{
+    uint8_t type;                 // MP_ENTRY_IO_INTERRUPT
+    uint8_t interrupt_type;       // 0 for a vectored interrupt
+    uint16_t flags;               // Polarity in bits 0-1, trigger mode in bits 2-3
+    uint8_t source_bus;
+    uint8_t source_irq;
+    uint8_t ioapic_id;
+    uint8_t ioapic_pin;
+} __attribute__((packed)) mp_io_interrupt_t;
+
+#define MP_ENTRY_PROCESSOR      0
+#define MP_ENTRY_BUS            1
+#define MP_ENTRY_IOAPIC         2
+#define MP_ENTRY_IO_INTERRUPT   3
+#define MP_POLARITY_LOW         0x3
+#define MP_TRIGGER_LEVEL        0xC
+#define MP_IMCR_PRESENT         0x80
+#define MP_PROCESSOR_ENABLED    0x1
+#define MP_PROCESSOR_BSP        0x2
+#define MP_FLAGS_ENABLED        0x1
+
+cpu_t cpus[MAX_CPUS];
+uint32_t cpu_count = 1;
+spinlock_t kernel_lock = SPINLOCK_UNLOCKED;
+
+// Bumped every time shared kernel mappings are removed. See tlb_shootdown().
+static volatile uint32_t kernel_tlb_generation = 0;
+
+extern page_directory_t *kernel_directory;
+
+// Defined in smp_boot.s. The trampoline is copied to AP_TRAMPOLINE_ADDR, and the variables inside it are
+// filled in before each AP is started.
+extern uint8_t ap_trampoline_start[];
+extern uint8_t ap_trampoline_end[];
+extern uint8_t ap_trampoline_cr3[];
+extern uint8_t ap_trampoline_stack[];
+extern uint8_t ap_trampoline_entry[];
+
+cpu_t *this_cpu()
+{
+    return &cpus[get_cpu_index()];
+}
+
+static uint8_t mp_checksum(void *address, uint32_t length)
+{
+    uint8_t sum = 0;
+    uint8_t *bytes = address;
+    for(uint32_t i = 0; i < length; i++){
+        sum += bytes[i];
+    }
+    return sum;
+}
+
+static mp_floating_t *mp_scan(uint32_t start, uint32_t length)
+{
+    for(uint32_t address = start; address < start + length; address += 16){
+        mp_floating_t *mp = (mp_floating_t *)address;
+        if(mp->signature[0] == '_' && mp->signature[1] == 'M' && mp->signature[2] == 'P' && mp->signature[3] == '_'
+           && mp_checksum(mp, sizeof(*mp)) == 0){
+            return mp;
+        }
+    }
+    return NULL;
+}
+
+static mp_floating_t *mp_find()
+{
+    // The spec lists three places to look, in this order:
+    // -- the first KB of the extended BIOS data area (its segment is stored at 0x40E)
+    // -- the last KB of base memory (its size in KB is stored at 0x413)
+    // -- the BIOS ROM between 0xF0000 and 0xFFFFF
+    mp_floating_t *mp;
+    uint32_t ebda = (uint32_t)(*(uint16_t *)0x40E) << 4;
+    if(ebda && (mp = mp_scan(ebda, 1024))){
+        return mp;
+    }
+    uint32_t base_memory = (uint32_t)(*(uint16_t *)0x413) * 1024;
+    if((mp = mp_scan(base_memory - 1024, 1024))){
+        return mp;
+    }
+    return mp_scan(0xF0000, 0x10000);
+}
+
+void smp_detect()
+{
+    cpus[0].index = 0;
+    cpu_count = 1;
+
+    mp_floating_t *mp = mp_find();
+    if(!mp || mp->config_type != 0 || !mp->config_table){
+        return;
+    }
+
+    mp_config_t *config = (mp_config_t *)mp->config_table;
+    if(config->signature[0] != 'P' || config->signature[1] != 'C' || config->signature[2] != 'M'
+       || config->signature[3] != 'P' || mp_checksum(config, config->length) != 0){
+        return;
+    }
+
+    lapic_base = config->lapic_address;
+    imcr_present = (mp->imcr & MP_IMCR_PRESENT) != 0;
+    int isa_bus = -1;
+    int ioapic_id = -1;
+
+    uint8_t *entry = (uint8_t *)(config + 1);
+    for(uint32_t i = 0; i < config->entry_count; i++){
+        if(*entry == MP_ENTRY_PROCESSOR){
+            mp_processor_t *processor = (mp_processor_t *)entry;
+            if(processor->flags & MP_PROCESSOR_BSP){
+                // The bootstrap processor is always cpus[0], since that's the TSS the boot code loads.
+                cpus[0].apic_id = processor->apic_id;
+            } else if((processor->flags & MP_PROCESSOR_ENABLED) && cpu_count < MAX_CPUS){
+                cpus[cpu_count].index = cpu_count;
+                cpus[cpu_count].apic_id = processor->apic_id;
+                cpu_count++;
+            }
+            entry += sizeof(mp_processor_t);
+        } else {
+            if(*entry == MP_ENTRY_IOAPIC){
+                mp_ioapic_t *ioapic = (mp_ioapic_t *)entry;
+                if((ioapic->flags & MP_FLAGS_ENABLED) && !ioapic_base){
+                    ioapic_base = ioapic->address;
+                    ioapic_id = ioapic->id;
+                }
+            } else if(*entry == MP_ENTRY_BUS){
+                mp_bus_t *bus = (mp_bus_t *)entry;
+                if(bus->type_name[0] == 'I' && bus->type_name[1] == 'S' && bus->type_name[2] == 'A'){
+                    isa_bus = bus->id;
+                }
+            } else if(*entry == MP_ENTRY_IO_INTERRUPT){
+                // Bus entries always come before the interrupt entries, so the ISA bus is known by now.
+                mp_io_interrupt_t *interrupt = (mp_io_interrupt_t *)entry;
+                // Only the first IO APIC is used.
+                if(interrupt->interrupt_type == 0 && interrupt->source_bus == isa_bus
+                   && interrupt->ioapic_id == ioapic_id){
+                    uint32_t flags = 0;
+                    if((interrupt->flags & MP_POLARITY_LOW) == MP_POLARITY_LOW){
+                        flags |= IOAPIC_ACTIVE_LOW;
+                    }
+                    if((interrupt->flags & MP_TRIGGER_LEVEL) == MP_TRIGGER_LEVEL){
+                        flags |= IOAPIC_LEVEL_TRIGGERED;
+                    }
+                    ioapic_set_isa_route(interrupt->source_irq, interrupt->ioapic_pin, flags);
+                }
+            }
+            // Every other entry type is 8 bytes.
+            entry += 8;
+        }
+    }
+}
+
+void kernel_enter()
+{
+    spin_lock(&kernel_lock);
+
+    cpu_t *cpu = this_cpu();
+    cpu->kernel_locked = TRUE;
+    if(cpu->tlb_generation != kernel_tlb_generation){
+        cpu->tlb_generation = kernel_tlb_generation;
+        uint32_t pagedir_addr;
+        asm volatile("mov %%cr3, %0" : "=r" (pagedir_addr));
+        asm volatile("mov %0, %%cr3" : : "r" (pagedir_addr) : "memory");
+    }
+}
+
+void kernel_exit()
+{
+    this_cpu()->kernel_locked = FALSE;
+    spin_unlock(&kernel_lock);
+}
+
+void tlb_shootdown()
+{
+    // Every other CPU is either in user mode (where the kernel heap isn't accessible) or waiting on the
+    // kernel lock, so it's enough to have them flush as they next enter the kernel.
+    kernel_tlb_generation++;
+    this_cpu()->tlb_generation = kernel_tlb_generation;
+
+    uint32_t pagedir_addr;
+    asm volatile("mov %%cr3, %0" : "=r" (pagedir_addr));
+    asm volatile("mov %0, %%cr3" : : "r" (pagedir_addr) : "memory");
+}
+
+void smp_send_reschedule(cpu_t *cpu)
+{
+    if(!cpu->online || cpu == this_cpu()){
+        return;
+    }
+    lapic_send_ipi(cpu->apic_id, IPI_RESCHEDULE | LAPIC_ICR_ASSERT);
+}
+
+void smp_broadcast_reschedule()
+{
+    if(cpu_count == 1 || !lapic_base){
+        return;
+    }
+
+    int work_queued = FALSE;
+    for(uint32_t i = 0; i < cpu_count; i++){
+        if(cpus[i].online && list_size(cpus[i].ready_queue) > 0){
+            work_queued = TRUE;
+        }
+    }
+
+    cpu_t *self = this_cpu();
+    for(uint32_t i = 0; i < cpu_count; i++){
+        cpu_t *cpu = &cpus[i];
+        // An idle CPU has no time slice to end, and waking it is only worth it if it could steal something.
+        if(cpu == self || (cpu->current == cpu->idle && !work_queued)){
+            continue;
+        }
+        smp_send_reschedule(cpu);
+    }
+}
+
+void smp_wake_idle_cpus()
+{
+    cpu_t *self = this_cpu();
+    if(list_size(self->ready_queue) == 0){
+        return;
+    }
+    for(uint32_t i = 0; i < cpu_count; i++){
+        cpu_t *cpu = &cpus[i];
+        if(cpu != self && cpu->current == cpu->idle){
+            smp_send_reschedule(cpu);
+        }
+    }
+}
+
+static void ipi_reschedule(registers_t *regs)
+{
+    this_cpu()->need_resched = TRUE;
+}
+
+static void smp_wait_ticks(uint32_t ticks)
+{
+    uint32_t start = timer_get_ticks();
+    while(timer_get_ticks() - start < ticks);
+}
+
+/// C entry point of an application processor, called by the trampoline in smp_boot.s with paging enabled
+/// and the CPU's idle kernel stack loaded.
+static void ap_main()
+{
+    uint8_t apic_id = lapic_id();
+    cpu_t *cpu = NULL;
+    for(uint32_t i = 1; i < cpu_count; i++){
+        if(cpus[i].apic_id == apic_id){
+            cpu = &cpus[i];
+        }
+    }
+    if(!cpu){
+        for(;;) asm volatile("cli; hlt" : : : "memory");
+    }
+
+    init_ap_descriptor_tables(cpu->index);
+    lapic_enable();
+
+    cpu->directory = kernel_directory;
+    cpu->online_since = clock_monotonic_ns();
+    cpu->idle_since = cpu->online_since;
+    cpu->current = cpu->idle;
+    cpu->idle->state = state_running;
+    set_kernel_stack(cpu->idle->kernel_stack + KERNEL_STACK_SIZE);
+    cpu->online = TRUE;
+
+    // The boot stack is the idle task's kernel stack, so from here on this is just the idle task.
+    idle_loop();
+}
+
+static void smp_start_ap(cpu_t *cpu)
+{
+    *(uint32_t *)(AP_TRAMPOLINE_ADDR + (ap_trampoline_stack - ap_trampoline_start))
+            = cpu->idle->kernel_stack + KERNEL_STACK_SIZE;
+
+    // INIT, then two STARTUPs as the MP spec recommends. The vector of a STARTUP IPI is the page
+    // number the AP starts executing at in real mode.
+    lapic_send_ipi(cpu->apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT);
+    smp_wait_ticks(10);
+    for(int i = 0; i < 2 && !cpu->online; i++){
+        lapic_send_ipi(cpu->apic_id, LAPIC_ICR_STARTUP | LAPIC_ICR_ASSERT | (AP_TRAMPOLINE_ADDR / PAGE_SIZE));
+        // Give it a generous amount of time to get going.
+        for(int j = 0; j < TICKS_PER_SECOND && !cpu->online; j++){
+            smp_wait_ticks(1);
+        }
+    }
+}
+
+void smp_init()
+{
+    for(uint32_t i = 0; i < cpu_count; i++){
+        cpus[i].idle = task_create_idle(i);
+        if(i != 0){
+            cpus[i].ready_queue = list_init();
+        }
+    }
+    cpus[0].online_since = clock_monotonic_ns();
+    cpus[0].online = TRUE;
+
+    if(cpu_count == 1 || !lapic_base){
+        return;
+    }
+
+    register_interrupt_handler(IPI_RESCHEDULE, &ipi_reschedule);
+
+    memcpy((void *)AP_TRAMPOLINE_ADDR, ap_trampoline_start, ap_trampoline_end - ap_trampoline_start);
+    *(uint32_t *)(AP_TRAMPOLINE_ADDR + (ap_trampoline_cr3 - ap_trampoline_start)) = kernel_directory->physicalAddr;
+    *(uint32_t *)(AP_TRAMPOLINE_ADDR + (ap_trampoline_entry - ap_trampoline_start)) = (uint32_t)&ap_main;
+
+    // Start them one at a time, since they all share the trampoline.
+    for(uint32_t i = 1; i < cpu_count; i++){
+        smp_start_ap(&cpus[i]);
+    }
+}
@@ -0,0 +1,77 @@
+// smp.h -- Multiprocessor support: CPU discovery, AP start up and per-CPU scheduler state.
+
+#ifndef SMP_H
+#define SMP_H
+
+#include "common.h"
+#include "task.h"
+#include "spinlock.h"
+#include "isr.h"
+
+/// Everything the scheduler keeps separately for each CPU.
+typedef struct cpu
+{
+    uint32_t index;               // Position in cpus[], also selects the CPU's TSS.
+    uint8_t apic_id;              // Local APIC id, used to address IPIs.
+    volatile uint8_t online;      // Set once the CPU is running its idle task.
+    task_t *current;              // The task running on this CPU.
+    task_t *idle;                 // Runs whenever ready_queue is empty. Never in a ready queue itself.
+    list_t *ready_queue;          // Tasks waiting for this CPU.
+    page_directory_t *directory;  // The page directory loaded into this CPU's CR3.
+    uint32_t tlb_generation;      // Last kernel_tlb_generation this CPU flushed its TLB for.
+    uint64_t online_since;        // clock_monotonic_ns() when the CPU came online.
+    uint64_t idle_since;          // clock_monotonic_ns() when the CPU last switched to its idle task.
+    uint64_t idle_ns;             // Time spent in the idle task, not counting the current stretch.
+    uint64_t next_quantum;        // clock_monotonic_ns() at which the running task's time slice runs out.
+    uint8_t kernel_locked;        // Set while this CPU holds kernel_lock.
+    uint32_t softirq_pending;     // Bit n set if softirq n has been raised.
+    uint8_t in_softirq;           // Set while softirqs run. Interrupts are enabled, but the kernel lock is held.
+    uint8_t need_resched;         // Run the scheduler before leaving the kernel.
+    uint8_t irqs_deferred;        // Set if any bit of deferred_irqs is.
+    uint32_t deferred_irqs[8];    // Vectors that arrived during softirq work, one bit each, to be handled after it.
+    uint64_t deferred_since;      // TSC when the oldest of deferred_irqs arrived.
+    tasklet_t *tasklets;          // Tasklets scheduled on this CPU, most recent first.
+} cpu_t;
+
+extern cpu_t cpus[MAX_CPUS];
+extern uint32_t cpu_count;
+
+/// The big kernel lock. Held whenever a CPU is executing kernel code on behalf of an interrupt or system call,
+/// which covers every global kernel list. It is still held across switch_to(), and the task that is
+/// switched to releases it on its way out of the kernel.
+extern spinlock_t kernel_lock;
+
+#define current_process (this_cpu()->current)
+#define current_directory (this_cpu()->directory)
+
+/// \returns the per-CPU state of the CPU executing this
+cpu_t *this_cpu();
+
+/// Finds the CPUs and APICs described by the BIOS's MP configuration tables. Call before initialise_paging().
+/// Without MP tables, the kernel carries on with only the bootstrap processor.
+void smp_detect();
+
+/// Creates an idle task for every CPU and starts the application processors. Call after initialise_scheduler().
+void smp_init();
+
+/// Take/release the big kernel lock on entry to/exit from the kernel.
+void kernel_enter();
+void kernel_exit();
+
+/// Makes every CPU flush its TLB before it next enters the kernel. Needed after unmapping pages that all
+/// processes share (the kernel heap), since another CPU may still have the old translation cached.
+void tlb_shootdown();
+
+/// Interrupts a CPU so it runs the scheduler, eg. because it is idle and work was queued for it.
+void smp_send_reschedule(cpu_t *cpu);
+
+/// Interrupts the idle CPUs if this one has tasks queued, so they can take some of them. With a local APIC timer
+/// per CPU, idle CPUs have no tick of their own to notice queued work with.
+void smp_wake_idle_cpus();
+
+/// Interrupts the other online CPUs so they run the scheduler. The PIT only interrupts the bootstrap
+/// processor, so this is what gives the other CPUs their time slices. Idle CPUs are left halted unless
+/// there's queued work they could take.
+void smp_broadcast_reschedule();
+
+#endif
@@ -0,0 +1,116 @@
+;
+; smp_boot.s -- Application processor start up code, and the stubs for the
+;          interrupts that the local APIC delivers.
+;
+
+AP_TRAMPOLINE_ADDR equ 0x8000
+
+; Converts a label inside the trampoline into the address it ends up at
+; once smp.c has copied the trampoline to AP_TRAMPOLINE_ADDR.
+%define TRAMPOLINE(label) (AP_TRAMPOLINE_ADDR + (label - ap_trampoline_start))
+
+; An AP wakes up in real mode at AP_TRAMPOLINE_ADDR. This code is position
+; dependent on purpose: it only ever runs from that copy.
+[BITS 16]
+[GLOBAL ap_trampoline_start]
+ap_trampoline_start:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    lgdt [TRAMPOLINE(ap_trampoline_gdt_ptr)]
+    mov eax, cr0
+    or eax, 0x1               ; Enable protected mode.
+    mov cr0, eax
+    jmp dword 0x08:TRAMPOLINE(ap_trampoline_protected)
+
+[BITS 32]
+ap_trampoline_protected:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+
+    mov eax, [TRAMPOLINE(ap_trampoline_cr3)]
+    mov cr3, eax
+    mov eax, cr0
+    or eax, 0x80000000        ; Enable paging!
+    mov cr0, eax
+
+    mov esp, [TRAMPOLINE(ap_trampoline_stack)]
+    xor ebp, ebp
+    mov eax, [TRAMPOLINE(ap_trampoline_entry)]
+    call eax                  ; Never returns.
+.hang:
+    cli
+    hlt
+    jmp .hang
+
+align 8
+ap_trampoline_gdt:
+    dq 0x0000000000000000     ; Null segment
+    dq 0x00CF9A000000FFFF     ; Code segment, same as gdt_entries[1]
+    dq 0x00CF92000000FFFF     ; Data segment, same as gdt_entries[2]
+ap_trampoline_gdt_ptr:
+    dw 23
+    dd TRAMPOLINE(ap_trampoline_gdt)
+
+; Filled in by smp.c.
+[GLOBAL ap_trampoline_cr3]
+[GLOBAL ap_trampoline_stack]
+[GLOBAL ap_trampoline_entry]
+ap_trampoline_cr3:   dd 0
+ap_trampoline_stack: dd 0
+ap_trampoline_entry: dd 0
+[GLOBAL ap_trampoline_end]
+ap_trampoline_end:
+
+; The local APIC interrupts get the same treatment as the IRQs in
+; interrupt.s, so irq_handler() sees an ordinary registers_t.
+[EXTERN irq_handler]
+
+[GLOBAL irq_apic_timer]
+irq_apic_timer:
+    cli
+    push dword 0
+    push dword 0xEF           ; APIC_TIMER
+    jmp apic_common_stub
+
+[GLOBAL irq_ipi_reschedule]
+irq_ipi_reschedule:
+    cli
+    push dword 0
+    push dword 0xF0           ; IPI_RESCHEDULE
+    jmp apic_common_stub
+
+apic_common_stub:
+    pusha                     ; Pushes edi,esi,ebp,esp,ebx,edx,ecx,eax
+
+    mov ax, ds                ; Lower 16-bits of eax = ds.
+    push eax                  ; save the data segment descriptor
+
+    mov ax, 0x10              ; load the kernel data segment descriptor
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+
+    call irq_handler
+
+    pop ebx                   ; reload the original data segment descriptor
+    mov ds, bx
+    mov es, bx
+    mov fs, bx
+    mov gs, bx
+
+    popa                      ; Pops edi,esi,ebp...
+    add esp, 8                ; Cleans up the pushed error code and pushed ISR number
+    sti
+    iret
+
+; Spurious interrupts must not be acknowledged with an EOI.
+[GLOBAL irq_apic_spurious]
+irq_apic_spurious:
+    iret
@@ -0,0 +1,29 @@
+#include "spinlock.h"
+
+static uint32_t atomic_xchg(spinlock_t *lock, uint32_t value)
+{
+    // xchg with a memory operand is always locked, so no lock prefix is needed.
+    asm volatile("xchgl %0, %1" : "+r" (value), "+m" (*lock) : : "memory");
+    return value;
+}
+
+void spin_lock(spinlock_t *lock)
+{
+    while(atomic_xchg(lock, 1) != 0){
+        // Wait for the lock to look free before trying the (bus locking) xchg again.
+        while(*lock){
+            asm volatile("pause");
+        }
+    }
+}
+
+void spin_unlock(spinlock_t *lock)
+{
+    asm volatile("" : : : "memory");
+    *lock = SPINLOCK_UNLOCKED;
+}
+
+int spin_trylock(spinlock_t *lock)
+{
+    return atomic_xchg(lock, 1) == 0;
+}
@@ -0,0 +1,24 @@
+// spinlock.h -- Busy-waiting locks for data shared between CPUs.
+
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include "common.h"
+
+/// 0 when free, 1 when held. A spinlock doesn't know who holds it, so it is fine for one task to take it
+/// and another to release it (the scheduler relies on this).
+typedef volatile uint32_t spinlock_t;
+
+#define SPINLOCK_UNLOCKED 0
+
+/// Spin until the lock is acquired.
+void spin_lock(spinlock_t *lock);
+
+/// Release a lock acquired with spin_lock().
+void spin_unlock(spinlock_t *lock);
+
+/// Try to acquire the lock once.
+/// \returns TRUE if the lock is now held by the caller, FALSE if someone else has it
+int spin_trylock(spinlock_t *lock);
+
+#endif
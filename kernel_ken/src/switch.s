@@ -0,0 +1,106 @@
+;
+; switch.s -- Kernel stack switching. switch_to() is the only place a task
+;             gives up the CPU, so everything the scheduler needs to resume
+;             a task lives on that task's own kernel stack.
+;
+
+; void switch_to(uint32_t *prev_esp, uint32_t next_esp)
+; Only the callee-saved registers need to be preserved, since the C caller
+; already assumes eax/ecx/edx are trashed by the call.
+[GLOBAL switch_to]
+switch_to:
+    mov eax, [esp+4]          ; Where to save the outgoing stack pointer.
+    mov edx, [esp+8]          ; The incoming stack pointer.
+
+    push ebp
+    push ebx
+    push esi
+    push edi
+
+    mov [eax], esp            ; Save the outgoing task's stack...
+    mov esp, edx              ; ...and resume the incoming one.
+
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    ret                       ; Returns into the incoming task's run_scheduler(),
+                              ; or into task_entry_trampoline for a new task.
+
+; A new task's kernel stack is built so that switch_to() "returns" here, with
+; a registers_t sitting on top of the stack. We then leave the kernel the same
+; way the interrupt stubs do, so the task starts off in user mode.
+[GLOBAL task_entry_trampoline]
+[EXTERN finish_task_switch]
+task_entry_trampoline:
+    call finish_task_switch   ; Releases the kernel lock held by the scheduler.
+
+    pop eax                   ; Reload the original data segment descriptor.
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+
+    popa                      ; Pops edi,esi,ebp...
+    add esp, 8                ; Cleans up the pushed error code and pushed ISR number.
+    iret                      ; Pops CS, EIP, EFLAGS, SS, and ESP.
+
+; void call_on_stack(uint32_t stack_top, void (*fn)())
+; Used when the current kernel stack is about to be freed.
+[GLOBAL call_on_stack]
+call_on_stack:
+    mov eax, [esp+8]
+    mov esp, [esp+4]
+    xor ebp, ebp              ; Terminates the frame chain for debuggers.
+    call eax
+.hang:
+    jmp .hang                 ; fn should never return.
+
+; void relocate_stack(uint32_t old_top, uint32_t new_top)
+; Moves everything on the stack between esp and old_top to just below new_top,
+; and carries on from the copy. Any word on it that points into the old stack
+; (saved frame pointers, pointers to locals) is moved along with it. It has to
+; be done here rather than in C: an optimised caller could keep using the old
+; stack between copying it and switching esp.
+[GLOBAL relocate_stack]
+relocate_stack:
+    push ebp
+    push ebx
+    push esi
+    push edi
+
+    mov ebx, [esp+20]         ; old_top
+    mov edx, [esp+24]         ; new_top
+    mov esi, esp              ; Copy from here (our own saved registers too)...
+    mov ecx, ebx
+    sub ecx, esi              ; ...up to old_top.
+    mov edi, edx
+    sub edi, ecx              ; The copy of esp.
+    mov eax, edi
+    shr ecx, 2
+    cld
+    rep movsd
+
+    mov esi, esp              ; The old stack is esi up to ebx.
+    mov ebp, edx              ; The copy ends at new_top...
+    sub edx, ebx              ; ...and is edx bytes further on.
+    mov ecx, eax
+.relocate:
+    mov edi, [ecx]
+    cmp edi, esi
+    jb .next
+    cmp edi, ebx
+    jae .next
+    add edi, edx
+    mov [ecx], edi
+.next:
+    add ecx, 4
+    cmp ecx, ebp
+    jb .relocate
+
+    mov esp, eax
+    pop edi                   ; The caller's registers, moved too if they
+    pop esi                   ; pointed into the old stack.
+    pop ebx
+    pop ebp
+    ret
@@ -1,8 +1,17 @@
 #include "syscall.h"
 #include "monitor.h"
+#include "smp.h"
+#include "clock.h"
+#include "screen.h"
+#include "serial.h"
+#include "klog.h"
+#include "bench.h"
+#include "profile.h"
+#include "ksyms.h"
+#include "trace.h"
+#include "kheap.h"
+#include "klib.h"
 
-
-extern uint32_t read_eip();
 static void syscall_handler(registers_t *regs);
 
 ///
@@ -31,38 +40,138 @@ DEFN_SYSCALL3(read_impl, 17, int, void *, unsigned int);
 DEFN_SYSCALL1(close_pipe_impl, 18, int);
 DEFN_SYSCALL1(join_impl, 19, int);
 DEFN_SYSCALL3(monitor_colour, 20, int, int, unsigned int);
+DEFN_SYSCALL4(thread_create_impl, 21, void *, void *, void *, uint32_t);
+DEFN_SYSCALL1(thread_join_impl, 22, int);
+DEFN_SYSCALL4(spawn_impl, 23, void *, void *, void *, int);
+DEFN_SYSCALL0(idle_report_impl, 24);
+DEFN_SYSCALL1(msleep_impl, 25, uint32_t);
+DEFN_SYSCALL1(usleep_impl, 26, uint32_t);
+DEFN_SYSCALL1(sleep_until_impl, 27, uint32_t);
+DEFN_SYSCALL0(monotonic_ms_impl, 28);
+DEFN_SYSCALL2(clock_gettime_impl, 29, int, timespec_t *);
+DEFN_SYSCALL0(irq_report_impl, 30);
+DEFN_SYSCALL2(monitor_blit_impl, 31, const uint16_t *, const screen_rect_t *);
+DEFN_SYSCALL0(screen_acquire_impl, 32);
+DEFN_SYSCALL0(screen_release_impl, 33);
+DEFN_SYSCALL2(serial_read_impl, 34, void *, uint32_t);
+DEFN_SYSCALL3(dmesg_impl, 35, char *, uint32_t, uint32_t *);
+DEFN_SYSCALL1(klog_set_console_level_impl, 36, int);
+DEFN_SYSCALL3(bench_kmalloc_impl, 37, uint32_t, uint32_t, uint64_t *);
+DEFN_SYSCALL1(qemu_exit_impl, 38, uint32_t);
+DEFN_SYSCALL1(profile_start_impl, 39, uint32_t);
+DEFN_SYSCALL2(profile_read_impl, 40, profile_sample_t *, uint32_t);
+DEFN_SYSCALL3(ksym_name_impl, 41, uint32_t, char *, uint32_t);
+DEFN_SYSCALL1(trace_enable_impl, 42, uint32_t);
+DEFN_SYSCALL2(trace_read_impl, 43, trace_record_t *, uint32_t);
+DEFN_SYSCALL3(syscall_stats_impl, 44, uint32_t, syscall_stat_t *, uint32_t);
+DEFN_SYSCALL2(syscall_report_impl, 45, uint32_t, uint32_t);
+DEFN_SYSCALL1(syscall_stats_enable_impl, 46, uint32_t);
+
+/// Every system call, called as though it took five arguments (EBX, ECX, EDX, ESI and EDI in that order).
+typedef uint32_t (*syscall_t)(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t);
+
+// What a system call's return value says about how it went, for counting errors and calls that did nothing.
+#define SYSCALL_RETURNS_NOTHING     0   // Nothing: it's void, or returns a value that says nothing (monotonic_ms, or
+                                        // the sleeps, which always return 0)
+#define SYSCALL_RETURNS_STATUS      1   // Negative on error, and 0 if there was nothing to do
+#define SYSCALL_RETURNS_POINTER     2   // NULL on error
+#define SYSCALL_RETURNS_BOOL        3   // 0 (FALSE) on error, eg. the semaphore calls
+
+typedef struct
+{
+    void *handler;
+    uint32_t returns;       // One of SYSCALL_RETURNS_*
+} syscall_entry_t;
 
 ///
 /// Now register them in the following array:
 ///
-#define NUM_SYSCALLS 21
-static void *syscalls[NUM_SYSCALLS] =
+#define NUM_SYSCALLS 47
+static syscall_entry_t syscalls[NUM_SYSCALLS] =
 {
-        &monitor_write,
-        &monitor_write_hex,
-        &monitor_write_dec,
-        &fork_impl,
-        &getpid_impl,
-        &yield_impl,
-        &exit_impl,
-        &alloc_impl,
-        &free_impl,
-        &sleep_impl,
-        &set_priority_impl,
-        &open_sem_impl,
-        &wait_impl,
-        &signal_impl,
-        &close_sem_impl,
-        &open_pipe_impl,
-        &write_impl,
-        &read_impl,
-        &close_pipe_impl,
-        &join_impl,
-        &monitor_colour
+        {&monitor_write, SYSCALL_RETURNS_NOTHING},
+        {&monitor_write_hex, SYSCALL_RETURNS_NOTHING},
+        {&monitor_write_dec, SYSCALL_RETURNS_NOTHING},
+        {&fork_impl, SYSCALL_RETURNS_STATUS},
+        {&getpid_impl, SYSCALL_RETURNS_STATUS},
+        {&yield_impl, SYSCALL_RETURNS_NOTHING},
+        {&exit_impl, SYSCALL_RETURNS_NOTHING},
+        {&alloc_impl, SYSCALL_RETURNS_POINTER},
+        {&free_impl, SYSCALL_RETURNS_NOTHING},
+        {&sleep_impl, SYSCALL_RETURNS_NOTHING},
+        {&set_priority_impl, SYSCALL_RETURNS_BOOL},
+        {&open_sem_impl, SYSCALL_RETURNS_BOOL},
+        {&wait_impl, SYSCALL_RETURNS_BOOL},
+        {&signal_impl, SYSCALL_RETURNS_BOOL},
+        {&close_sem_impl, SYSCALL_RETURNS_BOOL},
+        {&open_pipe_impl, SYSCALL_RETURNS_STATUS},
+        {&write_impl, SYSCALL_RETURNS_STATUS},
+        {&read_impl, SYSCALL_RETURNS_STATUS},
+        {&close_pipe_impl, SYSCALL_RETURNS_STATUS},
+        {&join_impl, SYSCALL_RETURNS_STATUS},
+        {&monitor_colour, SYSCALL_RETURNS_NOTHING},
+        {&thread_create_impl, SYSCALL_RETURNS_STATUS},
+        {&thread_join_impl, SYSCALL_RETURNS_STATUS},
+        {&spawn_impl, SYSCALL_RETURNS_BOOL},
+        {&idle_report_impl, SYSCALL_RETURNS_NOTHING},
+        {&msleep_impl, SYSCALL_RETURNS_NOTHING},
+        {&usleep_impl, SYSCALL_RETURNS_NOTHING},
+        {&sleep_until_impl, SYSCALL_RETURNS_NOTHING},
+        {&monotonic_ms_impl, SYSCALL_RETURNS_NOTHING},
+        {&clock_gettime_impl, SYSCALL_RETURNS_STATUS},
+        {&irq_report_impl, SYSCALL_RETURNS_NOTHING},
+        {&monitor_blit_impl, SYSCALL_RETURNS_STATUS},
+        {&screen_acquire_impl, SYSCALL_RETURNS_POINTER},
+        {&screen_release_impl, SYSCALL_RETURNS_STATUS},
+        {&serial_read_impl, SYSCALL_RETURNS_STATUS},
+        {&dmesg_impl, SYSCALL_RETURNS_STATUS},
+        {&klog_set_console_level_impl, SYSCALL_RETURNS_STATUS},
+        {&bench_kmalloc_impl, SYSCALL_RETURNS_STATUS},
+        {&qemu_exit_impl, SYSCALL_RETURNS_STATUS},
+        {&profile_start_impl, SYSCALL_RETURNS_STATUS},
+        {&profile_read_impl, SYSCALL_RETURNS_STATUS},
+        {&ksym_name_impl, SYSCALL_RETURNS_STATUS},
+        {&trace_enable_impl, SYSCALL_RETURNS_STATUS},
+        {&trace_read_impl, SYSCALL_RETURNS_STATUS},
+        {&syscall_stats_impl, SYSCALL_RETURNS_STATUS},
+        {&syscall_report_impl, SYSCALL_RETURNS_STATUS},
+        {&syscall_stats_enable_impl, SYSCALL_RETURNS_STATUS}
 };
 
 /// -----------------------------------------
 
+// Counts for every task since boot. Each CPU has its own, so that the dispatcher never has to share a cache line or
+// take a lock to update them. syscall_stats_impl() adds them up.
+static syscall_stat_t cpu_syscall_stats[MAX_CPUS][NUM_SYSCALLS];
+// Whether tasks get their own counts as well. See syscall_stats_enable_impl().
+static uint32_t task_stats_enabled = FALSE;
+
+static uint32_t syscall_hist_bucket(uint64_t cycles)
+{
+    cycles >>= SYSCALL_HIST_SHIFT;
+    if(cycles == 0){
+        return 0;
+    }
+    uint32_t high = (uint32_t)(cycles >> 32);
+    uint32_t bucket = high ? 64 - __builtin_clz(high) : 32 - __builtin_clz((uint32_t)cycles);
+    return MIN(bucket, SYSCALL_HIST_BUCKETS - 1);
+}
+
+static void syscall_account(syscall_stat_t *stat, uint32_t returns, uint32_t ret, uint64_t cycles)
+{
+    stat->calls++;
+    if(returns == SYSCALL_RETURNS_STATUS && (int)ret < 0){
+        stat->errors++;
+    } else if((returns == SYSCALL_RETURNS_POINTER || returns == SYSCALL_RETURNS_BOOL) && ret == 0){
+        stat->errors++;
+    } else if(returns == SYSCALL_RETURNS_STATUS && ret == 0){
+        stat->zeros++;
+        stat->zero_cycles += cycles;
+    }
+    stat->cycles += cycles;
+    stat->histogram[syscall_hist_bucket(cycles)]++;
+}
+
 void initialise_syscalls()
 {
     // Register our syscall handler.
@@ -76,35 +185,172 @@ void syscall_handler(registers_t *regs)
     if (regs->eax >= NUM_SYSCALLS)
         return;
 
-    if(regs->eax == SYSCALL_FORK){
-        register_stack_pointer((uint32_t)&regs, (uint32_t)regs);
-    }
+    // Syscalls like fork() need to see the user's registers, not just the arguments.
+    task_t *task = current_process;
+    task->regs = regs;
+    uint32_t number = regs->eax;
 
     // Get the required syscall location.
-    void *location = syscalls[regs->eax];
-
-    // We don't know how many parameters the function wants, so we just
-    // push them all onto the stack in the correct order. The function will
-    // use all the parameters it wants, and we can pop them all back off afterwards.
-    uint32_t ret;
-    asm volatile (" \
-     push %1; \
-     push %2; \
-     push %3; \
-     push %4; \
-     push %5; \
-     call *%6; \
-     pop %%ebx; \
-     pop %%ebx; \
-     pop %%ebx; \
-     pop %%ebx; \
-     pop %%ebx; \
-   " : "=a" (ret) : "r" (regs->edi), "r" (regs->esi), "r" (regs->edx), "r" (regs->ecx), "r" (regs->ebx), "r" (location));
+    syscall_entry_t *entry = &syscalls[regs->eax];
+    TRACE(TRACE_SYSCALL_ENTER, regs->eax, regs->ebx, 0);
+
+    // We don't know how many parameters the function wants, so we just pass all five. The caller cleans up the
+    // stack in the C calling convention, so any the function doesn't declare are simply ignored.
+    // System calls run with interrupts enabled, so a long one doesn't hold up timer ticks. An interrupt that arrives
+    // meanwhile just runs its handler. Anything it leaves for later waits for a preempt_point() or the end of the call.
+    asm volatile("sti" : : : "memory");
+    if(task_stats_enabled && !task->syscall_stats){
+        task->syscall_stats = kmalloc(NUM_SYSCALLS * sizeof(syscall_stat_t));
+        memset(task->syscall_stats, 0, NUM_SYSCALLS * sizeof(syscall_stat_t));
+    }
+    syscall_t call = (syscall_t)entry->handler;
+    uint64_t start = read_tsc();
+    uint32_t ret = call(regs->ebx, regs->ecx, regs->edx, regs->esi, regs->edi);
+    uint64_t cycles = read_tsc() - start;
+    asm volatile("cli" : : : "memory");
+
+    // The call could have moved the task to another CPU. Its counts go to the CPU it finished on.
+    if(task_stats_enabled && task->syscall_stats){
+        syscall_account(&task->syscall_stats[number], entry->returns, ret, cycles);
+    }
+    syscall_account(&cpu_syscall_stats[this_cpu()->index][number], entry->returns, ret, cycles);
+    TRACE(TRACE_SYSCALL_EXIT, number, ret, 0);
     regs->eax = ret;
+}
 
+/// Adds stat into total.
+static void syscall_stat_add(syscall_stat_t *total, const syscall_stat_t *stat)
+{
+    total->calls += stat->calls;
+    total->errors += stat->errors;
+    total->zeros += stat->zeros;
+    total->cycles += stat->cycles;
+    total->zero_cycles += stat->zero_cycles;
+    for(uint32_t i = 0; i < SYSCALL_HIST_BUCKETS; i++){
+        total->histogram[i] += stat->histogram[i];
+    }
+}
 
+int syscall_stats_impl(uint32_t pid, syscall_stat_t *stats, uint32_t max)
+{
+    if(!stats){
+        return -1;
+    }
+    task_t *task = NULL;
+    if(pid){
+        task = get_task_by_pid(pid);
+        if(!task){
+            return -1;
+        }
+    }
+
+    uint32_t count = MIN(max, NUM_SYSCALLS);
+    memset(stats, 0, count * sizeof(syscall_stat_t));
+    for(uint32_t i = 0; i < count; i++){
+        if(task){
+            if(task->syscall_stats){
+                stats[i] = task->syscall_stats[i];
+            }
+        } else {
+            for(uint32_t c = 0; c < cpu_count; c++){
+                syscall_stat_add(&stats[i], &cpu_syscall_stats[c][i]);
+            }
+        }
+        stats[i].handler = (uint32_t)syscalls[i].handler;
+    }
+    return count;
+}
+
+/// \returns total / count, or uint32_t_MAX if that doesn't fit in 32 bits
+static uint32_t syscall_average(uint64_t total, uint32_t count)
+{
+    if(count == 0){
+        return 0;
+    }
+    if((total >> 32) >= count){
+        return uint32_t_MAX;
+    }
+    return udiv64(total, count);
+}
+
+/// \returns the upper bound, in cycles, of the bucket the given percentile of calls falls in, or 0 if that's the
+/// last one, which has none
+static uint64_t syscall_percentile(const syscall_stat_t *stat, uint32_t percent)
+{
+    uint64_t wanted = (uint64_t)stat->calls * percent;
+    uint64_t seen = 0;
+    for(uint32_t b = 0; b < SYSCALL_HIST_BUCKETS - 1; b++){
+        seen += (uint64_t)stat->histogram[b] * 100;
+        if(seen >= wanted){
+            return 1ull << (b + SYSCALL_HIST_SHIFT);
+        }
+    }
+    return 0;
+}
+
+int syscall_report_impl(uint32_t pid, uint32_t top)
+{
+    syscall_stat_t *stats = kmalloc(NUM_SYSCALLS * sizeof(syscall_stat_t));
+    if(syscall_stats_impl(pid, stats, NUM_SYSCALLS) < 0){
+        kfree(stats);
+        return -1;
+    }
+
+    uint64_t total = 0;
+    for(uint32_t i = 0; i < NUM_SYSCALLS; i++){
+        total += stats[i].cycles;
+    }
+    if(pid){
+        kprintf("System calls of task %u, by TSC cycles spent in them \n", pid);
+    } else {
+        kprintf("System calls since boot, by TSC cycles spent in them \n");
+    }
+    kprintf("%-22s %8s %6s %8s %11s %5s %12s %12s %5s \n", "syscall", "calls", "errors", "zeros", "cycles/call",
+            "zero%", "p50 <", "p99 <", "share");
+
+    // Pick the most expensive one still left each time. There are few enough of them that sorting isn't worth it.
+    for(uint32_t n = 0; n < top; n++){
+        syscall_stat_t *best = NULL;
+        for(uint32_t i = 0; i < NUM_SYSCALLS; i++){
+            if(stats[i].calls && (!best || stats[i].cycles > best->cycles)){
+                best = &stats[i];
+            }
+        }
+        if(!best){
+            break;
+        }
+
+        // Both shares are in percent, worked out with 32 bit divisors.
+        uint64_t cycles = best->cycles;
+        uint64_t zero_cycles = best->zero_cycles;
+        uint64_t all = total;
+        while(all >> 32){
+            all >>= 1;
+            cycles >>= 1;
+        }
+        uint32_t share = all ? udiv64(cycles * 100, (uint32_t)all) : 0;
+        cycles = best->cycles;
+        while(cycles >> 32){
+            cycles >>= 1;
+            zero_cycles >>= 1;
+        }
+        uint32_t zero_share = cycles ? udiv64(zero_cycles * 100, (uint32_t)cycles) : 0;
 
-    clear_stack_pointers();
+        uint32_t offset;
+        const char *name = ksym_lookup(best->handler, &offset);
+        // A percentile in the last bucket is shown as 0, since that bucket has no upper bound.
+        kprintf("%-22s %8u %6u %8u %11u %4u%% %12llu %12llu %4u%% \n", name ? name : "?", best->calls, best->errors,
+                best->zeros, syscall_average(best->cycles, best->calls), zero_share, syscall_percentile(best, 50),
+                syscall_percentile(best, 99), share);
+        best->calls = 0;
+    }
 
+    kfree(stats);
+    return 0;
+}
 
+int syscall_stats_enable_impl(uint32_t enable)
+{
+    task_stats_enabled = enable ? TRUE : FALSE;
+    return 0;
 }
@@ -7,9 +7,52 @@
 
 #include "common.h"
 #include "task.h"
+#include "clock.h"
+#include "monitor.h"
+#include "profile.h"
+#include "trace.h"
 
 void initialise_syscalls();
 
+// Latency histogram buckets. Bucket 0 counts calls that took fewer than 2^SYSCALL_HIST_SHIFT TSC cycles, bucket b
+// calls that took [2^(b+SHIFT-1), 2^(b+SHIFT)) and the last one everything longer than that, from 2^37 cycles
+// (45 seconds at 3 GHz). That's enough for calls that block to land in a bucket of their own.
+#define SYSCALL_HIST_BUCKETS    32
+#define SYSCALL_HIST_SHIFT      7
+
+/// What the dispatcher has counted for one system call. Latency is from just before the call to just after it, so a
+/// call that blocks (wait(), msleep(), join()) includes the time spent blocked. exit() never returns, so it never
+/// gets counted. errors and zeros stay 0 for calls that don't return a status, eg. yield() or monotonic_ms().
+typedef struct syscall_stat
+{
+    uint32_t handler;               // Address of the system call's *_impl function. Filled in by syscall_stats_impl()
+    uint32_t calls;
+    uint32_t errors;                // Calls that returned a negative number, or 0 for the ones returning a pointer or
+                                    // TRUE/FALSE
+    uint32_t zeros;                 // Calls that returned 0, e.g. a write() to a full pipe or a read() of an empty one
+    uint64_t cycles;                // TSC cycles spent in all of the calls
+    uint64_t zero_cycles;           // The part of cycles spent in calls that returned 0
+    uint32_t histogram[SYSCALL_HIST_BUCKETS];
+} syscall_stat_t;
+
+/// Starts or stops counting system calls for each task. Counts for every task since boot are always kept, but each
+/// task's own take a table per task, which is only allocated (on its next system call) while this is on. Stopping
+/// keeps the counts made so far. It's off at boot.
+/// \returns 0
+int syscall_stats_enable_impl(uint32_t enable);
+
+/// Copies the counts of up to max system calls into stats, entry i for system call i.
+/// \param [in] pid a task to get the counts of, or 0 for every task since boot. A task's counts are all 0 unless
+/// syscall_stats_enable_impl() was on while it made its calls.
+/// \returns how many entries were filled in, or -1 if stats is NULL or there's no task pid
+int syscall_stats_impl(uint32_t pid, syscall_stat_t *stats, uint32_t max);
+
+/// Prints the top system calls by the TSC cycles spent in them, with their counts and latency percentiles.
+/// \param [in] pid a task to report on, or 0 for every task since boot
+/// \param [in] top how many system calls to print
+/// \returns 0, or -1 if there's no task pid
+int syscall_report_impl(uint32_t pid, uint32_t top);
+
 #define DECL_SYSCALL0(fn) int syscall_##fn();
 #define DECL_SYSCALL1(fn,p1) int syscall_##fn(p1);
 #define DECL_SYSCALL2(fn,p1,p2) int syscall_##fn(p1,p2);
@@ -21,7 +64,7 @@ void initialise_syscalls();
 int syscall_##fn() \
 { \
     int a; \
-    asm volatile("int $0x80" : "=a" (a) : "0" (num)); \
+    asm volatile("int $0x80" : "=a" (a) : "0" (num) : "memory"); \
     return a; \
 }
 
@@ -29,7 +72,7 @@ int syscall_##fn() \
 int syscall_##fn(P1 p1) \
 { \
     int a; \
-    asm volatile("int $0x80" : "=a" (a) : "0" (num), "b" ((int)p1)); \
+    asm volatile("int $0x80" : "=a" (a) : "0" (num), "b" ((int)p1) : "memory"); \
     return a; \
 }
 
@@ -37,7 +80,7 @@ int syscall_##fn(P1 p1) \
 int syscall_##fn(P1 p1, P2 p2) \
 { \
     int a; \
-    asm volatile("int $0x80" : "=a" (a) : "0" (num), "b" ((int)p1), "c" ((int)p2)); \
+    asm volatile("int $0x80" : "=a" (a) : "0" (num), "b" ((int)p1), "c" ((int)p2) : "memory"); \
     return a; \
 }
 
@@ -45,7 +88,7 @@ int syscall_##fn(P1 p1, P2 p2) \
 int syscall_##fn(P1 p1, P2 p2, P3 p3) \
 { \
     int a; \
-    asm volatile("int $0x80" : "=a" (a) : "0" (num), "b" ((int)p1), "c" ((int)p2), "d"((int)p3)); \
+    asm volatile("int $0x80" : "=a" (a) : "0" (num), "b" ((int)p1), "c" ((int)p2), "d"((int)p3) : "memory"); \
     return a; \
 }
 
@@ -53,15 +96,15 @@ int syscall_##fn(P1 p1, P2 p2, P3 p3) \
 int syscall_##fn(P1 p1, P2 p2, P3 p3, P4 p4) \
 { \
     int a; \
-    asm volatile("int $0x80" : "=a" (a) : "0" (num), "b" ((int)p1), "c" ((int)p2), "d" ((int)p3), "S" ((int)p4)); \
+    asm volatile("int $0x80" : "=a" (a) : "0" (num), "b" ((int)p1), "c" ((int)p2), "d" ((int)p3), "S" ((int)p4) : "memory"); \
     return a; \
 }
 
-#define DEFN_SYSCALL5(fn, num) \
+#define DEFN_SYSCALL5(fn, num, P1, P2, P3, P4, P5) \
 int syscall_##fn(P1 p1, P2 p2, P3 p3, P4 p4, P5 p5) \
 { \
     int a; \
-    asm volatile("int $0x80" : "=a" (a) : "0" (num), "b" ((int)p1), "c" ((int)p2), "d" ((int)p3), "S" ((int)p4), "D" ((int)p5)); \
+    asm volatile("int $0x80" : "=a" (a) : "0" (num), "b" ((int)p1), "c" ((int)p2), "d" ((int)p3), "S" ((int)p4), "D" ((int)p5) : "memory"); \
     return a; \
 }
 
@@ -86,6 +129,32 @@ DECL_SYSCALL3(read_impl, int, void *, unsigned int);
 DECL_SYSCALL1(close_pipe_impl, int);
 DECL_SYSCALL1(join_impl, int);
 DECL_SYSCALL3(monitor_colour, int, int, unsigned int);
+DECL_SYSCALL4(thread_create_impl, void *, void *, void *, uint32_t);
+DECL_SYSCALL1(thread_join_impl, int);
+DECL_SYSCALL4(spawn_impl, void *, void *, void *, int);
+DECL_SYSCALL0(idle_report_impl);
+DECL_SYSCALL1(msleep_impl, uint32_t);
+DECL_SYSCALL1(usleep_impl, uint32_t);
+DECL_SYSCALL1(sleep_until_impl, uint32_t);
+DECL_SYSCALL0(monotonic_ms_impl);
+DECL_SYSCALL2(clock_gettime_impl, int, timespec_t *);
+DECL_SYSCALL0(irq_report_impl);
+DECL_SYSCALL2(monitor_blit_impl, const uint16_t *, const screen_rect_t *);
+DECL_SYSCALL0(screen_acquire_impl);
+DECL_SYSCALL0(screen_release_impl);
+DECL_SYSCALL2(serial_read_impl, void *, uint32_t);
+DECL_SYSCALL3(dmesg_impl, char *, uint32_t, uint32_t *);
+DECL_SYSCALL1(klog_set_console_level_impl, int);
+DECL_SYSCALL3(bench_kmalloc_impl, uint32_t, uint32_t, uint64_t *);
+DECL_SYSCALL1(qemu_exit_impl, uint32_t);
+DECL_SYSCALL1(profile_start_impl, uint32_t);
+DECL_SYSCALL2(profile_read_impl, profile_sample_t *, uint32_t);
+DECL_SYSCALL3(ksym_name_impl, uint32_t, char *, uint32_t);
+DECL_SYSCALL1(trace_enable_impl, uint32_t);
+DECL_SYSCALL2(trace_read_impl, trace_record_t *, uint32_t);
+DECL_SYSCALL3(syscall_stats_impl, uint32_t, syscall_stat_t *, uint32_t);
+DECL_SYSCALL2(syscall_report_impl, uint32_t, uint32_t);
+DECL_SYSCALL1(syscall_stats_enable_impl, uint32_t);
 
 
 
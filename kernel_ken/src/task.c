@@ -7,19 +7,21 @@
 #include "queue.h"
 #include "linked_list.h"
 #include "heapindex.h"
+#include "smp.h"
+#include "timer.h"
+#include "clock.h"
+#include "trace.h"
+#include "monitor.h"
+#include "screen.h"
 
 extern uint32_t kernel_cleanup_stack;
 extern uint32_t initial_esp;
 extern page_directory_t *kernel_directory;
-extern page_directory_t *current_directory;
-extern uint32_t read_eip();
-extern uint32_t initial_esp;
+extern void task_entry_trampoline();
 
-// Global job queues
+// Global job queues (the ready queues are per-CPU, see cpu_t)
 list_t *sleeping_jobs = NULL;
 list_t *task_list = NULL;
-list_t *ready_queue = NULL;
-task_t *current_process = NULL;
 // Global lists of all semaphores/pipes open
 list_t *semaphores_list = NULL;
 list_t *pipe_list = NULL;
@@ -36,43 +38,261 @@ static int comparator_pid(void *a, void *b)
     return h_a->id < h_b->id ? -1 : h_a->id > h_b->id ? 1 : 0;
 }
 
-void register_stack_pointer(uint32_t loc, uint32_t target)
+static int comparator_int(void *a, void *b)
 {
-    pointer_info_t *ptr = kmalloc(sizeof(*ptr));
-    ptr->pointer_memory_loc = loc;
-    ptr->pointer_target = target;
-    list_add_back(current_process->pointers, ptr);
+    int h_a = (int)a;
+    int h_b = (int)b;
+    return h_a < h_b ? -1 : h_a > h_b ? 1 : 0;
 }
 
-void clear_stack_pointers()
-{
-    list_foreach(current_process->pointers, kfree);
-    list_clear(current_process->pointers);
-}
+// switch_to() needs somewhere to save the stack pointer of a task that has already been freed.
+static uint32_t dead_task_esp = 0;
 
-task_t *task_init(page_directory_t *page_dir)
+/// Allocates a task_t with no PID that isn't in task_list yet.
+static task_t *task_alloc(page_directory_t *page_dir)
 {
     task_t *t = kmalloc(sizeof(*t));
-    t->id = pid_generator++;
-    t->sleep_ticks = 0;
+    t->id = 0;
+    t->wake_time = 0;
     t->esp = 0;
-    t->ebp = 0;
-    t->eip = 0;
     t->page_directory = page_dir;
     t->priority = PRIORITY_NORMAL;
     t->kernel_stack = (uint32_t)kmalloc_a(KERNEL_STACK_SIZE);
+    t->regs = NULL;
+    t->cpu = 0;
     t->initial_priority = t->priority;
     t->time_slice_count = 0;
     t->heap = NULL;
+    t->user_stack = 0;
+    t->preempt_count = 0;
+    t->syscall_stats = NULL;
     t->state = state_new;
-    t->pointers = list_init();
     t->waiting_processes = list_init();
     t->semaphores = list_init();
     t->pipes = list_init();
+    return t;
+}
+
+task_t *task_init(page_directory_t *page_dir)
+{
+    task_t *t = task_alloc(page_dir);
+    t->id = pid_generator++;
     list_add_back(task_list, t);
     return t;
 }
 
+/// Builds the initial kernel stack of a task that has never run. The first switch_to() into the task
+/// pops an empty set of callee-saved registers and returns into task_entry_trampoline, which then
+/// irets to user mode with the registers in regs.
+/// \param [in] task a task in state_new
+/// \param [in] regs the user-mode registers the task should start with
+void task_prepare_entry_frame(task_t *task, registers_t *regs)
+{
+    uint32_t *stack = (uint32_t *)(task->kernel_stack + KERNEL_STACK_SIZE);
+
+    stack -= sizeof(registers_t) / sizeof(uint32_t);
+    memcpy(stack, regs, sizeof(registers_t));
+
+    // Mirrors the pushes in switch_to()
+    *--stack = (uint32_t)task_entry_trampoline;
+    *--stack = 0; // ebp
+    *--stack = 0; // ebx
+    *--stack = 0; // esi
+    *--stack = 0; // edi
+
+    task->esp = (uint32_t)stack;
+}
+
+/// Builds the initial kernel stack of a kernel-mode task, so the first switch_to() into the task calls entry.
+/// entry runs with the kernel lock held (just like the rest of the scheduler) and must never return.
+static void task_prepare_kernel_frame(task_t *task, void (*entry)())
+{
+    uint32_t *stack = (uint32_t *)(task->kernel_stack + KERNEL_STACK_SIZE);
+
+    *--stack = 0; // Fake return address for entry
+    *--stack = (uint32_t)entry;
+    *--stack = 0; // ebp
+    *--stack = 0; // ebx
+    *--stack = 0; // esi
+    *--stack = 0; // edi
+
+    task->esp = (uint32_t)stack;
+}
+
+void finish_task_switch()
+{
+    kernel_exit();
+}
+
+void idle_loop()
+{
+    for(;;){
+        // Sleep until the next interrupt, which is also the only way anything could become ready to run.
+        asm volatile("sti; hlt" : : : "memory");
+    }
+}
+
+/// \returns parts per thousand of whole that part makes up
+static uint32_t permille(uint64_t part, uint64_t whole)
+{
+    // 64 bit division would need libgcc, so scale both down until they fit in 32 bits instead.
+    while(whole >> 32){
+        part >>= 1;
+        whole >>= 1;
+    }
+    if(whole < 1000){
+        return 0;
+    }
+    return (uint32_t)part / ((uint32_t)whole / 1000);
+}
+
+void idle_report_impl()
+{
+    uint64_t now = clock_monotonic_ns();
+    for(uint32_t i = 0; i < cpu_count; i++){
+        cpu_t *cpu = &cpus[i];
+        if(!cpu->online){
+            continue;
+        }
+        uint64_t idle = cpu->idle_ns;
+        if(cpu->current == cpu->idle){
+            idle += now - cpu->idle_since;
+        }
+        uint32_t p = permille(idle, now - cpu->online_since);
+        kprintf("CPU %u: %u.%u%% idle \n", i, p / 10, p % 10);
+    }
+    kprintf("%u timer ticks since boot \n", timer_get_ticks());
+}
+
+static void idle_task_start()
+{
+    finish_task_switch();
+    idle_loop();
+}
+
+task_t *task_create_idle(uint32_t cpu)
+{
+    task_t *t = task_alloc(kernel_directory);
+    t->cpu = cpu;
+    t->priority = PRIORITY_MIN + 1;
+    t->initial_priority = t->priority;
+    task_prepare_kernel_frame(t, idle_task_start);
+    return t;
+}
+
+/// \returns how busy a CPU is: the tasks in its ready queue, plus the one running (unless it's idling)
+static int cpu_load(cpu_t *cpu)
+{
+    return list_size(cpu->ready_queue) + (cpu->current && cpu->current != cpu->idle ? 1 : 0);
+}
+
+/// \returns the online CPU with the least work queued, which is where new tasks are started
+static cpu_t *least_loaded_cpu()
+{
+    cpu_t *best = this_cpu();
+    int best_load = cpu_load(best);
+    for(uint32_t i = 0; i < cpu_count; i++){
+        if(!cpus[i].online){
+            continue;
+        }
+        int load = cpu_load(&cpus[i]);
+        if(load < best_load){
+            best = &cpus[i];
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+void sched_enqueue(task_t *task)
+{
+    cpu_t *cpu = &cpus[task->cpu];
+    // Whatever is about to run needs its time slices again.
+    timer_work_queued();
+
+    task->state = state_ready;
+    list_add_back(cpu->ready_queue, task);
+
+    // An idle CPU won't look at its ready queue until its next tick otherwise.
+    if(cpu->current == cpu->idle){
+        smp_send_reschedule(cpu);
+    }
+}
+
+/// \returns TRUE if no CPU has anything to run, so nothing can happen until the next sleeper wakes up or some
+/// other interrupt arrives
+static int sched_all_idle()
+{
+    for(uint32_t i = 0; i < cpu_count; i++){
+        if(!cpus[i].online){
+            continue;
+        }
+        if(cpus[i].current != cpus[i].idle || list_size(cpus[i].ready_queue) > 0){
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+void sched_program_tick()
+{
+    cpu_t *cpu = this_cpu();
+    if(cpu->current != cpu->idle){
+        timer_restart_tick();
+        return;
+    }
+    if(!sched_all_idle()){
+        timer_cpu_idle();
+        return;
+    }
+    // There may not be another tick for a while, so whatever was printed last has to be shown now.
+    monitor_flush();
+    task_t *first = list_is_empty(sleeping_jobs) ? NULL : sleeping_jobs->front->value;
+    timer_set_next_event(first ? first->wake_time : 0);
+}
+
+void sched_wake_sleepers(uint64_t now)
+{
+    // sleeping_jobs is sorted by wake time, so everything due is at the front.
+    while(!list_is_empty(sleeping_jobs) && ((task_t *)sleeping_jobs->front->value)->wake_time <= now){
+        sched_enqueue(list_remove_front(sleeping_jobs));
+    }
+}
+
+/// Pulls one task over from the busiest CPU if it has at least two more tasks than this one.
+static void sched_balance(cpu_t *cpu)
+{
+    cpu_t *busiest = NULL;
+    int busiest_load = list_size(cpu->ready_queue) + 1;
+    for(uint32_t i = 0; i < cpu_count; i++){
+        if(&cpus[i] == cpu || !cpus[i].online){
+            continue;
+        }
+        int load = cpu_load(&cpus[i]);
+        if(load > busiest_load){
+            busiest = &cpus[i];
+            busiest_load = load;
+        }
+    }
+    if(!busiest){
+        return;
+    }
+
+    // Take the task that was queued most recently, since it's been waiting the least. The first process
+    // only ever blocks, so it's not worth moving.
+    struct linked_list_node *node = busiest->ready_queue->back;
+    while(node && ((task_t *)node->value)->id == global_parent_id){
+        node = node->previous;
+    }
+    if(!node){
+        return;
+    }
+    task_t *task = node->value;
+    list_remove_node(busiest->ready_queue, node);
+    task->cpu = cpu->index;
+    list_add_back(cpu->ready_queue, task);
+}
+
 void task_create_heap(task_t *t, uint32_t start, uint32_t end, uint32_t max, uint8_t supervisor, uint8_t readonly)
 {
     // Need frames for the initial contents
@@ -84,44 +304,50 @@ void task_create_heap(task_t *t, uint32_t start, uint32_t end, uint32_t max, uin
     t->heap = heap_init(start, end, max, supervisor, readonly);
 }
 
+/// Maps and clears the page that holds the stdout buffer of the process whose directory is current. fork_impl() doesn't
+/// need this: the child gets a copy of the parent's page along with the rest of its address space.
+static void task_create_stdout()
+{
+    alloc_frame(get_page(USTDOUT_START, 1, current_directory), FALSE, TRUE);
+    memset((void*)USTDOUT_START, 0, PAGE_SIZE);
+}
+
 void switch_to_user_mode()
 {
     // Set up our kernel stack.
     set_kernel_stack(current_process->kernel_stack+KERNEL_STACK_SIZE);
 
-    // Set up a stack structure for switching to user mode.
-    asm volatile("  \
-      cli; \
-      mov $0x23, %ax; \
-      mov %ax, %ds; \
-      mov %ax, %es; \
-      mov %ax, %fs; \
-      mov %ax, %gs; \
-                    \
-       \
-      mov %esp, %eax; \
-      pushl $0x23; \
-      pushl %esp; \
-      pushf; \
-      pop %eax ;\
-      or $0x200, %eax;\
-      push %eax;\
-      pushl $0x1B; \
-      push $1f; \
-      iret; \
-    1: \
-      ");
+    // Set up a stack structure for switching to user mode. The iret lands on 1: with ESP back where it started, so
+    // the compiler's idea of the stack still holds afterwards.
+    asm volatile("cli\n\t"
+                 "mov $0x23, %%ax\n\t"
+                 "mov %%ax, %%ds\n\t"
+                 "mov %%ax, %%es\n\t"
+                 "mov %%ax, %%fs\n\t"
+                 "mov %%ax, %%gs\n\t"
+                 "mov %%esp, %%eax\n\t"
+                 "pushl $0x23\n\t"
+                 "pushl %%eax\n\t"
+                 "pushf\n\t"
+                 "pop %%eax\n\t"
+                 "or $0x200, %%eax\n\t"
+                 "push %%eax\n\t"
+                 "pushl $0x1B\n\t"
+                 "push $1f\n\t"
+                 "iret\n"
+                 "1:"
+                 : : : "eax", "cc", "memory");
 }
 
 void initialise_scheduler()
 {
-    asm volatile("cli");
+    asm volatile("cli" : : : "memory");
 
     // We could move the stack at a few different places. JamesM's tutorials suggest moving it here is OK, especially
     // since that won't cause any damage
     move_stack((void*)KSTACK_START, KSTACK_SIZE);
 
-    ready_queue = list_init();
+    this_cpu()->ready_queue = list_init();
     sleeping_jobs = list_init();
     task_list = list_init();
     current_process = task_init(current_directory);
@@ -130,6 +356,7 @@ void initialise_scheduler()
     current_process->state = state_ready;
     task_create_heap(current_process, UHEAP_START, UHEAP_START + UHEAP_INITIAL_SIZE, UHEAP_MAX, FALSE, FALSE);
     current_process->heap->directory = current_directory;
+    task_create_stdout();
 
     semaphores_list = list_init();
 
@@ -137,7 +364,7 @@ void initialise_scheduler()
 
     ASSERT(current_process->id == global_parent_id);
 
-    asm volatile("sti");
+    asm volatile("sti" : : : "memory");
 }
 
 void apply_aging(void *a)
@@ -153,57 +380,36 @@ void apply_aging(void *a)
     }
 }
 
-void run_scheduler(int add_to_ready, int is_alive, int is_timer_based)
+/// The body of run_scheduler(), which runs it with interrupts off.
+static void schedule(int add_to_ready, int is_alive)
 {
-    if(!current_process){
+    cpu_t *cpu = this_cpu();
+    if(!cpu->current){
         return;
     }
 
-    uint32_t esp;
-    uint32_t ebp;
-    uint32_t eip;
-    asm volatile("mov %%esp, %0" : "=r"(esp));
-    asm volatile("mov %%ebp, %0" : "=r"(ebp));
-    eip = read_eip();
+    task_t *prev = cpu->current;
 
-    if(is_alive && current_process->state != state_terminating){
-        current_process->eip = eip;
-        current_process->esp = esp;
-        current_process->ebp = ebp;
-
-        list_foreach(ready_queue, apply_aging);
+    // The idle task never goes in a ready queue. It's what runs when the queue is empty.
+    if(is_alive && prev->state != state_terminating && prev != cpu->idle){
+        list_foreach(cpu->ready_queue, apply_aging);
 
         if(add_to_ready){
-            list_add_back(ready_queue, (void*)current_process);
-            current_process->state = state_ready;
+            list_add_back(cpu->ready_queue, (void*)prev);
+            prev->state = state_ready;
         } else {
-            current_process->state = state_waiting;
+            prev->state = state_waiting;
         }
     }
 
-    // Update sleeping things.
-    struct linked_list_node *node;
-    if(is_timer_based){
-        node = sleeping_jobs->front;
-        while(node){
-            task_t *value = node->value;
-            assert(value->sleep_ticks > 0);
-            value->sleep_ticks--;
-            if(value->sleep_ticks == 0){
-                list_add_back(ready_queue, value);
-
-                struct linked_list_node *temp = node->next;
-                list_remove_node(sleeping_jobs, node);
-                node = temp;
-                continue;
-            }
-            node = node->next;
-        }
+    if(cpu_count > 1){
+        sched_balance(cpu);
     }
 
     // Schedule the next job. I assume there's a better way to do this, as a list_ function,
     // but I don't know what it is right now.
-    node = ready_queue->front;
+    task_t *next = cpu->idle;
+    struct linked_list_node *node = cpu->ready_queue->front;
     struct linked_list_node *best = node;
     while(node){
         task_t *value = node->value;
@@ -213,35 +419,83 @@ void run_scheduler(int add_to_ready, int is_alive, int is_timer_based)
         }
         node = node->next;
     }
-    current_process = best->value;
-    current_process->priority = current_process->initial_priority;
-    current_process->time_slice_count = 0;
-    enum task_state prev_state = current_process->state;
-    current_process->state = state_running;
-    list_remove_node(ready_queue, best);
+    if(best){
+        next = best->value;
+        next->priority = next->initial_priority;
+        next->time_slice_count = 0;
+        list_remove_node(cpu->ready_queue, best);
+    }
+    next->state = state_running;
+    next->cpu = cpu->index;
+    cpu->current = next;
+
+    if(is_alive && next == prev){
+        // Nothing else deserves the CPU, so just keep running.
+        return;
+    }
+    TRACE(TRACE_SWITCH, is_alive ? prev->id : 0, next->id, is_alive);
+
+    // Idle residency is just the time each CPU spends in its idle task.
+    uint64_t now = clock_monotonic_ns();
+    if(prev == cpu->idle){
+        cpu->idle_ns += now - cpu->idle_since;
+    }
+    if(next == cpu->idle){
+        cpu->idle_since = now;
+    }
+    // With nothing left to time slice, the tick would only wake the CPU up for nothing. And when there is
+    // something again, it needs the tick back.
+    if(prev == cpu->idle || next == cpu->idle){
+        sched_program_tick();
+    }
 
     // Set other variables so thing don't explode.
-    current_directory = current_process->page_directory;
-    set_kernel_stack(current_process->kernel_stack + KERNEL_STACK_SIZE);
-
-    eip = current_process->eip;
-    esp = current_process->esp;
-    ebp = current_process->ebp;
-
-    // For new tasks, we have to JMP to the fork syscall to let them return gracefully at the same location.
-    // otherwise, we can just return (eliminating the crazy code from the tutorial)
-    if(prev_state == state_new){
-        asm volatile("mov %0, %%ecx" : : "r"(eip));
-        asm volatile("mov %0, %%esp" : : "r"(esp));
-        asm volatile("mov %0, %%ebp" : : "r"(ebp));
-        asm volatile("mov %0, %%cr3" : : "r"(current_process->page_directory->physicalAddr));
-        asm volatile("jmp *%ecx");
-    } else {
-        asm volatile("mov %0, %%esp" : : "r"(esp));
-        asm volatile("mov %0, %%ebp" : : "r"(ebp));
-        asm volatile("mov %0, %%cr3" : : "r"(current_process->page_directory->physicalAddr));
+    cpu->directory = next->page_directory;
+    set_kernel_stack(next->kernel_stack + KERNEL_STACK_SIZE);
+    asm volatile("mov %0, %%cr3" : : "r"(next->page_directory->physicalAddr) : "memory");
+
+    // A dead task has already had its task_t freed, so its stack pointer goes nowhere in particular.
+    // Either way, we only come back here once prev is picked by the scheduler again.
+    switch_to(is_alive ? &prev->esp : &dead_task_esp, next->esp);
+}
+
+void run_scheduler(int add_to_ready, int is_alive)
+{
+    // System calls run with interrupts enabled, but the interrupt handlers use the per-CPU state and timers the
+    // scheduler changes. The task switched to has its own saved flags, so they're put back when it resumes here.
+    uint32_t flags = irq_save();
+    schedule(add_to_ready, is_alive);
+    irq_restore(flags);
+}
+
+void preempt_disable()
+{
+    current_process->preempt_count++;
+}
+
+void preempt_enable()
+{
+    ASSERT(current_process->preempt_count > 0);
+    if(--current_process->preempt_count == 0){
+        preempt_point();
     }
+}
 
+void preempt_point()
+{
+    cpu_t *cpu = this_cpu();
+    // Only a system call can be preempted, not an interrupt handler or softirq (with interrupts off or in_softirq).
+    uint32_t eflags;
+    asm volatile("pushf; pop %0" : "=r" (eflags));
+    if(!(eflags & EFLAGS_IF) || cpu->in_softirq || !cpu->current || cpu->current->preempt_count){
+        return;
+    }
+    if(!cpu->softirq_pending && !cpu->need_resched){
+        return;
+    }
+    uint32_t flags = irq_save();
+    irq_exit(cpu->current->regs);
+    irq_restore(flags);
 }
 
 void move_stack(void *new_start_stack, uint32_t size)
@@ -256,75 +510,12 @@ void move_stack(void *new_start_stack, uint32_t size)
     // flush the TLB
     uint32_t pagedir_addr;
     asm volatile("mov %%cr3, %0" : "=r" (pagedir_addr));
-    asm volatile("mov %0, %%cr3" : : "r" (pagedir_addr));
-
-    // ESP/EBP need fixed too.
-    // Aside: ESP tends to be the top of the stack
-    // EBP by convention is assigned ESP when calling a function (preserved across calls)
-    // initial_esp in the very bottom of the stack (from main.c)
-    uint32_t old_esp;
-    uint32_t old_ebp;
-    asm volatile("mov %%esp, %0" : "=r" (old_esp));
-    asm volatile("mov %%ebp, %0" : "=r" (old_ebp));
-    // (The stack is definitely moving forward. The question is by how much.)
-    uint32_t offset = (uint32_t)new_start_stack - initial_esp;
-    uint32_t new_esp = old_esp + offset;
-    uint32_t new_ebp = old_ebp + offset;
-
-    memcpy((void*)new_esp, (uint8_t*)old_esp, initial_esp - old_esp/*Just copy the bytes in use*/);
-
-    // Traverse for EBP values and update them.
-    uint32_t ebp;
-    asm volatile("mov %%ebp, %0 " : "=r"(ebp));
-    do {
-        uint32_t *ebp_ptr = (uint32_t *)(ebp );
-        uint32_t new_ptr = (uint32_t)ebp_ptr + offset;
-        uint32_t *as_ptr = (uint32_t *)new_ptr;
-        *as_ptr = (*ebp_ptr + offset);
-        ebp = *ebp_ptr;
-    } while(between((uint32_t)old_esp, ebp, initial_esp));
-
-    // Changing these finalizes our move to the new stack.
-    asm volatile("mov %0, %%esp" : : "r"(new_esp));
-    asm volatile("mov %0, %%ebp" : : "r"(new_ebp));
-}
-
-/// Similar to move_stack except this function copies the contents of the stack to another location,
-/// leaving the current one alone. Necessary to get the fork() function to work properly because the
-/// kernel stacks for the interupts are in the same memory space
-/// This isn't fully safe (if a word on the stack happens to fall inside the two page boundary, things will
-/// get interesting) but since this isn't used much, I'm OK with that.
-/// \param [in] dest the address of the child stack's memory block. Note that the address is weird here.
-/// Stacks ordinarily grow downwards, so this isn't actual stack start. Rather (uint32_t)dest + size === stack start.
-/// \param [in] src the address of the parent stack's memory block. Note that the address is weird here.
-/// Stacks ordinarily grow downwards, so this isn't actual stack start. Rather (uint32_t)dest + size === stack start.
-/// \param [in] size the number of bytes to copy.
-void copy_stack(void *dest, void *src, uint32_t size)
-{
-    // Copy memory
-    memcpy(dest, src, size);
-    // Fix any registered pointers (eg registers_t *)
-    struct linked_list_node *node = current_process->pointers->front;
-    while (node) {
-        pointer_info_t *ptr = node->value;
-        uint32_t ptr_loc = ptr->pointer_memory_loc - (uint32_t) src + (uint32_t) dest;
-        uint32_t *word = (uint32_t *) (ptr_loc);
-        uint32_t word_offset_from_base = *word - (uint32_t) src;
-        *word = word_offset_from_base + (uint32_t) dest;
-        node = node->next;
-    }
-
-    // Traverse for EBP values and update them.
-    uint32_t ebp;
-    asm volatile("mov %%ebp, %0 " : "=r"(ebp));
-    do {
-        uint32_t *ebp_ptr = (uint32_t *)(ebp );
-        uint32_t new_ptr = (uint32_t)ebp_ptr - (uint32_t)src + (uint32_t)dest;
-        uint32_t *as_ptr = (uint32_t *)new_ptr;
-        *as_ptr = (*ebp_ptr - (uint32_t)src + (uint32_t)dest);
-        ebp = *ebp_ptr;
-    } while(between((uint32_t)src, ebp, (uint32_t)src + size));
+    asm volatile("mov %0, %%cr3" : : "r" (pagedir_addr) : "memory");
 
+    // initial_esp is the very bottom of the stack (from main.c). Like JamesM's version, this relocates any word on
+    // the stack that looks like a pointer into it, rather than following the chain of saved EBPs: in an optimised
+    // build, frames don't have to have one.
+    relocate_stack(initial_esp, (uint32_t)new_start_stack);
 }
 
 int cmp_job_pid(void *a, void *b)
@@ -384,38 +575,40 @@ void restore_joined_processes(void *data)
     task_t *task = get_task_by_pid(pid);
     ASSERT(task);
 
-    task->state = state_ready;
-    list_add_back(ready_queue, task);
-
+    sched_enqueue(task);
 }
 
-void free_current_process_kernel_structs()
+/// Runs on kernel_cleanup_stack, since both the kernel stack and the page directory of the exiting
+/// process are freed here. Never returns.
+static void reap_current_process()
 {
-    // --- Start of black magic 
-    // We have to free the stack we're currently executing on and
-    // the page_directory_t that is currently loaded in cr3.
-    // We'll have to use another block of memory for the stack until we
-    // run the scheduler and swap to a running process.
-
-    // Further, we have to free the page directory by swapping to another
-    // first. Let's just use the one for the kernel since we're executing on
-    // a block of memory in its stack anyway.
-
-    // Change stacks. We don't need anything that is on our current stack.
-    // That makes this quite easy because we can just trash the contents
-    // Also: give the stack frame non-zero size just for the fun of it.
-    uint32_t new_esp = kernel_cleanup_stack + KERNEL_STACK_SIZE - 64;
-    uint32_t new_ebp = kernel_cleanup_stack + KERNEL_STACK_SIZE - 4;
-
-    asm volatile("mov %0, %%esp" : : "r"(new_esp));
-    asm volatile("mov %0, %%ebp" : : "r"(new_ebp));
+    page_directory_t *dir = current_process->page_directory;
 
-    kfree(current_process->heap->index);
-    kfree(current_process->heap);
+    // A thread's user stack lives in the shared heap, so it has to go while that's still mapped.
+    if(current_process->user_stack){
+        heap_free(current_process->heap, (void*)current_process->user_stack);
+    }
 
-    // Switch to the kernel_directory since the current one is about to get trashed.
+    // Switch to the kernel_directory since the current one may be about to get trashed.
     switch_page_directory(kernel_directory);
-    destroy_directory(current_process->page_directory);
+
+    // Other threads could still be running in this address space. Only the last one out frees it.
+    ASSERT(dir->refcount > 0);
+    if(--dir->refcount != 0){
+        // Remembered so that the others can still join it, see thread_join_impl().
+        if(!dir->exited_threads){
+            dir->exited_threads = list_init();
+        }
+        list_add_back(dir->exited_threads, (void*)current_process->id);
+    } else {
+        if(dir->exited_threads){
+            list_destroy(dir->exited_threads);
+        }
+        screen_release_directory(dir);
+        kfree(current_process->heap->index);
+        kfree(current_process->heap);
+        destroy_directory(dir);
+    }
     list_foreach(current_process->semaphores, reduce_sem_refcounts);
     list_destroy(current_process->semaphores);
     list_foreach(current_process->pipes, reduce_pipe_refcounts);
@@ -426,8 +619,7 @@ void free_current_process_kernel_structs()
 
     // Destroy the kernel stack
     kfree((void*)current_process->kernel_stack);
-
-    kfree(current_process->pointers);
+    kfree(current_process->syscall_stats);
 
 #ifdef DEBUG_MEMORY
     uint32_t pid = current_process->id;
@@ -437,14 +629,52 @@ void free_current_process_kernel_structs()
     kfree((void*)current_process);
 
 #ifdef DEBUG_MEMORY
-    kprintf("[Exit pid = %d]: %d free frames. %d free heap memory / %d (account for 28 bytes less due to a pointer_info_t allocation being different) \n",
+    klog(KLOG_DEBUG, "[Exit pid = %d]: %d free frames. %d free heap memory / %d \n",
             pid, get_number_free_frames(), heap_remaining_space(kernel_heap), (kernel_heap->end_address - kernel_heap->start_address));
 //    kprintf("=> %d \n", list_size(ready_queue));
 #endif
 
-
     // Finally, select the next process to run.
-    run_scheduler(FALSE, FALSE, FALSE);
+    run_scheduler(FALSE, FALSE);
+
+    PANIC("Scheduler returned to a dead process");
+}
+
+/// Gives child a reference to every semaphore and pipe that parent has open.
+static void task_share_handles(task_t *parent, task_t *child)
+{
+    list_enumerator_t enumerator = list_get_enumerator(parent->semaphores);
+    while(list_has_next(&enumerator)){
+        void *id = list_next_value(&enumerator);
+        sem_t *sem = get_semaphore_by_id((uint32_t)id);
+        if(!sem){
+            continue; // sem is dead already.
+        }
+        sem->refcount++;
+        list_add_back(child->semaphores, id);
+    }
+
+    enumerator = list_get_enumerator(parent->pipes);
+    while(list_has_next(&enumerator)){
+        void *id = list_next_value(&enumerator);
+        pipe_t *pipe = get_pipe_by_id((uint32_t)id);
+        if(!pipe){
+            continue;
+        }
+        pipe->refcount++;
+        list_add_back(child->pipes, id);
+    }
+}
+
+void free_current_process_kernel_structs()
+{
+    // We have to free the stack we're currently executing on and
+    // the page_directory_t that is currently loaded in cr3.
+    // We'll have to use another block of memory for the stack until we
+    // run the scheduler and swap to a running process.
+    //
+    // Nothing on the current stack is needed anymore, so we never come back here.
+    call_on_stack(kernel_cleanup_stack + KERNEL_STACK_SIZE, reap_current_process);
 }
 
 int fork_impl()
@@ -455,84 +685,185 @@ int fork_impl()
     // -- a parent
 
 #ifdef DEBUG_MEMORY
-    kprintf("[Fork pid = %d]: %d free frames. %d free heap memory / %d \n", current_process->id,
+    klog(KLOG_DEBUG, "[Fork pid = %d]: %d free frames. %d free heap memory / %d \n", current_process->id,
             get_number_free_frames(), heap_remaining_space(kernel_heap), (kernel_heap->end_address - kernel_heap->start_address));
 //    kprintf("=> %d \n", list_size(ready_queue));
 #endif
 
     task_t *parent = (task_t*)current_process;
+
+    // copy_table() lets other tasks run between pages. If one of them is a thread of this process, it could grow or
+    // shrink the heap in the meantime, and the heap_t copied below would describe memory the child never got. So
+    // while there are threads, the clone and the heap copy happen in one go.
+    int shared = parent->page_directory->refcount > 1;
+    if(shared){
+        preempt_disable();
+    }
     task_t *child = task_init(clone_directory(current_directory));
 
-    list_add_back(ready_queue, child);
-    uint32_t eip = read_eip(); // Child will enter here.
-
-    if(current_process == parent) {
-        // Parent process: Initialize the rest of the child
-        uint32_t esp; asm volatile("mov %%esp, %0" : "=r"(esp));
-        uint32_t ebp; asm volatile("mov %%ebp, %0" : "=r"(ebp));
-        uint32_t offset_ebp = ebp - parent->kernel_stack;
-        uint32_t offset_esp = esp - parent->kernel_stack;
-        ASSERT (offset_ebp < KERNEL_STACK_SIZE && offset_esp < KERNEL_STACK_SIZE );
-        child->esp = child->kernel_stack + offset_esp;
-        child->ebp = child->kernel_stack + offset_ebp;
-        child->eip = eip;
-        copy_stack((void*)child->kernel_stack, (void*)parent->kernel_stack, KERNEL_STACK_SIZE);
-
-        // The behaviour of the copy, with respect to priorities, is kind of left up to us
-        // Thus, I've chosen to copy the priority and initial priorities from the parent
-        // but let the child's time_slice_count start out fresh from 0.
-        if(parent->id != global_parent_id){
-            child->priority = parent->priority;
-            child->initial_priority = parent->initial_priority;
-        } else {
-            child->priority = PRIORITY_NORMAL;
-            child->initial_priority = PRIORITY_NORMAL;
-        }
+    // The child resumes in user mode right after its int 0x80, just like the parent, but sees a return value of 0.
+    // Nothing from the parent's kernel stack is needed, so there's no need to copy it.
+    ASSERT(parent->regs);
+    task_prepare_entry_frame(child, parent->regs);
+    ((registers_t *)(child->kernel_stack + KERNEL_STACK_SIZE - sizeof(registers_t)))->eax = 0;
+
+    // The behaviour of the copy, with respect to priorities, is kind of left up to us
+    // Thus, I've chosen to copy the priority and initial priorities from the parent
+    // but let the child's time_slice_count start out fresh from 0.
+    if(parent->id != global_parent_id){
+        child->priority = parent->priority;
+        child->initial_priority = parent->initial_priority;
+    } else {
+        child->priority = PRIORITY_NORMAL;
+        child->initial_priority = PRIORITY_NORMAL;
+    }
 
-        // Copy the heap
-        heap_t *heap_copy = kmalloc(sizeof(heap_t));
-        heap_copy->start_address = parent->heap->start_address;
-        heap_copy->end_address = parent->heap->end_address;
-        heap_copy->max_address = parent->heap->max_address;
-        heap_copy->readonly = parent->heap->readonly;
-        heap_copy->supervisor = parent->heap->supervisor;
-        heap_copy->index = kmalloc(sizeof(heap_index_t));
-        heap_copy->index->size = parent->heap->index->size;
-        heap_copy->index->comparator = parent->heap->index->comparator;
-        heap_copy->index->max_size = parent->heap->index->max_size;
-        heap_copy->index->max_address = parent->heap->index->max_address;
-        heap_copy->index->owner = heap_copy;
-        heap_copy->directory = child->page_directory;
-        child->heap = heap_copy;
-
-        list_enumerator_t enumerator = list_get_enumerator(parent->semaphores);
-        while(list_has_next(&enumerator)){
-            void *id = list_next_value(&enumerator);
-            sem_t *sem = get_semaphore_by_id((uint32_t)id);
-            if(!sem){
-                continue; // sem is dead already.
-            }
-            sem->refcount++;
-            list_add_back(child->semaphores, id);
-        }
+    // Copy the heap
+    heap_t *heap_copy = kmalloc(sizeof(heap_t));
+    heap_copy->start_address = parent->heap->start_address;
+    heap_copy->end_address = parent->heap->end_address;
+    heap_copy->max_address = parent->heap->max_address;
+    heap_copy->readonly = parent->heap->readonly;
+    heap_copy->supervisor = parent->heap->supervisor;
+    heap_copy->index = kmalloc(sizeof(heap_index_t));
+    heap_copy->index->size = parent->heap->index->size;
+    heap_copy->index->comparator = parent->heap->index->comparator;
+    heap_copy->index->max_size = parent->heap->index->max_size;
+    heap_copy->index->max_address = parent->heap->index->max_address;
+    heap_copy->index->owner = heap_copy;
+    heap_copy->directory = child->page_directory;
+    child->heap = heap_copy;
+    if(shared){
+        preempt_enable();
+    }
 
-        enumerator = list_get_enumerator(parent->pipes);
-        while(list_has_next(&enumerator)){
-            void *id = list_next_value(&enumerator);
-            pipe_t *pipe = get_pipe_by_id((uint32_t)id);
-            if(!pipe){
-                continue;
-            }
-            pipe->refcount++;
-            list_add_back(child->pipes, id);
-        }
+    task_share_handles(parent, child);
 
+    // Start the child wherever there's the least going on. This is what spreads forked workers over the CPUs.
+    child->cpu = least_loaded_cpu()->index;
+    sched_enqueue(child);
 
-        return child->id;
-    } else {
-        // Child process: just exit.
+    return child->id;
+}
+
+/// Lays out a user stack as if start(entry, arg) had just been called. start must never return.
+/// The stack has to be mapped in the current address space.
+/// \returns the user stack pointer start should begin with
+static uint32_t push_start_frame(uint32_t stack_top, void *entry, void *arg)
+{
+    uint32_t *stack = (uint32_t *)stack_top;
+    *--stack = (uint32_t)arg;
+    *--stack = (uint32_t)entry;
+    *--stack = 0; // Fake return address
+    return (uint32_t)stack;
+}
+
+/// Prepares a new task to enter user mode at start, on the user stack esp. Segments and flags are taken from
+/// the user registers of the task that asked for it. Everything else starts out clear.
+static void task_prepare_user_call(task_t *task, registers_t *template, void *start, uint32_t esp)
+{
+    registers_t regs = *template;
+    regs.eax = regs.ebx = regs.ecx = regs.edx = regs.esi = regs.edi = regs.ebp = 0;
+    regs.eip = (uint32_t)start;
+    regs.useresp = esp;
+    task_prepare_entry_frame(task, &regs);
+}
+
+int thread_create_impl(void *start, void *entry, void *arg, uint32_t stack_size)
+{
+    task_t *parent = (task_t*)current_process;
+    ASSERT(parent->regs);
+
+    if(stack_size == 0){
+        stack_size = THREAD_STACK_SIZE;
+    }
+    // Checked before rounding up, which would otherwise wrap a size near 4 GB around to 0.
+    if(stack_size > THREAD_STACK_MAX){
+        return -1;
+    }
+    if(stack_size % PAGE_SIZE != 0){
+        stack_size = ((stack_size / PAGE_SIZE) * PAGE_SIZE) + PAGE_SIZE;
+    }
+
+    // A thread is a task that shares everything but its stacks with the parent.
+    task_t *thread = task_init(parent->page_directory);
+    parent->page_directory->refcount++;
+    thread->heap = parent->heap;
+    thread->priority = parent->priority;
+    thread->initial_priority = parent->initial_priority;
+    thread->user_stack = (uint32_t)heap_alloc(parent->heap, stack_size, TRUE);
+
+    // We're still in the shared address space, so the new stack can be filled in directly.
+    uint32_t esp = push_start_frame(thread->user_stack + stack_size, entry, arg);
+    task_prepare_user_call(thread, parent->regs, start, esp);
+
+    task_share_handles(parent, thread);
+
+    thread->cpu = least_loaded_cpu()->index;
+    sched_enqueue(thread);
+
+    return thread->id;
+}
+
+int spawn_impl(void *start, void *entry, void *arg, int priority)
+{
+    if(priority < PRIORITY_MAX || priority > PRIORITY_MIN){
         return 0;
     }
+
+    task_t *parent = (task_t*)current_process;
+    ASSERT(parent->regs);
+
+    // Only the kernel's tables are linked in. Unlike fork_impl(), nothing of the parent's gets copied.
+    task_t *child = task_init(clone_directory(kernel_directory));
+    child->priority = (uint32_t)priority;
+    child->initial_priority = child->priority;
+
+    // The new stack and heap have to be written to, so build them from inside the new address space. Switching
+    // tasks in the middle of this would load the parent's directory again.
+    preempt_disable();
+    page_directory_t *dir = current_directory;
+    switch_page_directory(child->page_directory);
+    for(uint32_t i = KSTACK_START - KSTACK_SIZE; i < KSTACK_START; i += PAGE_SIZE){
+        alloc_frame(get_page(i, 1, current_directory), FALSE, TRUE);
+    }
+    task_create_heap(child, UHEAP_START, UHEAP_START + UHEAP_INITIAL_SIZE, UHEAP_MAX, FALSE, FALSE);
+    child->heap->directory = child->page_directory;
+    task_create_stdout();
+    uint32_t esp = push_start_frame(KSTACK_START, entry, arg);
+    switch_page_directory(dir);
+    preempt_enable();
+
+    task_prepare_user_call(child, parent->regs, start, esp);
+
+    // Semaphore and pipe IDs are the only way to talk to the child, so it gets the same ones as the parent.
+    task_share_handles(parent, child);
+
+    child->cpu = least_loaded_cpu()->index;
+    sched_enqueue(child);
+
+    return child->id;
+}
+
+int thread_join_impl(int tid)
+{
+    page_directory_t *dir = current_process->page_directory;
+    task_t *thread = get_task_by_pid(tid);
+    if(!thread){
+        // Gone already, which is fine as long as it was one of ours.
+        return dir->exited_threads && list_remove(dir->exited_threads, (void*)tid, comparator_int) == 0 ? 0 : -1;
+    }
+
+    // Only threads of the same process can be joined this way.
+    if(thread == current_process || thread->page_directory != dir){
+        return -1;
+    }
+
+    list_add_back(thread->waiting_processes, (void*)current_process->id);
+    run_scheduler(FALSE, TRUE);
+    // It left its ID behind on the way out, which this join has used up.
+    list_remove(dir->exited_threads, (void*)tid, comparator_int);
+    return 0;
 }
 
 int getpid_impl()
@@ -542,7 +873,7 @@ int getpid_impl()
 
 void yield_impl()
 {
-    run_scheduler(TRUE, TRUE, FALSE);
+    run_scheduler(TRUE, TRUE);
 }
 
 void exit_impl()
@@ -553,6 +884,8 @@ void exit_impl()
     // plus remove from all relevant queues
     // resource handles eg pipes and semaphores (if their refcount == 0)
     current_process->state = state_terminating;
+    // There's no going back to this task part way through freeing it.
+    preempt_disable();
     remove_process_from_queues((task_t *) current_process);
 
     // ~~~~ IMPORTANT ~~~~
@@ -575,15 +908,72 @@ void free_impl(void *p)
     heap_free(current_process->heap, p);
 }
 
-int sleep_impl(unsigned int secs)
+/// Blocks the current task until the monotonic clock reaches deadline (in nanoseconds).
+static void sleep_until_ns(uint64_t deadline)
 {
-    current_process->sleep_ticks = TICKS_PER_SECOND * secs;
-    list_add_back(sleeping_jobs, (task_t *)current_process);
+    if(deadline <= clock_monotonic_ns()){
+        return;
+    }
+    current_process->wake_time = deadline;
+
+    // Keep sleeping_jobs sorted by wake time, so the timer only ever has to look at the front.
+    struct linked_list_node *node = sleeping_jobs->front;
+    while(node && ((task_t *)node->value)->wake_time <= deadline){
+        node = node->next;
+    }
+    list_insert_before(sleeping_jobs, node, (task_t *)current_process);
+
+    run_scheduler(FALSE, TRUE);
+}
 
-    run_scheduler(FALSE, TRUE, FALSE);
+int sleep_impl(unsigned int secs)
+{
+    sleep_until_ns(clock_monotonic_ns() + (uint64_t)secs * NS_PER_SECOND);
 
     // Not that we can really be interupted but...
-    return current_process->sleep_ticks == 0 ? 0 : (current_process->sleep_ticks / TICKS_PER_SECOND + 1);
+    return 0;
+}
+
+int msleep_impl(uint32_t ms)
+{
+    sleep_until_ns(clock_monotonic_ns() + (uint64_t)ms * NS_PER_MS);
+    return 0;
+}
+
+int usleep_impl(uint32_t us)
+{
+    sleep_until_ns(clock_monotonic_ns() + (uint64_t)us * 1000);
+    return 0;
+}
+
+/// \returns milliseconds since boot, without wrapping. udiv64() alone would fault once that took over 32 bits, after
+/// about 49.7 days, so this divides the high half first.
+static uint64_t monotonic_ms64()
+{
+    uint64_t ns = clock_monotonic_ns();
+    uint32_t high = (uint32_t)(ns >> 32);
+    uint32_t low = udiv64(((uint64_t)(high % NS_PER_MS) << 32) | (uint32_t)ns, NS_PER_MS);
+    return ((uint64_t)(high / NS_PER_MS) << 32) | low;
+}
+
+int sleep_until_impl(uint32_t deadline_ms)
+{
+    // The deadline is absolute, so a periodic task that adds its period to the last deadline never drifts, no
+    // matter how late it was woken up. It wraps along with monotonic_ms_impl(), so it's taken to be within 2^31 ms
+    // (about 24 days) of now, one way or the other.
+    uint64_t now = monotonic_ms64();
+    int32_t delta = (int32_t)(deadline_ms - (uint32_t)now);
+    if(delta <= 0){
+        // Already past. Working it out in 64 bits could go below 0, which would wrap to forever.
+        return 0;
+    }
+    sleep_until_ns((now + (uint32_t)delta) * NS_PER_MS);
+    return 0;
+}
+
+uint32_t monotonic_ms_impl()
+{
+    return (uint32_t)monotonic_ms64();
 }
 
 int set_priority_impl(int pid, int new_priority)
@@ -621,7 +1011,7 @@ int join_impl(int pid)
     }
 
     list_add_back(proc->waiting_processes, (void*)current_process->id);
-    run_scheduler(FALSE, TRUE, FALSE);
+    run_scheduler(FALSE, TRUE);
     return 0;
 }
 
@@ -21,29 +21,35 @@ typedef struct task
     uint32_t initial_priority;
     uint32_t time_slice_count;
     uint32_t priority;
-    uint32_t sleep_ticks;
+    uint64_t wake_time;      // Monotonic clock time (ns) a sleeping task is woken up at.
     uint32_t id;                // Process ID.
-    uint32_t esp, ebp;       // Stack and base pointers.
-    uint32_t eip;            // Instruction pointer.
+    uint32_t esp;            // Kernel stack pointer saved by switch_to() while the task isn't running.
     page_directory_t *page_directory; // Page directory.
     uint32_t kernel_stack; //bp
+    registers_t *regs;       // User registers pushed on entry to the syscall currently being serviced.
+    uint32_t cpu;            // Index of the CPU whose ready queue this task goes in.
     heap_t *heap;
+    uint32_t user_stack;     // Heap block used as the user stack of a thread, or 0 for the first task of a process.
+    uint32_t preempt_count;  // preempt_point() does nothing while this is above 0. See preempt_disable().
+    struct syscall_stat *syscall_stats; // One per system call. NULL unless enabled, see syscall.h.
     enum task_state state;
-    list_t *pointers;
     list_t *waiting_processes;
     list_t *semaphores;
     list_t *pipes;
 } task_t;
 
-typedef struct
-{
-    uint32_t pointer_memory_loc;
-    uint32_t pointer_target;
-} pointer_info_t;
+/// Saves the callee-saved registers of the running task on its kernel stack, stores the resulting stack pointer
+/// in *prev_esp and resumes whatever task owns next_esp. (Defined in switch.s)
+/// \param [out] prev_esp where to keep the stack pointer of the task being switched away from
+/// \param [in] next_esp a stack pointer previously saved by switch_to(), or prepared by task_prepare_entry_frame()
+extern void switch_to(uint32_t *prev_esp, uint32_t next_esp);
 
-void register_stack_pointer(uint32_t loc, uint32_t target);
-void clear_stack_pointers();
+/// Points ESP at stack_top and calls fn, which must never return. (Defined in switch.s)
+extern void call_on_stack(uint32_t stack_top, void (*fn)());
 
+/// Moves the stack in use, from ESP up to old_top, to end at new_top instead, relocating anything on it that points
+/// into it. Returns on the new stack. (Defined in switch.s)
+extern void relocate_stack(uint32_t old_top, uint32_t new_top);
 
 void switch_to_user_mode();
 
@@ -55,9 +61,41 @@ void move_stack(void *new_start_stack, uint32_t size);
 /// queue next.
 /// Partially based on JamesM's code from tutorial #9, but modified to work with
 /// our requirements.
-void run_scheduler(int add_to_ready, int is_alive, int is_timer_based);
+void run_scheduler(int add_to_ready, int is_alive);
 void initialise_scheduler();
 
+/// Stops preempt_point() from switching away from the current task, until the matching preempt_enable(). Use this
+/// around kernel work that leaves something inconsistent (eg. a temporarily switched page directory) and calls
+/// code that may contain a preempt_point(). These nest.
+void preempt_disable();
+void preempt_enable();
+
+/// A place in a long system call where it is safe to run softirqs and switch to another task, if any interrupt
+/// since the call started asked for that. System calls are only ever preempted here, and on their way out.
+void preempt_point();
+
+/// Marks a task as ready and puts it in the ready queue of the CPU it last ran on (task->cpu).
+void sched_enqueue(task_t *task);
+
+/// Moves every sleeping task whose wake time is at or before now (in nanoseconds) to a ready queue.
+void sched_wake_sleepers(uint64_t now);
+
+/// Picks how the timer should run on this CPU: the periodic tick while it's running a task, nothing while it's
+/// idle but other CPUs aren't, and a one-shot interrupt for when the first sleeper is due once every CPU is idle.
+void sched_program_tick();
+
+/// Creates the idle task for a CPU. It has no PID and is never in task_list or a ready queue.
+task_t *task_create_idle(uint32_t cpu);
+
+/// Body of every idle task: halts until the next interrupt, forever.
+void idle_loop();
+
+/// Prints the share of time each CPU has spent in its idle task since it came online.
+void idle_report_impl();
+
+/// Called on the first switch_to() into a new task, to release the kernel lock the scheduler held.
+void finish_task_switch();
+
 int fork_impl();
 int getpid_impl();
 void yield_impl();
@@ -65,8 +103,15 @@ void exit_impl();
 void *alloc_impl(uint32_t size, uint8_t page_align);
 void free_impl(void *p);
 int sleep_impl(unsigned int secs);
+int msleep_impl(uint32_t ms);
+int usleep_impl(uint32_t us);
+int sleep_until_impl(uint32_t deadline_ms);
+uint32_t monotonic_ms_impl();
 int set_priority_impl(int pid, int new_priority);
 int join_impl(int pid);
+int thread_create_impl(void *start, void *entry, void *arg, uint32_t stack_size);
+int thread_join_impl(int tid);
+int spawn_impl(void *start, void *entry, void *arg, int priority);
 
 task_t *get_task_by_pid(int pid);
 
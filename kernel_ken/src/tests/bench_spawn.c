@@ -0,0 +1,72 @@
+#include "app.h"
+#include "kernel_ken.h"
+#include "ulib.h"
+#include "syscall.h"
+
+// Process creation microbenchmark. Starts 1, 10 and then 100 workers with fork() and with spawn(), and times how
+// long it takes until every worker has been started and has exited. The workers don't touch anything of the
+// parent's, which is the case spawn() is meant for. The output looks something like:
+//
+// fork:  1 workers took 1234 us (1234 us per worker)
+// spawn: 1 workers took 234 us (234 us per worker)
+//
+// Times are measured on the kernel's monotonic clock.
+
+#define MAX_WORKERS 100
+
+static volatile uint32_t sink;
+
+static void worker(void *arg)
+{
+    uint32_t sum = 0;
+    for(uint32_t i = 0; i < (uint32_t)arg; i++){
+        sum += i;
+    }
+    sink = sum;
+}
+
+/// \returns how long it took to start and finish n workers, in microseconds
+static uint32_t bench_fork(int n, int *pids)
+{
+    uint64_t start = monotonic_ns();
+    for(int i = 0; i < n; i++){
+        pids[i] = fork();
+        if(pids[i] == 0){
+            worker((void*)1000);
+            exit();
+        }
+    }
+    for(int i = 0; i < n; i++){
+        syscall_join_impl(pids[i]);
+    }
+    return udiv64(monotonic_ns() - start, 1000);
+}
+
+/// \returns how long it took to start and finish n workers, in microseconds
+static uint32_t bench_spawn(int n, int *pids)
+{
+    uint64_t start = monotonic_ns();
+    for(int i = 0; i < n; i++){
+        pids[i] = spawn(worker, (void*)1000, PRIORITY_NORMAL);
+    }
+    for(int i = 0; i < n; i++){
+        syscall_join_impl(pids[i]);
+    }
+    return udiv64(monotonic_ns() - start, 1000);
+}
+
+void my_app()
+{
+    static const int counts[] = {1, 10, MAX_WORKERS};
+    int *pids = alloc(sizeof(int) * MAX_WORKERS, FALSE);
+
+    for(int i = 0; i < 3; i++){
+        int n = counts[i];
+        uint32_t elapsed = bench_fork(n, pids);
+        printf("fork:  %u workers took %u us (%u us per worker) \n", n, elapsed, elapsed / n);
+        elapsed = bench_spawn(n, pids);
+        printf("spawn: %u workers took %u us (%u us per worker) \n", n, elapsed, elapsed / n);
+    }
+
+    free(pids);
+}
@@ -0,0 +1,44 @@
+#include "app.h"
+#include "kernel_ken.h"
+#include "ulib.h"
+
+// stdout buffering microbenchmark. Prints the same lines, built from several print()/print_dec() calls each the way
+// dining_philosophers.c does, in each buffering mode and times them. Unbuffered output traps once per call, line
+// buffered output once per line, and fully buffered output once per page or so. The summary looks like:
+//
+// unbuffered:     200 lines took 12345 us
+// line buffered:  200 lines took 2345 us
+// fully buffered: 200 lines took 1234 us
+//
+// Times are measured on the kernel's monotonic clock.
+
+#define LINES 200
+
+/// \returns how long printing LINES lines took in the given mode, in microseconds
+static uint32_t bench_mode(uint32_t mode)
+{
+    stdout_set_mode(mode);
+    uint64_t start = monotonic_ns();
+    for(uint32_t i = 0; i < LINES; i++){
+        print("Philosopher ");
+        print_dec(i % 5);
+        print(" is eating with fork ");
+        print_dec(i % 5);
+        print(" \n");
+    }
+    stdout_flush();
+    uint32_t elapsed = udiv64(monotonic_ns() - start, 1000);
+    stdout_set_mode(STDOUT_LINE_BUFFERED);
+    return elapsed;
+}
+
+void my_app()
+{
+    uint32_t unbuffered = bench_mode(STDOUT_UNBUFFERED);
+    uint32_t line = bench_mode(STDOUT_LINE_BUFFERED);
+    uint32_t full = bench_mode(STDOUT_FULLY_BUFFERED);
+
+    printf("unbuffered:     %u lines took %u us \n", LINES, unbuffered);
+    printf("line buffered:  %u lines took %u us \n", LINES, line);
+    printf("fully buffered: %u lines took %u us \n", LINES, full);
+}
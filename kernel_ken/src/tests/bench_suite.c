@@ -0,0 +1,265 @@
+#include "app.h"
+#include "kernel_ken.h"
+#include "ulib.h"
+#include "syscall.h"
+
+// The microbenchmark suite that "make bench" builds. Each benchmark is timed with rdtsc and on the kernel's monotonic
+// clock, and prints one JSON line, which also goes out on the serial port:
+//
+// {"bench":"syscall","param":0,"ops":100000,"cycles":41152000,"ns":20576000,"cycles_per_op":411,"ns_per_op":205}
+//
+// param is the benchmark's size parameter (the pipe record size, the largest allocation), or 0 if it hasn't got one.
+// Once everything has run, QEMU is switched off through its isa-debug-exit device. bench_qemu.sh at the root boots
+// this headless and keeps the JSON lines.
+//
+// Processes made by fork() can land on another CPU, so the process benchmarks include cross-CPU wakeups.
+
+#define SYSCALL_OPS         100000
+#define ROUND_TRIPS         5000
+#define FORK_OPS            100
+#define PIPE_BYTES          (256 * 1024)
+#define ALLOC_OPS           20000
+#define ALLOC_SLOTS         64
+
+typedef struct
+{
+    uint64_t tsc;
+    uint64_t ns;
+} bench_time_t;
+
+static bench_time_t bench_now()
+{
+    bench_time_t now;
+    now.ns = monotonic_ns();
+    now.tsc = read_tsc();
+    return now;
+}
+
+static void report(const char *name, uint32_t param, uint32_t ops, uint64_t cycles, uint64_t ns)
+{
+    printf("{\"bench\":\"%s\",\"param\":%u,\"ops\":%u,\"cycles\":%llu,\"ns\":%llu,\"cycles_per_op\":%u,\"ns_per_op\":%u}\n",
+           name, param, ops, cycles, ns, udiv64(cycles, ops), udiv64(ns, ops));
+}
+
+/// Reports ops operations that took from start until now.
+static void report_since(const char *name, uint32_t param, uint32_t ops, bench_time_t start)
+{
+    uint64_t tsc = read_tsc();
+    uint64_t ns = monotonic_ns();
+    report(name, param, ops, tsc - start.tsc, ns - start.ns);
+}
+
+/// The cheapest system call there is, so this is the cost of the trap and the dispatcher.
+static void bench_syscall()
+{
+    bench_time_t start = bench_now();
+    for(int i = 0; i < SYSCALL_OPS; i++){
+        getpid();
+    }
+    report_since("syscall", 0, SYSCALL_OPS, start);
+}
+
+/// Two processes bounce control back and forth through a pair of semaphores, so each round trip is two switches
+/// between address spaces.
+static void bench_context_switch()
+{
+    int ping = open_sem(0);
+    int pong = open_sem(0);
+
+    int pid = fork();
+    if(pid == 0){
+        for(int i = 0; i < ROUND_TRIPS; i++){
+            wait(ping);
+            signal(pong);
+        }
+        exit();
+    }
+
+    // Let the child block on ping first, so the first round trip isn't any different from the rest.
+    yield();
+
+    bench_time_t start = bench_now();
+    for(int i = 0; i < ROUND_TRIPS; i++){
+        signal(ping);
+        wait(pong);
+    }
+    report_since("context_switch", 0, 2 * ROUND_TRIPS, start);
+
+    syscall_join_impl(pid);
+    close_sem(ping);
+    close_sem(pong);
+}
+
+typedef struct
+{
+    int ping;
+    int pong;
+} sem_pair_t;
+
+static void pingpong_worker(void *arg)
+{
+    sem_pair_t *sems = arg;
+    for(int i = 0; i < ROUND_TRIPS; i++){
+        wait(sems->ping);
+        signal(sems->pong);
+    }
+}
+
+/// The same ping-pong between two threads of one process, so there's no page directory switch. One op is a round
+/// trip.
+static void bench_sem_pingpong()
+{
+    sem_pair_t sems;
+    sems.ping = open_sem(0);
+    sems.pong = open_sem(0);
+
+    int tid = thread_create(pingpong_worker, &sems, 0);
+    yield();
+
+    bench_time_t start = bench_now();
+    for(int i = 0; i < ROUND_TRIPS; i++){
+        signal(sems.ping);
+        wait(sems.pong);
+    }
+    report_since("sem_pingpong", 0, ROUND_TRIPS, start);
+
+    thread_join(tid);
+    close_sem(sems.ping);
+    close_sem(sems.pong);
+}
+
+/// A child that exits straight away, from fork() until join() returns in the parent.
+static void bench_fork_exit()
+{
+    bench_time_t start = bench_now();
+    for(int i = 0; i < FORK_OPS; i++){
+        int pid = fork();
+        if(pid == 0){
+            exit();
+        }
+        syscall_join_impl(pid);
+    }
+    report_since("fork_exit", 0, FORK_OPS, start);
+}
+
+/// From telling a waiting child to exit until join() returns, so this is exit() plus waking the joiner up.
+static void bench_join()
+{
+    uint64_t cycles = 0;
+    uint64_t ns = 0;
+    int go = open_sem(0);
+    for(int i = 0; i < FORK_OPS; i++){
+        int pid = fork();
+        if(pid == 0){
+            wait(go);
+            exit();
+        }
+        yield();
+
+        bench_time_t start = bench_now();
+        signal(go);
+        syscall_join_impl(pid);
+        cycles += read_tsc() - start.tsc;
+        ns += monotonic_ns() - start.ns;
+    }
+    close_sem(go);
+    report("join", 0, FORK_OPS, cycles, ns);
+}
+
+/// Sends PIPE_BYTES through a pipe in records of record_size bytes, from a child to the parent. Pipes never block,
+/// so both sides yield whenever the pipe is full or empty. One op is a record.
+static void bench_pipe(uint32_t record_size)
+{
+    int pipe = open_pipe();
+    int go = open_sem(0);
+    uint8_t *buffer = alloc(record_size, FALSE);
+    memset(buffer, 0x5A, record_size);
+    uint32_t records = PIPE_BYTES / record_size;
+
+    int pid = fork();
+    if(pid == 0){
+        wait(go);
+        for(uint32_t i = 0; i < records; i++){
+            while(write(pipe, buffer, record_size) == 0){
+                yield();
+            }
+        }
+        exit();
+    }
+
+    bench_time_t start = bench_now();
+    signal(go);
+    uint32_t received = 0;
+    while(received < PIPE_BYTES){
+        uint32_t got = read(pipe, buffer, record_size);
+        if(got == 0){
+            yield();
+        }
+        received += got;
+    }
+    report_since("pipe", record_size, records, start);
+
+    syscall_join_impl(pid);
+    free(buffer);
+    close_sem(go);
+    close_pipe(pipe);
+}
+
+/// Allocates and frees blocks of 1 to max_size bytes on the user heap, keeping up to ALLOC_SLOTS of them alive, in
+/// the same order as bench_kmalloc_impl() does on the kernel heap.
+static void bench_alloc(uint32_t max_size)
+{
+    void *slots[ALLOC_SLOTS];
+    memset(slots, 0, sizeof(slots));
+
+    uint32_t seed = 1;
+    bench_time_t start = bench_now();
+    for(int i = 0; i < ALLOC_OPS; i++){
+        seed = seed * 214013 + 2531011;
+        uint32_t slot = (seed >> 16) % ALLOC_SLOTS;
+        if(slots[slot]){
+            free(slots[slot]);
+            slots[slot] = NULL;
+        } else {
+            slots[slot] = alloc(1 + (seed >> 8) % max_size, FALSE);
+        }
+    }
+    report_since("alloc_free", max_size, ALLOC_OPS, start);
+
+    for(int i = 0; i < ALLOC_SLOTS; i++){
+        if(slots[i]){
+            free(slots[i]);
+        }
+    }
+}
+
+/// The same churn on the kernel heap. The cycles are counted in the kernel, around the loop only.
+static void bench_kmalloc_churn(uint32_t max_size)
+{
+    uint64_t cycles;
+    bench_time_t start = bench_now();
+    int ret = bench_kmalloc(ALLOC_OPS, max_size, &cycles);
+    assert(ret == 0);
+    report("kmalloc", max_size, ALLOC_OPS, cycles, monotonic_ns() - start.ns);
+}
+
+void my_app()
+{
+    bench_syscall();
+    bench_context_switch();
+    bench_sem_pingpong();
+    bench_fork_exit();
+    bench_join();
+    bench_pipe(16);
+    bench_pipe(256);
+    bench_pipe(4096);
+    bench_pipe(32768);
+    bench_alloc(64);
+    bench_alloc(4096);
+    bench_kmalloc_churn(64);
+    bench_kmalloc_churn(4096);
+
+    if(qemu_exit(0) != 0){
+        printf("Not running in QEMU with isa-debug-exit, so it has to be switched off by hand \n");
+    }
+}
@@ -0,0 +1,35 @@
+#include "app.h"
+#include "kernel_ken.h"
+#include "ulib.h"
+
+// Kernel log check: prints the boot messages from the log, then checks that a cursor only ever returns each message
+// once, and that messages logged with the console quiet still end up in the log.
+
+static char buffer[4096];
+
+void my_app()
+{
+    uint32_t cursor = 0;
+    int n = dmesg(buffer, sizeof(buffer), &cursor);
+    assert(n > 0);
+    print(buffer);
+    while(dmesg(buffer, sizeof(buffer), &cursor) > 0){
+        print(buffer);
+    }
+    assert(dmesg(buffer, sizeof(buffer), &cursor) == 0);
+
+    // irq_report() logs at KLOG_INFO, so with the console level at KLOG_WARN it only goes to the log.
+    int previous = klog_set_console_level(1);
+    assert(previous >= 0);
+    irq_report();
+    assert(klog_set_console_level(previous) == 1);
+    assert(klog_set_console_level(42) == -1);
+
+    n = dmesg(buffer, sizeof(buffer), &cursor);
+    assert(n > 0);
+    printf("Logged while the console was quiet: \n");
+    print(buffer);
+
+    assert(dmesg(NULL, sizeof(buffer), &cursor) == -1);
+    printf("dmesg passed. \n");
+}
@@ -0,0 +1,24 @@
+#include "app.h"
+#include "kernel_ken.h"
+#include "ulib.h"
+
+// Idle residency check. Busy waits for a while, then sleeps, printing the idle report after each. While the app
+// busy waits its CPU should be close to 0% idle, and while it sleeps every CPU should be halted in its idle task
+// rather than spinning.
+
+#define BUSY_ITERATIONS 500000000
+#define SLEEP_SECONDS 5
+
+void my_app()
+{
+    printf("At start up: \n");
+    idle_report();
+
+    for(volatile uint32_t i = 0; i < BUSY_ITERATIONS; i++);
+    printf("After busy waiting: \n");
+    idle_report();
+
+    sleep(SLEEP_SECONDS);
+    printf("After sleeping for %u seconds: \n", SLEEP_SECONDS);
+    idle_report();
+}
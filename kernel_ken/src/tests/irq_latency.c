@@ -0,0 +1,37 @@
+#include "app.h"
+#include "kernel_ken.h"
+#include "ulib.h"
+
+// Interrupt latency check. Keeps the timer softirq busy with several threads sleeping on short, staggered
+// periods (so wake ups and time slices happen on most ticks) while the app busy waits, then prints the worst
+// interrupt handling times seen.
+
+#define SLEEPERS 4
+#define SLEEPER_ROUNDS 500
+#define BUSY_ITERATIONS 200000000
+
+static void sleeper(void *arg)
+{
+    uint32_t period = (uint32_t)arg;
+    uint32_t deadline = monotonic_ms();
+    for(uint32_t i = 0; i < SLEEPER_ROUNDS; i++){
+        deadline += period;
+        sleep_until(deadline);
+    }
+}
+
+void my_app()
+{
+    int tids[SLEEPERS];
+    for(uint32_t i = 0; i < SLEEPERS; i++){
+        tids[i] = thread_create(sleeper, (void *)(i + 1), 0);
+        assert(tids[i] > 0);
+    }
+
+    for(volatile uint32_t i = 0; i < BUSY_ITERATIONS; i++);
+
+    for(uint32_t i = 0; i < SLEEPERS; i++){
+        thread_join(tids[i]);
+    }
+    irq_report();
+}
@@ -18,6 +18,7 @@
 #include "kernel_ken.h"
 #ifdef NON_PORTABLE_COLOURS
 #include "syscall.h"
+#include "ulib.h"
 #endif
 
 #define AIR ' '
@@ -306,6 +307,11 @@ node *link_maze(node *nodes, unsigned long int *seed, node *n)
     return n->parent;
 }
 
+#ifdef NON_PORTABLE_COLOURS
+// The frame being drawn. Only the maze's part of it is ever sent to the screen.
+static uint16_t frame[SCREEN_WIDTH * SCREEN_HEIGHT];
+#endif
+
 void draw(node *nodes, int px, int py)
 {
 #ifndef NON_PORTABLE_COLOURS
@@ -336,7 +342,7 @@ void draw(node *nodes, int px, int py)
                     colour = COLOUR_BLACK;
                 }
             }
-            syscall_monitor_colour(x, y, colour);
+            frame[y * SCREEN_WIDTH + x] = SCREEN_CELL(' ', COLOUR_BLACK, colour);
 #else
             if( y == py && x == px) {
                 buffer[y * 80 + x] = 'P';
@@ -349,6 +355,10 @@ void draw(node *nodes, int px, int py)
 #ifndef NON_PORTABLE_COLOURS
     buffer[80 * 25 - 1] = '\0';
     print(buffer);
+#else
+    // The whole maze in one system call, rather than one per cell.
+    screen_rect_t maze = {0, 0, GRID_WIDTH, GRID_HEIGHT};
+    monitor_blit(frame, &maze);
 #endif
 }
 
@@ -165,17 +165,16 @@ void my_app()
     }
 
     // <end of init>
+#ifdef NON_PORTABLE_COLOURS
+    uint16_t frame[SCREEN_WIDTH * SCREEN_HEIGHT];
+#endif
     int x, y;
     for(y = 0; y < Y_SIZE; y++){
         for(x = 0; x < X_SIZE; x++){
             double perl = octave_perlin(p, rand_double(&seed) * X_SIZE, rand_double(&seed) * Y_SIZE * 3.14159, 0, 10, 0.85);
 
 #ifdef NON_PORTABLE_COLOURS
-            if(perl >= 0.50) {
-                syscall_monitor_colour(x, y, COLOUR_BLACK);
-            } else {
-                syscall_monitor_colour(x, y, COLOUR_WHITE);
-            }
+            frame[y * SCREEN_WIDTH + x] = SCREEN_CELL(' ', COLOUR_BLACK, perl >= 0.50 ? COLOUR_BLACK : COLOUR_WHITE);
 #else
             char c[] = " ";
             if(perl >= 0.50) {
@@ -193,4 +192,10 @@ void my_app()
         }
 #endif
     }
+
+#ifdef NON_PORTABLE_COLOURS
+    // Draw the noise all at once, instead of one system call per cell.
+    screen_rect_t noise = {0, 0, X_SIZE, Y_SIZE};
+    monitor_blit(frame, &noise);
+#endif
 }
\ No newline at end of file
@@ -0,0 +1,79 @@
+#include "app.h"
+#include "kernel_ken.h"
+#include "ulib.h"
+#include "syscall.h"
+
+// Runs a few workloads under the sampling profiler and dumps the folded stacks over serial, then switches QEMU off.
+// profile_qemu.sh at the root builds this with PROFILE=profile (so there are frame pointers to follow), boots it
+// headless and turns the dump into a flat profile and a folded file for flamegraph.pl:
+//
+// PROFILE pid1;[user];my_app;spin_user;mix 812
+// PROFILE pid1;[kernel];isr_common_stub;isr_handler;syscall_handler;getpid_impl 97
+//
+// Each workload runs in its own function, so it's easy to pick out which of them a sample belongs to.
+
+#define PROFILE_HZ          1000
+#define WORKLOAD_MS         2000
+#define SYSCALLS_PER_CHECK  1000
+
+static volatile uint32_t sink;
+
+static uint32_t mix(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7FEB352D;
+    x ^= x >> 15;
+    x *= 0x846CA68B;
+    x ^= x >> 16;
+    return x;
+}
+
+/// Pure user mode work, so nearly all of its samples should be [user] ones.
+static void spin_user(uint32_t ms)
+{
+    uint32_t end = monotonic_ms() + ms;
+    uint32_t x = 1;
+    while((int32_t)(monotonic_ms() - end) < 0){
+        for(int i = 0; i < 10000; i++){
+            x = mix(x + i);
+        }
+    }
+    sink = x;
+}
+
+/// Back to back cheap system calls, so most of the samples land in the kernel's system call path.
+static void spin_syscalls(uint32_t ms)
+{
+    uint32_t end = monotonic_ms() + ms;
+    while((int32_t)(monotonic_ms() - end) < 0){
+        for(int i = 0; i < SYSCALLS_PER_CHECK; i++){
+            getpid();
+        }
+    }
+}
+
+void my_app()
+{
+    if(profile_start(PROFILE_HZ) != 0){
+        printf("profile_start(%u) failed\n", PROFILE_HZ);
+        return;
+    }
+
+    // A second process on whatever CPU it lands on, so the profile has more than one pid in it.
+    int pid = fork();
+    if(pid == 0){
+        spin_user(WORKLOAD_MS);
+        exit();
+    }
+    spin_user(WORKLOAD_MS);
+    spin_syscalls(WORKLOAD_MS);
+    syscall_join_impl(pid);
+
+    profile_stop();
+    uint32_t samples = profile_dump();
+    printf("%u samples\n", samples);
+
+    if(qemu_exit(0) != 0){
+        printf("Not running in QEMU with isa-debug-exit, so it has to be switched off by hand \n");
+    }
+}
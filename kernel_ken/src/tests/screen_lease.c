@@ -0,0 +1,43 @@
+#include "app.h"
+#include "kernel_ken.h"
+#include "ulib.h"
+#include "syscall.h"
+
+// Screen lease check. Takes the screen and animates a bar across it by writing the text buffer directly, makes
+// sure a forked child can't take the screen while it's held, then gives it back. Whatever the kernel printed in
+// the meantime should reappear once it's released.
+
+#define FRAMES 200
+#define FRAME_MS 10
+
+void my_app()
+{
+    uint16_t *screen = screen_acquire();
+    assert(screen);
+    // Asking again is fine, and gets the same mapping.
+    assert(screen_acquire() == screen);
+
+    int pid = fork();
+    if(pid == 0){
+        // The child only has a private copy of the page, not the screen.
+        assert(screen_acquire() == NULL);
+        assert(screen_release() == -1);
+        exit();
+    }
+    syscall_join_impl(pid);
+
+    for(int frame = 0; frame < FRAMES; frame++){
+        int column = frame % SCREEN_WIDTH;
+        for(int y = 0; y < SCREEN_HEIGHT; y++){
+            for(int x = 0; x < SCREEN_WIDTH; x++){
+                int colour = x == column ? COLOUR_LIGHT_MAGENTA : COLOUR_BLUE;
+                screen[y * SCREEN_WIDTH + x] = SCREEN_CELL(' ', COLOUR_WHITE, colour);
+            }
+        }
+        msleep(FRAME_MS);
+    }
+
+    assert(screen_release() == 0);
+    assert(screen_release() == -1);
+    printf("Screen lease: OK \n");
+}
@@ -0,0 +1,28 @@
+#include "app.h"
+#include "kernel_ken.h"
+#include "ulib.h"
+
+// Serial console check. Run QEMU with -serial stdio (or -nographic): everything printed shows up on the host, and
+// anything typed there for the next few seconds is echoed back, on the screen and over the serial port.
+
+#define ECHO_SECONDS 10
+#define POLL_MS 20
+
+void my_app()
+{
+    printf("Type something into the serial console. Echoing for %u seconds... \n", ECHO_SECONDS);
+
+    char buffer[64];
+    uint32_t deadline = monotonic_ms() + ECHO_SECONDS * 1000;
+    while((int32_t)(monotonic_ms() - deadline) < 0){
+        int n = serial_read(buffer, sizeof(buffer) - 1);
+        if(n > 0){
+            buffer[n] = '\0';
+            print(buffer);
+            // Echo straight away, not just once a newline comes in.
+            stdout_flush();
+        }
+        msleep(POLL_MS);
+    }
+    printf("\nDone. \n");
+}
@@ -0,0 +1,66 @@
+#include "app.h"
+#include "kernel_ken.h"
+#include "ulib.h"
+#include "syscall.h"
+
+// A small producer/consumer run with every tracepoint on. Two producers write numbered items into a pipe and signal
+// a semaphore for each one; the consumer waits on it, reads the item back and checks it. Afterwards the trace is
+// dumped over serial and QEMU is switched off. trace_qemu.sh at the root runs this and converts the dump with
+// host/trace_decode.c into a JSON file for chrome://tracing or ui.perfetto.dev, where the blocking on the semaphore,
+// the context switches and the pipe filling and draining show up on a timeline.
+//
+// The run is kept short enough that no CPU's ring fills up.
+
+#define PRODUCERS           2
+#define ITEMS_PER_PRODUCER  100
+
+static void producer(int pipe, int items, uint32_t id)
+{
+    for(uint32_t i = 0; i < ITEMS_PER_PRODUCER; i++){
+        uint32_t item[2] = {id, i};
+        while(write(pipe, item, sizeof(item)) == 0){
+            yield();
+        }
+        signal(items);
+    }
+}
+
+void my_app()
+{
+    int pipe = open_pipe();
+    int items = open_sem(0);
+    int pids[PRODUCERS];
+
+    trace_enable(TRACE_ALL);
+
+    for(uint32_t p = 0; p < PRODUCERS; p++){
+        pids[p] = fork();
+        if(pids[p] == 0){
+            producer(pipe, items, p);
+            exit();
+        }
+    }
+
+    uint32_t next[PRODUCERS] = {0};
+    for(int i = 0; i < PRODUCERS * ITEMS_PER_PRODUCER; i++){
+        wait(items);
+        uint32_t item[2];
+        assert(read(pipe, item, sizeof(item)) == sizeof(item));
+        assert(item[0] < PRODUCERS);
+        // A producer's items come out in the order it wrote them.
+        assert(item[1] == next[item[0]]);
+        next[item[0]]++;
+    }
+    for(int p = 0; p < PRODUCERS; p++){
+        syscall_join_impl(pids[p]);
+    }
+
+    uint32_t records = trace_dump();
+    printf("%u trace records\n", records);
+    close_sem(items);
+    close_pipe(pipe);
+
+    if(qemu_exit(0) != 0){
+        printf("Not running in QEMU with isa-debug-exit, so it has to be switched off by hand \n");
+    }
+}
@@ -4,32 +4,270 @@
 #include "timer.h"
 #include "isr.h"
 #include "task.h"
+#include "smp.h"
+#include "clock.h"
+#include "apic.h"
+#include "monitor.h"
 
-extern uint32_t read_eip();
+// Largest count the PIT can be programmed with, and how long that takes.
+#define PIT_MAX_COUNT           0xFFFF
+#define PIT_MAX_NS              54924000
+
+#define PIT_MODE_ONE_SHOT       0x30
+#define PIT_MODE_RATE_GENERATOR 0x34
+
+static volatile uint32_t ticks = 0;
+static uint32_t tick_divisor = 0;
+// The count the PIT was last loaded with, or 0 once a one-shot count has been accounted for.
+static uint32_t programmed_count = 0;
+static int oneshot = FALSE;
+
+// The monotonic clock. The fraction keeps the rounding error of each tick from adding up into drift.
+static uint64_t clock_ns = 0;
+static uint32_t clock_ns_fraction = 0;
+static uint64_t next_broadcast_ns = 0;
+
+// Set once every CPU's tick comes from its own local APIC timer.
+static int lapic_timer = FALSE;
+static int tsc_deadline = FALSE;
+static uint32_t tick_frequency = 0;
+static uint32_t lapic_counts_per_ms = 0;
+
+/// Loads PIT channel 0 with a mode command byte and a count.
+static void pit_program(uint8_t command, uint32_t count)
+{
+    // Send the command byte.
+    outb(0x43, command);
+
+    // Count has to be sent byte-wise, so split here into upper/lower bytes.
+    uint8_t l = (uint8_t)(count & 0xFF);
+    uint8_t h = (uint8_t)( (count>>8) & 0xFF );
+
+    // Send the count.
+    outb(0x40, l);
+    outb(0x40, h);
+
+    programmed_count = count;
+}
+
+/// \returns what's left of the count channel 0 is working through
+static uint32_t pit_read_count()
+{
+    // Latch the count first, so the two bytes go together.
+    outb(0x43, 0x00);
+    uint32_t l = inb(0x40);
+    uint32_t h = inb(0x40);
+    return l | (h << 8);
+}
+
+/// Moves the monotonic clock forward by some number of PIT input clock cycles.
+static void clock_advance(uint32_t counts)
+{
+    uint64_t delta = (uint64_t)counts * PIT_NS_PER_COUNT_FP;
+    uint32_t fraction = clock_ns_fraction + (uint32_t)delta;
+    clock_ns += (delta >> 32) + (fraction < clock_ns_fraction ? 1 : 0);
+    clock_ns_fraction = fraction;
+}
+
+/// Adds the part of the current PIT count that has already gone by to the clock, before the PIT is reloaded.
+static void clock_catch_up()
+{
+    uint32_t count = pit_read_count();
+    if(programmed_count && count <= programmed_count){
+        clock_advance(programmed_count - count);
+    }
+}
+
+/// The timer softirq: everything a timer interrupt leads to beyond counting it, whichever timer it came from.
+static void timer_softirq()
+{
+    uint64_t now = clock_monotonic_ns();
+    sched_wake_sleepers(now);
+    monitor_flush();
+
+    // Only the bootstrap processor gets PIT interrupts, so it hands out the other CPUs' time slices too.
+    if(!lapic_timer && now >= next_broadcast_ns){
+        next_broadcast_ns = now + TIME_QUANTUM * NS_PER_MS;
+        smp_broadcast_reschedule();
+    }
+
+    cpu_t *cpu = this_cpu();
+    if(cpu->current == cpu->idle){
+        // Set the timer up for whatever comes next, then run anything that has just woken up.
+        sched_program_tick();
+        cpu->need_resched = TRUE;
+    } else if(now >= cpu->next_quantum){
+        cpu->next_quantum = now + TIME_QUANTUM * NS_PER_MS;
+        if(lapic_timer){
+            smp_wake_idle_cpus();
+        }
+        cpu->need_resched = TRUE;
+    }
+}
 
 static void timer_callback(registers_t *regs)
 {
-    run_scheduler(TRUE, TRUE, TRUE);
+    clock_advance(programmed_count);
+    if(oneshot){
+        // The one-shot count is over, and nothing new has been loaded to count down from.
+        programmed_count = 0;
+    }
+    ticks++;
+    softirq_raise(SOFTIRQ_TIMER);
+}
+
+static void lapic_timer_callback(registers_t *regs)
+{
+    ticks++;
+    softirq_raise(SOFTIRQ_TIMER);
+}
+
+uint32_t timer_get_ticks()
+{
+    return ticks;
+}
+
+uint64_t timer_monotonic_ns()
+{
+    // A timer interrupt half way through would tear the 64 bit read.
+    uint32_t flags = irq_save();
+    uint64_t ns = clock_ns;
+    irq_restore(flags);
+    return ns;
+}
+
+/// timer_set_next_event() for the local APIC timer of the CPU executing this.
+static void lapic_set_next_event(uint64_t deadline)
+{
+    if(!deadline){
+        // The TSC keeps the time, so there's no reason to interrupt this CPU at all.
+        lapic_timer_stop();
+        return;
+    }
+    if(tsc_deadline){
+        lapic_timer_set_tsc_deadline(clock_ns_to_tsc(deadline));
+        return;
+    }
+
+    uint64_t now = clock_monotonic_ns();
+    uint64_t delta = deadline > now ? deadline - now : 0;
+    // A deadline further off than this just gets an early interrupt, which sets the timer again.
+    delta = MIN(delta, NS_PER_SECOND);
+    lapic_timer_start(LAPIC_TIMER_ONE_SHOT, udiv64(delta * lapic_counts_per_ms, NS_PER_MS) + 1);
+}
+
+/// timer_set_next_event() for the PIT.
+static void pit_set_next_event(uint64_t deadline)
+{
+    clock_catch_up();
+
+    uint32_t count = PIT_MAX_COUNT;
+    if(deadline){
+        uint64_t now = clock_monotonic_ns();
+        uint64_t delta = deadline > now ? deadline - now : 0;
+        if(delta < PIT_MAX_NS){
+            // Round up, so the deadline has definitely passed by the time the interrupt arrives.
+            count = MIN(udiv64(delta * PIT_FREQUENCY, NS_PER_SECOND) + 1, PIT_MAX_COUNT);
+        }
+    }
+
+    oneshot = TRUE;
+    pit_program(PIT_MODE_ONE_SHOT, count);
+}
+
+/// timer_restart_tick() for the PIT.
+static void pit_restart_tick()
+{
+    if(!oneshot){
+        return;
+    }
+    clock_catch_up();
+    oneshot = FALSE;
+    pit_program(PIT_MODE_RATE_GENERATOR, tick_divisor);
+}
+
+void timer_set_next_event(uint64_t deadline)
+{
+    // System calls run with interrupts enabled. A timer interrupt while the PIT is being reloaded would count
+    // the same cycles twice.
+    uint32_t flags = irq_save();
+    if(lapic_timer){
+        lapic_set_next_event(deadline);
+    } else {
+        pit_set_next_event(deadline);
+    }
+    irq_restore(flags);
+}
+
+void timer_restart_tick()
+{
+    uint32_t flags = irq_save();
+    if(lapic_timer){
+        lapic_timer_start(LAPIC_TIMER_PERIODIC, lapic_counts_per_ms * 1000 / tick_frequency);
+    } else {
+        pit_restart_tick();
+    }
+    irq_restore(flags);
+}
+
+void timer_cpu_idle()
+{
+    if(lapic_timer){
+        lapic_timer_stop();
+    } else {
+        timer_restart_tick();
+    }
+}
+
+void timer_work_queued()
+{
+    if(!lapic_timer){
+        timer_restart_tick();
+    }
+}
+
+void timer_init_lapic()
+{
+    if(!lapic_base || !clock_uses_tsc()){
+        return;
+    }
+
+    // See how far the local APIC timer counts down in 10ms. Its rate is the bus clock, which nothing else tells us.
+    lapic_timer_start(LAPIC_TIMER_ONE_SHOT | LAPIC_LVT_MASKED, 0xFFFFFFFF);
+    uint64_t start = clock_monotonic_ns();
+    while(clock_monotonic_ns() - start < 10 * NS_PER_MS);
+    uint32_t counted = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+    lapic_timer_stop();
+
+    lapic_counts_per_ms = counted / 10;
+    if(lapic_counts_per_ms * 1000 / tick_frequency == 0){
+        return;
+    }
+    tsc_deadline = lapic_tsc_deadline_supported();
+    register_interrupt_handler(APIC_TIMER, &lapic_timer_callback);
+
+    asm volatile("cli" : : : "memory");
+    irq_set_masked(0, TRUE);
+    lapic_timer = TRUE;
+    oneshot = FALSE;
+    // The other CPUs are idle, and start their own timers once they have something to run.
+    timer_restart_tick();
+    asm volatile("sti" : : : "memory");
 }
 
 void init_timer(uint32_t frequency)
 {
     // Firstly, register our timer callback.
     register_interrupt_handler(IRQ0, &timer_callback);
+    register_softirq(SOFTIRQ_TIMER, &timer_softirq);
 
     // The value we send to the PIT is the value to divide it's input clock
-    // (1193180 Hz) by, to get our required frequency. Important to note is
+    // (1193182 Hz) by, to get our required frequency. Important to note is
     // that the divisor must be small enough to fit into 16-bits.
-    uint32_t divisor = 1193180 / frequency;
-
-    // Send the command byte.
-    outb(0x43, 0x36);
-
-    // Divisor has to be sent byte-wise, so split here into upper/lower bytes.
-    uint8_t l = (uint8_t)(divisor & 0xFF);
-    uint8_t h = (uint8_t)( (divisor>>8) & 0xFF );
+    // The tick is independent of the time slice (TIME_QUANTUM), which is measured on the monotonic clock.
+    tick_frequency = frequency;
+    tick_divisor = PIT_FREQUENCY / frequency;
 
-    // Send the frequency divisor.
-    outb(0x40, l);
-    outb(0x40, h);
+    // Mode 2 (rate generator) reloads the count every time it runs out, which gives a periodic interrupt.
+    pit_program(PIT_MODE_RATE_GENERATOR, tick_divisor);
 }
@@ -6,6 +6,40 @@
 
 #include "common.h"
 
+// The PIT's input clock, in Hz.
+#define PIT_FREQUENCY           1193182
+// Nanoseconds per PIT input clock cycle, as a 32.32 fixed point number.
+#define PIT_NS_PER_COUNT_FP     3599591090043ULL
+
 void init_timer(uint32_t frequency);
 
+/// \returns the number of timer interrupts since init_timer()
+uint32_t timer_get_ticks();
+
+/// \returns nanoseconds since init_timer(). This is counted in PIT input clock cycles, so it doesn't drift
+/// however the PIT is programmed, but it only moves forward on timer interrupts. It's the fallback clocksource
+/// for clock_monotonic_ns(), which is what everything else should use.
+uint64_t timer_monotonic_ns();
+
+/// Moves every CPU's tick over to its local APIC timer, and masks the PIT. Only happens if there's a local APIC and
+/// the TSC is the clocksource, since the PIT's interrupts are what keep the time otherwise. Call after smp_init().
+void timer_init_lapic();
+
+/// Switches the timer to one-shot mode, for when every CPU is idle. The next interrupt arrives at deadline (in
+/// nanoseconds on clock_monotonic_ns()), or earlier if that's further off than the timer can count.
+/// With the PIT (which can only count to about 55ms), deadline == 0 still gets an interrupt that late to keep the
+/// clock going. With the local APIC timer, it means no interrupt at all.
+void timer_set_next_event(uint64_t deadline);
+
+/// Goes back to the periodic tick on this CPU, since it has something to run.
+void timer_restart_tick();
+
+/// This CPU has nothing to run, but others do. A local APIC timer is just stopped, while the PIT has to carry on
+/// ticking for the other CPUs.
+void timer_cpu_idle();
+
+/// Called when a task is queued. The PIT has to be ticking again for it, but a CPU with its own local APIC timer
+/// restarts that itself once it leaves its idle task.
+void timer_work_queued();
+
 #endif
@@ -0,0 +1,66 @@
+// trace.c -- Static tracepoints.
+
+#include "trace.h"
+#include "ring.h"
+#include "smp.h"
+#include "clock.h"
+
+// Each CPU's records. Anything running on the CPU can add to them, with interrupts off while it does, and
+// trace_read_impl() takes them off from any CPU.
+static ring_t rings[MAX_CPUS];
+volatile uint32_t trace_mask = 0;
+
+void trace_record(uint32_t event, uint32_t a0, uint32_t a1, uint32_t a2)
+{
+    uint32_t flags = irq_save();
+    cpu_t *cpu = this_cpu();
+    trace_record_t *record = ring_reserve(&rings[cpu->index]);
+    if(!record){
+        irq_restore(flags);
+        return;
+    }
+
+    record->tsc = read_tsc();
+    record->pid = cpu->current ? cpu->current->id : 0;
+    record->event = event;
+    record->cpu = cpu->index;
+    record->reserved = 0;
+    record->args[0] = a0;
+    record->args[1] = a1;
+    record->args[2] = a2;
+    ring_commit(&rings[cpu->index]);
+    irq_restore(flags);
+}
+
+/// Pairs the TSC up with the monotonic clock, for the decoder.
+static void trace_clock()
+{
+    uint64_t ns = clock_monotonic_ns();
+    trace_record(TRACE_CLOCK, (uint32_t)ns, (uint32_t)(ns >> 32), 0);
+}
+
+int trace_enable_impl(uint32_t mask)
+{
+    mask &= TRACE_ALL;
+    if(!mask){
+        trace_mask = 0;
+        trace_clock();
+        return 0;
+    }
+
+    trace_mask = 0;
+    for(uint32_t i = 0; i < cpu_count; i++){
+        ring_reset(&rings[i], TRACE_RECORDS_PER_CPU, sizeof(trace_record_t));
+    }
+    trace_clock();
+    trace_mask = mask;
+    return 0;
+}
+
+int trace_read_impl(trace_record_t *records, uint32_t max)
+{
+    if(!records){
+        return -1;
+    }
+    return ring_read_cpus(rings, records, max, "trace");
+}
@@ -0,0 +1,72 @@
+// trace.h -- Static tracepoints. A handful of places in the kernel (context switches, system calls, frames, heaps,
+//            semaphores and pipes) call TRACE(), which costs one test of trace_mask while tracing is off. While it's on,
+//            each one appends a fixed size binary record to its CPU's ring, with the TSC, the running task and up to
+//            three arguments. host/trace_decode.c turns a dump of the records into a Chrome trace.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "common.h"
+
+// Records each CPU holds before it starts dropping them.
+#define TRACE_RECORDS_PER_CPU   2048
+
+/// What a record is for, and what its arguments mean.
+enum trace_event
+{
+    TRACE_CLOCK = 0,        // a0, a1: clock_monotonic_ns() at the record's TSC, low and high half. Written when
+                            // tracing starts and stops, so that TSCs can be turned into time.
+    TRACE_SWITCH,           // a0: task switched away from (0 is an idle task). a1: task switched to. a2: FALSE if
+                            // the task switched away from exited, in which case a0 is 0 too
+    TRACE_SYSCALL_ENTER,    // a0: system call number. a1: its first argument
+    TRACE_SYSCALL_EXIT,     // a0: system call number. a1: what it returned
+    TRACE_FRAME_ALLOC,      // a0: physical address of the frame
+    TRACE_FRAME_FREE,       // a0: physical address of the frame
+    TRACE_HEAP_EXPAND,      // a0: heap's start address. a1: old end address. a2: new end address
+    TRACE_HEAP_CONTRACT,    // a0: heap's start address. a1: old end address. a2: new end address
+    TRACE_SEM_BLOCK,        // a0: semaphore. a1: its counter, after the wait
+    TRACE_SEM_WAKE,         // a0: semaphore. a1: task woken up
+    TRACE_PIPE_WRITE,       // a0: pipe. a1: bytes written. a2: bytes in the pipe afterwards
+    TRACE_PIPE_READ,        // a0: pipe. a1: bytes read. a2: bytes in the pipe afterwards
+    TRACE_EVENT_COUNT
+};
+
+// trace_enable() masks: one bit per event, or all of them. TRACE_CLOCK is always recorded.
+#define TRACE_BIT(event)        (1u << (event))
+#define TRACE_ALL               (TRACE_BIT(TRACE_EVENT_COUNT) - 1)
+
+typedef struct
+{
+    uint64_t tsc;
+    uint32_t pid;           // The task running on the CPU when the record was made
+    uint16_t event;         // One of enum trace_event
+    uint8_t cpu;
+    uint8_t reserved;
+    uint32_t args[3];
+} trace_record_t;
+
+/// Events being recorded, as TRACE_BIT()s. 0 while tracing is off.
+extern volatile uint32_t trace_mask;
+
+/// Records event, if it's being traced.
+#define TRACE(event, a0, a1, a2) \
+    do { \
+        if(trace_mask & TRACE_BIT(event)){ \
+            trace_record((event), (uint32_t)(a0), (uint32_t)(a1), (uint32_t)(a2)); \
+        } \
+    } while(0)
+
+/// Appends a record to this CPU's ring, or counts it as dropped if the ring is full. It doesn't look at trace_mask;
+/// TRACE() does that first.
+void trace_record(uint32_t event, uint32_t a0, uint32_t a1, uint32_t a2);
+
+/// Starts recording the events in mask, throwing away any records not yet read, or stops recording if mask is 0.
+/// Either way a TRACE_CLOCK record is written.
+/// \returns 0
+int trace_enable_impl(uint32_t mask);
+
+/// Moves up to max records, from every CPU, into records. They're in order for each CPU, but not across CPUs.
+/// \returns how many were moved, or -1 if records is NULL
+int trace_read_impl(trace_record_t *records, uint32_t max);
+
+#endif
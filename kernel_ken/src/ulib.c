@@ -1,5 +1,305 @@
 #include "ulib.h"
 #include "kernel_ken.h"
+#include "syscall.h"
+#include "serial.h"
+
+/// Where every task made by thread_create() or spawn() starts out, so that returning from entry exits it.
+static void task_start(void (*entry)(void *arg), void *arg)
+{
+    entry(arg);
+    exit();
+}
+
+int thread_create(void (*entry)(void *arg), void *arg, uint32_t stack_size)
+{
+    return syscall_thread_create_impl(task_start, entry, arg, stack_size);
+}
+
+int thread_join(int tid)
+{
+    return syscall_thread_join_impl(tid);
+}
+
+int spawn(void (*entry)(void *arg), void *arg, int priority)
+{
+    return syscall_spawn_impl(task_start, entry, arg, priority);
+}
+
+void idle_report()
+{
+    syscall_idle_report_impl();
+}
+
+int monitor_blit(const uint16_t *cells, const screen_rect_t *dirty)
+{
+    return syscall_monitor_blit_impl(cells, dirty);
+}
+
+uint16_t *screen_acquire()
+{
+    return (uint16_t *)syscall_screen_acquire_impl();
+}
+
+int screen_release()
+{
+    int result;
+    while((result = syscall_screen_release_impl()) == 1){
+        syscall_yield_impl();
+    }
+    return result;
+}
+
+int serial_read(void *buf, uint32_t nbyte)
+{
+    return syscall_serial_read_impl(buf, nbyte);
+}
+
+int dmesg(char *buf, uint32_t size, uint32_t *cursor)
+{
+    return syscall_dmesg_impl(buf, size, cursor);
+}
+
+int klog_set_console_level(int level)
+{
+    return syscall_klog_set_console_level_impl(level);
+}
+
+int bench_kmalloc(uint32_t ops, uint32_t max_size, uint64_t *cycles)
+{
+    return syscall_bench_kmalloc_impl(ops, max_size, cycles);
+}
+
+int qemu_exit(uint32_t code)
+{
+    stdout_flush();
+    return syscall_qemu_exit_impl(code);
+}
+
+int profile_start(uint32_t hz)
+{
+    return syscall_profile_start_impl(hz);
+}
+
+void profile_stop()
+{
+    syscall_profile_start_impl(0);
+}
+
+int profile_read(profile_sample_t *samples, uint32_t max)
+{
+    return syscall_profile_read_impl(samples, max);
+}
+
+int ksym_name(uint32_t address, char *buf, uint32_t size)
+{
+    return syscall_ksym_name_impl(address, buf, size);
+}
+
+// Distinct stacks profile_dump() counts. Samples with any other stack are all counted as "[other]".
+#define PROFILE_DUMP_STACKS     1024
+#define PROFILE_DUMP_CHUNK      64
+#define PROFILE_LINE_SIZE       1024
+// Bytes the serial port sends per second, with a start and a stop bit around each one.
+#define SERIAL_BYTES_PER_SECOND (SERIAL_BAUD / 10)
+
+typedef struct
+{
+    profile_sample_t sample;
+    uint32_t count;
+} profile_count_t;
+
+static int profile_same_stack(profile_sample_t *a, profile_sample_t *b)
+{
+    if(a->pid != b->pid || a->user != b->user || a->depth != b->depth){
+        return FALSE;
+    }
+    for(uint32_t i = 0; i < a->depth; i++){
+        if(a->stack[i] != b->stack[i]){
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// Bytes print_line_paced() lets out at once. Well under the serial port's transmit buffer.
+#define PACED_BURST             1024
+
+/// Prints one line, and every PACED_BURST bytes or so, sleeps for as long as the serial port takes to send them.
+static void print_line_paced(const char *line)
+{
+    static uint32_t unpaced = 0;
+    printf("%s\n", line);
+    unpaced += strlen(line) + 1;
+    if(unpaced >= PACED_BURST){
+        stdout_flush();
+        msleep(1 + unpaced * 1000 / SERIAL_BYTES_PER_SECOND);
+        unpaced = 0;
+    }
+}
+
+uint32_t profile_dump()
+{
+    profile_sample_t *chunk = alloc(PROFILE_DUMP_CHUNK * sizeof(profile_sample_t), FALSE);
+    profile_count_t *counts = alloc(PROFILE_DUMP_STACKS * sizeof(profile_count_t), FALSE);
+    char *line = alloc(PROFILE_LINE_SIZE, FALSE);
+    char name[64];
+    uint32_t distinct = 0;
+    uint32_t other = 0;
+    uint32_t total = 0;
+
+    int got;
+    while((got = profile_read(chunk, PROFILE_DUMP_CHUNK)) > 0){
+        for(int i = 0; i < got; i++){
+            profile_sample_t *sample = &chunk[i];
+            // Every address in a function is the same for a profile, so fold them all into the function's start.
+            for(uint32_t j = 0; j < sample->depth; j++){
+                int offset = ksym_name(sample->stack[j], name, sizeof(name));
+                if(offset > 0){
+                    sample->stack[j] -= offset;
+                }
+            }
+
+            uint32_t k = 0;
+            while(k < distinct && !profile_same_stack(&counts[k].sample, sample)){
+                k++;
+            }
+            if(k < distinct){
+                counts[k].count++;
+            } else if(distinct < PROFILE_DUMP_STACKS){
+                counts[distinct].sample = *sample;
+                counts[distinct].count = 1;
+                distinct++;
+            } else {
+                other++;
+            }
+            total++;
+        }
+    }
+
+    for(uint32_t k = 0; k < distinct; k++){
+        profile_sample_t *sample = &counts[k].sample;
+        int length = snprintf(line, PROFILE_LINE_SIZE, "PROFILE pid%u;%s", sample->pid,
+                              sample->user ? "[user]" : "[kernel]");
+        // Outermost caller first, the way flamegraph.pl wants them.
+        for(int j = sample->depth - 1; j >= 0 && length < PROFILE_LINE_SIZE; j--){
+            if(ksym_name(sample->stack[j], name, sizeof(name)) >= 0){
+                length += snprintf(line + length, PROFILE_LINE_SIZE - length, ";%s", name);
+            } else {
+                length += snprintf(line + length, PROFILE_LINE_SIZE - length, ";%x", sample->stack[j]);
+            }
+        }
+        if(length < PROFILE_LINE_SIZE){
+            snprintf(line + length, PROFILE_LINE_SIZE - length, " %u", counts[k].count);
+        }
+        print_line_paced(line);
+    }
+    if(other > 0){
+        snprintf(line, PROFILE_LINE_SIZE, "PROFILE [other] %u", other);
+        print_line_paced(line);
+    }
+
+    free(line);
+    free(counts);
+    free(chunk);
+    return total;
+}
+
+int trace_enable(uint32_t mask)
+{
+    return syscall_trace_enable_impl(mask);
+}
+
+void trace_disable()
+{
+    syscall_trace_enable_impl(0);
+}
+
+int trace_read(trace_record_t *records, uint32_t max)
+{
+    return syscall_trace_read_impl(records, max);
+}
+
+#define TRACE_DUMP_CHUNK        64
+
+uint32_t trace_dump()
+{
+    static const char digits[] = "0123456789abcdef";
+    trace_disable();
+
+    trace_record_t *chunk = alloc(TRACE_DUMP_CHUNK * sizeof(trace_record_t), FALSE);
+    char line[8 + 2 * sizeof(trace_record_t)] = "TRACE ";
+    uint32_t total = 0;
+    int got;
+    while((got = trace_read(chunk, TRACE_DUMP_CHUNK)) > 0){
+        for(int i = 0; i < got; i++){
+            // The record's bytes as they are in memory, so the decoder sees exactly what the kernel wrote.
+            uint8_t *bytes = (uint8_t *)&chunk[i];
+            char *out = line + 6;
+            for(uint32_t j = 0; j < sizeof(trace_record_t); j++){
+                *out++ = digits[bytes[j] >> 4];
+                *out++ = digits[bytes[j] & 0xF];
+            }
+            *out = '\0';
+            print_line_paced(line);
+        }
+        total += got;
+    }
+    free(chunk);
+    return total;
+}
+
+void syscall_stats_enable(int enable)
+{
+    syscall_syscall_stats_enable_impl(enable);
+}
+
+int syscall_stats(uint32_t pid, syscall_stat_t *stats, uint32_t max)
+{
+    return syscall_syscall_stats_impl(pid, stats, max);
+}
+
+void syscall_report(uint32_t pid, uint32_t top)
+{
+    stdout_flush();
+    syscall_syscall_report_impl(pid, top);
+}
+
+void irq_report()
+{
+    syscall_irq_report_impl();
+}
+
+void msleep(uint32_t ms)
+{
+    syscall_msleep_impl(ms);
+}
+
+void usleep(uint32_t us)
+{
+    syscall_usleep_impl(us);
+}
+
+void sleep_until(uint32_t deadline_ms)
+{
+    syscall_sleep_until_impl(deadline_ms);
+}
+
+uint32_t monotonic_ms()
+{
+    return (uint32_t)syscall_monotonic_ms_impl();
+}
+
+int clock_gettime(int clock_id, timespec_t *ts)
+{
+    return syscall_clock_gettime_impl(clock_id, ts);
+}
+
+uint64_t monotonic_ns()
+{
+    timespec_t ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SECOND + ts.tv_nsec;
+}
 
 void insertion_sort(void **items, uint32_t size, int (*comparator)(void *a, void *b))
 {
@@ -3,14 +3,166 @@
 
 #include "print.h"
 #include "algorithm.h"
+#include "clock.h"
+#include "monitor.h"
+#include "profile.h"
+#include "trace.h"
+#include "syscall.h"
 
-/// Functions the same as C's printf, but on a limited number of types in the formatter. Supported format types include
-/// at least the following: %x %d %u %s %c %f %e and %%
+/// Functions the same as C's printf, with the conversions listed at __vsnprintf__internal() in print.h: flags, widths
+/// and precisions, and %d %i %u %x %X %p %c %s %f %e %% with the h, hh, l, ll and z modifiers. Unlike C's, %x prints a 0x.
 #define printf(fmt, ...) __user__printf__internal((uint32_t)fmt, ##__VA_ARGS__)
-/// Functions the same as C's snprintf, but on a limited number of types in the formatter. Supported format types include
-/// at least the following: %x %d %u %s %c %f %e and %%
+/// Functions the same as C's snprintf, with the same conversions as printf().
 #define snprintf(buf,size,fmt,...) __snprintf__internal((uint32_t)buf, (uint32_t)size, (uint32_t)fmt, ##__VA_ARGS__)
 
+/// Starts a thread that runs entry(arg) in the address space of the calling process. It shares the heap, semaphores
+/// and pipes of the caller, but has its own stack. The thread exits when entry returns (or when it calls exit()).
+/// \param [in] entry the function to run in the new thread
+/// \param [in] arg passed to entry
+/// \param [in] stack_size size of the thread's stack in bytes, or 0 for the default. It's allocated on the heap.
+///                         At most THREAD_STACK_MAX.
+/// \returns the ID of the new thread, or -1 if stack_size is too big. The ID which works with getpid()/setpriority()/thread_join()
+int thread_create(void (*entry)(void *arg), void *arg, uint32_t stack_size);
+
+/// Blocks until the thread tid has exited.
+/// \param [in] tid a thread of the calling process, as returned by thread_create()
+/// \returns 0 once the thread has exited, or -1 if tid isn't a thread of this process or has already been joined
+int thread_join(int tid);
+
+/// Starts a new process that runs entry(arg). Unlike fork(), nothing is copied from the caller: the process starts
+/// with an empty heap and a fresh stack, so arg must not point into the caller's heap or stack. It does get the
+/// caller's semaphores and pipes. The process exits when entry returns (or when it calls exit()).
+/// \param [in] entry the function to run in the new process
+/// \param [in] arg passed to entry
+/// \param [in] priority initial priority of the process, from 1 to 10
+/// \returns the PID of the new process, or 0 if priority is invalid
+int spawn(void (*entry)(void *arg), void *arg, int priority);
+
+/// Prints how much of the time since boot each CPU has spent halted in its idle task.
+void idle_report();
+
+/// Copies cells (a whole screen of SCREEN_CELL()s, SCREEN_WIDTH per row) to the screen in one system call, instead
+/// of one per cell.
+/// \param [in] dirty the part of cells that changed, or NULL to copy all of it
+/// \returns 0 on success, -1 if cells is NULL or dirty has a negative width or height
+int monitor_blit(const uint16_t *cells, const screen_rect_t *dirty);
+
+/// Takes over the screen. The text buffer is mapped into this process, so cells can be written straight to it, with
+/// no system call per frame. Kernel output is held back until screen_release() (or the process exits).
+/// \returns the text buffer, SCREEN_WIDTH by SCREEN_HEIGHT cells, or NULL if another process has the screen
+uint16_t *screen_acquire();
+
+/// Gives the screen back to the kernel. It's only taken back while no other thread of this process is running on
+/// another CPU, so this yields until that's the case.
+/// \returns 0 on success, -1 if this process didn't have it
+int screen_release();
+
+/// Copies up to nbyte bytes received on COM1 into buf. Never waits.
+/// \returns how many bytes were copied
+int serial_read(void *buf, uint32_t nbyte);
+
+/// Copies kernel log messages into buf, one line each: "[seconds.microseconds] LEVEL: message". buf is always null
+/// terminated.
+/// \param [in,out] cursor sequence number of the next message to read; start from 0 and pass it back each time to
+/// carry on. If NULL, messages are drained: each is only returned once, to whoever asks first.
+/// \returns how many bytes were copied, or -1 if buf is NULL or size is 0
+int dmesg(char *buf, uint32_t size, uint32_t *cursor);
+
+/// Sets which kernel log messages are also printed to the console: level (KLOG_ERR 0 to KLOG_DEBUG 3) and anything
+/// more severe.
+/// \returns the previous level, or -1 if level isn't valid
+int klog_set_console_level(int level);
+
+/// Times ops allocations and frees of up to max_size bytes on the kernel heap, which can't be done from user mode.
+/// \param [out] cycles TSC cycles the ops took
+/// \returns 0 on success, -1 if an argument is invalid: ops over 20000, or max_size 0 or over 4096
+int bench_kmalloc(uint32_t ops, uint32_t max_size, uint64_t *cycles);
+
+/// Flushes stdout, waits for the serial port to catch up and exits QEMU with status (code << 1) | 1. QEMU has to be
+/// started with "-device isa-debug-exit,iobase=0xf4,iosize=0x04", as bench_qemu.sh does.
+/// \returns -1 if it isn't, in which case nothing happens
+int qemu_exit(uint32_t code);
+
+/// Starts the sampling profiler at hz samples per second on each CPU (at most TICKS_PER_SECOND), discarding any
+/// samples that haven't been read yet.
+/// \returns 0 on success, -1 if hz is too high
+int profile_start(uint32_t hz);
+
+/// Stops the sampling profiler. Samples already taken can still be read.
+void profile_stop();
+
+/// Moves up to max of the profiler's samples into samples.
+/// \returns how many were moved
+int profile_read(profile_sample_t *samples, uint32_t max);
+
+/// Looks address up in the kernel image's symbol table, and copies the name of the function it's in into buf.
+/// \returns how far address is into the function, or -1 if it isn't in one
+int ksym_name(uint32_t address, char *buf, uint32_t size);
+
+/// Reads every sample the profiler has and prints them as folded stacks, one "PROFILE <stack> <count>" line per
+/// distinct stack, where stack is "pid<N>;[user] or [kernel];outermost function;...;innermost function". The lines are
+/// paced to the serial port's speed so none get dropped. host/profile_report.c turns them into a flat profile or the
+/// input for flamegraph.pl.
+/// \returns how many samples were printed
+uint32_t profile_dump();
+
+/// Starts recording the tracepoints in mask (TRACE_BIT()s of enum trace_event, or TRACE_ALL), throwing away any
+/// records that haven't been read yet.
+/// \returns 0
+int trace_enable(uint32_t mask);
+
+/// Stops recording tracepoints. Records already made can still be read.
+void trace_disable();
+
+/// Moves up to max trace records into records.
+/// \returns how many were moved
+int trace_read(trace_record_t *records, uint32_t max);
+
+/// Stops tracing and prints every record over serial as a "TRACE <hex>" line, the record's bytes in memory order,
+/// paced to the serial port's speed. host/trace_decode.c turns a log of them into Chrome trace JSON.
+/// \returns how many records were printed
+uint32_t trace_dump();
+
+/// Starts (or with enable FALSE, stops) keeping counts for each task, as well as the ones for every task since boot.
+/// It's off at boot, so that tasks don't each carry a table of counts nobody reads.
+void syscall_stats_enable(int enable);
+
+/// Copies the kernel's counts for up to max system calls into stats, entry i for system call i.
+/// \param [in] pid a task to get the counts of (all 0 unless syscall_stats_enable() was on), or 0 for every task since
+/// boot
+/// \returns how many entries were filled in, or -1 if there's no task pid
+int syscall_stats(uint32_t pid, syscall_stat_t *stats, uint32_t max);
+
+/// Prints the top system calls, by the time spent in them, of task pid (or of every task since boot if pid is 0):
+/// their calls, errors, calls that returned 0, average cycles and latency percentiles.
+void syscall_report(uint32_t pid, uint32_t top);
+
+/// Prints the worst interrupt handling latencies seen since boot.
+void irq_report();
+
+/// Sleeps for at least ms milliseconds. The timer ticks every millisecond, so that's also its resolution.
+void msleep(uint32_t ms);
+
+/// Sleeps for at least us microseconds, rounded up to the next timer tick.
+void usleep(uint32_t us);
+
+/// Sleeps until monotonic_ms() reaches deadline_ms, or returns straight away if it already has (in the last 2^31 ms).
+/// A periodic task should add its period to the previous deadline (rather than to the current time), so that it
+/// never drifts.
+void sleep_until(uint32_t deadline_ms);
+
+/// \returns milliseconds since the timer was started, wrapping around to 0 every 2^32 ms (about 49.7 days). Compare
+/// two of them by their difference, (int32_t)(a - b), rather than directly.
+uint32_t monotonic_ms();
+
+/// Reads a clock into *ts. Only CLOCK_MONOTONIC (nanoseconds since boot, never going backwards) is supported.
+/// \returns 0 on success, -1 if clock_id or ts is invalid
+int clock_gettime(int clock_id, timespec_t *ts);
+
+/// \returns CLOCK_MONOTONIC in nanoseconds. This is the time base benchmarks should use, since it's the same one
+/// the kernel measures everything with.
+uint64_t monotonic_ns();
+
 /// Insertion sort an array of values. This functions on any generic type.
 /// \param [in] items array of generic type to sort
 /// \param [in] size the length of the elements array (or the number of elements to sort, if not the entire array)
@@ -0,0 +1,23 @@
+#!/bin/bash
+# Builds tests/profile.c in the profile build (-O2 with frame pointers), boots it headless in qemu and runs what it
+# prints on the serial port through host/profile_report.c: the flat profile goes to stdout, and the folded stacks go
+# to a file that flamegraph.pl takes as it is.
+# Usage: ./profile_qemu.sh [folded output, default profile.folded] [seconds before giving up, default 120]
+out=${1:-profile.folded}
+log=profile_serial.log
+
+make -s -C kernel_ken/src clean
+make -s -C kernel_ken/src PROFILE=profile APP=tests/profile.c || exit 1
+make -s -C kernel_ken/src profile_report || exit 1
+
+timeout ${2:-120} qemu-system-i386 -m 16M -smp 4 -kernel kernel_ken/src/kernel -display none -serial stdio \
+    -device isa-debug-exit,iobase=0xf4,iosize=0x04 | tr -d '\r' > $log
+status=${PIPESTATUS[0]}
+if [ $status -ne 1 ]; then
+    echo "qemu exited with status $status instead of through isa-debug-exit, see $log" >&2
+    exit 1
+fi
+
+kernel_ken/src/profile_report --folded $log > $out || exit 1
+kernel_ken/src/profile_report $log
+echo "Folded stacks are in $out (flamegraph.pl $out > profile.svg)"
@@ -1,4 +1,4 @@
 
 sudo ./update_floppy.sh
-sudo qemu-system-i386 -k en-us -fda floppy.img -m 16M
+sudo qemu-system-i386 -k en-us -fda floppy.img -m 16M -smp 4
 
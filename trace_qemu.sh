@@ -0,0 +1,22 @@
+#!/bin/bash
+# Builds tests/trace.c, a short producer/consumer run with every tracepoint on, boots it headless in qemu and decodes
+# the trace it dumps on the serial port into Chrome trace_event JSON. Open the result in chrome://tracing or
+# ui.perfetto.dev.
+# Usage: ./trace_qemu.sh [JSON output, default trace.json] [seconds before giving up, default 300]
+out=${1:-trace.json}
+log=trace_serial.log
+
+make -s -C kernel_ken/src clean
+make -s -C kernel_ken/src PROFILE=release APP=tests/trace.c || exit 1
+make -s -C kernel_ken/src trace_decode || exit 1
+
+timeout ${2:-300} qemu-system-i386 -m 16M -smp 4 -kernel kernel_ken/src/kernel -display none -serial stdio \
+    -device isa-debug-exit,iobase=0xf4,iosize=0x04 | tr -d '\r' > $log
+status=${PIPESTATUS[0]}
+if [ $status -ne 1 ]; then
+    echo "qemu exited with status $status instead of through isa-debug-exit, see $log" >&2
+    exit 1
+fi
+
+kernel_ken/src/trace_decode $log > $out || exit 1
+echo "$(grep -c '^TRACE ' $log) records decoded into $out"